@@ -45,10 +45,12 @@ int ack_jit(int m, int n) {
         Reg n_1 = backend->sub(builder, n, one, ND);
         Reg ack_inner_args_list[2] = {m, n_1};
         RegList ack_inner_args = {2, ack_inner_args_list};
-        Reg ack_inner = backend->call(builder, ack_fun, ack_inner_args, type(8), ack_types, &ack_cc.base, ND);
+        Reg ack_inner_discards_list[3] = {m, n, n_1};
+        RegList ack_inner_discards = {3, ack_inner_discards_list};
+        Reg ack_inner = backend->call(builder, ack_fun, ack_inner_args, type(8), ack_types, &ack_cc.base, ack_inner_discards);
         Reg ack_outer_args_list[2] = {m_1, ack_inner};
         RegList ack_outer_args = {2, ack_outer_args_list};
-        Reg ack_outer = backend->call(builder, ack_fun, ack_outer_args, type(8), ack_types, &ack_cc.base, ND);
+        Reg ack_outer = backend->call(builder, ack_fun, ack_outer_args, type(8), ack_types, &ack_cc.base, ack_outer_args);
         backend->ret(builder, ack_outer, type(8), &ack_cc.base);
         // m_zero_marker: return n + 1
         backend->begin_bb(builder, blk0);
@@ -60,7 +62,9 @@ int ack_jit(int m, int n) {
         backend->label(builder, n_zero_marker);
         Reg ack_args_list[2] = {m_1, one};
         RegList ack_args = {2, ack_args_list};
-        Reg ack_ret = backend->call(builder, ack_fun, ack_args, type(8), ack_types, &ack_cc.base, ND);
+        Reg ack_discards_list[3] = {m, n, m_1};
+        RegList ack_discards = {3, ack_discards_list};
+        Reg ack_ret = backend->call(builder, ack_fun, ack_args, type(8), ack_types, &ack_cc.base, ack_discards);
         backend->ret(builder, ack_ret, type(8), &ack_cc.base);
 
         backend->finalize_function(builder);
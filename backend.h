@@ -1,30 +1,92 @@
 #ifndef __MUJIT_BACKEND_H__
 #define __MUJIT_BACKEND_H__
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 typedef struct {
     unsigned char *ptr;
     size_t length;
     size_t offset;
 } Buffer;
 
+/**
+ * Make room for at least n more bytes. Grows by half, so a buffer that's reused
+ * or sized up front from an estimate rarely reallocates.
+ */
+static inline void reserve(Buffer *buffer, size_t n) {
+    if (buffer->length - buffer->offset >= n) return;
+    size_t length = buffer->length + buffer->length / 2;
+    if (length < 64) length = 64;
+    if (length < buffer->offset + n) length = buffer->offset + n;
+    buffer->ptr = realloc(buffer->ptr, length);
+    buffer->length = length;
+}
+
+// Unchecked writes, into room made by reserve.
+static inline void put(Buffer *buffer, unsigned char value) {
+    buffer->ptr[buffer->offset++] = value;
+}
+
+static inline void put_u32(Buffer *buffer, uint32_t value) {
+    memcpy(buffer->ptr + buffer->offset, &value, 4);
+    buffer->offset += 4;
+}
+
+static inline void put_u64(Buffer *buffer, uint64_t value) {
+    memcpy(buffer->ptr + buffer->offset, &value, 8);
+    buffer->offset += 8;
+}
+
 static inline void append(Buffer *buffer, unsigned char value) {
-    if (buffer->offset == buffer->length) {
-        buffer->length = buffer->length ? (buffer->length * 2) : 16;
-        buffer->ptr = realloc(buffer->ptr, buffer->length);
-    }
-    buffer->ptr[buffer->offset] = value;
-    buffer->offset += 1;
+    reserve(buffer, 1);
+    put(buffer, value);
 }
 
+typedef enum {
+    TYPE_INTEGER,
+    // f32 or f64
+    TYPE_FLOAT,
+    // 16 bytes of lanes, which ops on it interpret as given by their Lanes
+    TYPE_VECTOR,
+} TypeKind;
+
+/**
+ * Integer values are 1, 2, 4 or 8 bytes. Values under 8 bytes are neither signed nor unsigned:
+ * ops that care (comparisons, division, right shifts, extensions) come in both flavours.
+ * Floats are 4 or 8 bytes, vectors 16.
+ * The alignment is at least the size; 0 means just that.
+ */
 typedef struct {
     int size;
-    // int alignment;
+    int alignment;
+    TypeKind kind;
 } Type;
 
 static inline Type type(int size) {
-    return (Type) { size };
+    return (Type) { size, size };
+}
+
+static inline Type float_type(int size) {
+    return (Type) { size, size, TYPE_FLOAT };
+}
+
+static inline Type vector_type(int size) {
+    return (Type) { size, size, TYPE_VECTOR };
 }
 
+// How vector ops interpret the lanes of a vector.
+typedef enum {
+    LANES_I8,
+    LANES_I16,
+    LANES_I32,
+    LANES_I64,
+    LANES_F32,
+    LANES_F64,
+} Lanes;
+
 typedef struct {
     size_t length;
     Type *ptr;
@@ -40,6 +102,8 @@ typedef struct {
 
 typedef enum {
     X86_64_CLASS_INTEGER,
+    // floats and vectors, passed and returned in xmm registers
+    X86_64_CLASS_SSE,
     X86_64_CLASS_MEMORY,
 } X86_64_ArgumentClass;
 
@@ -68,39 +132,238 @@ typedef struct {
     int32_t id;
 } Marker;
 
+// A memory address: base + index * scale + offset. index can be INVALID_REG; scale is 1, 2, 4 or 8.
+typedef struct {
+    Reg base;
+    Reg index;
+    int scale;
+    int32_t offset;
+} Address;
+
+typedef enum {
+    COMPARE_EQ,
+    COMPARE_NE,
+    // signed
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE,
+    // unsigned
+    COMPARE_ULT,
+    COMPARE_ULE,
+    COMPARE_UGT,
+    COMPARE_UGE,
+} Comparison;
+
+// Redundant moves that the peephole pass removes on finalize, by pattern.
+typedef enum {
+    // a reload of the stack slot that was just spilled to: dropped, or turned into a register move
+    PEEPHOLE_SPILL_RELOAD,
+    // a move straight back to where the value came from, as in mov a, b; mov b, a
+    PEEPHOLE_MOVE_BACK,
+    // a move to a register or stack slot that the next move overwrites
+    PEEPHOLE_DEAD_MOVE,
+    PEEPHOLE_PATTERNS,
+} PeepholePattern;
+
+// Code generation statistics for a finalized function.
+typedef struct {
+    size_t code_size;
+    size_t frame_size;
+    // stores of registers to the stack
+    size_t spills;
+    // loads of spilled registers back from the stack
+    size_t reloads;
+    size_t peephole_hits[PEEPHOLE_PATTERNS];
+    // IR backend: ops removed as dead before code generation, ops that reused an equal value
+    // computed before instead, and the regs that were never created in the x86-64 backend as a result
+    size_t ops_removed;
+    size_t ops_reused;
+    size_t regs_saved;
+    // IR backend: calls replaced by a copy of the callee's body
+    size_t calls_inlined;
+} FunctionStats;
+
+// Instruction set extensions that code can be generated for, beyond baseline x86-64 (bitmask).
+typedef enum {
+    CPU_POPCNT = 1 << 0,
+    CPU_LZCNT = 1 << 1,
+    // andn, tzcnt
+    CPU_BMI1 = 1 << 2,
+    // shlx, shrx, sarx
+    CPU_BMI2 = 1 << 3,
+    // VEX encodings of float and vector ops
+    CPU_AVX = 1 << 4,
+    CPU_AVX2 = 1 << 5,
+    CPU_FMA = 1 << 6,
+    CPU_AVX512F = 1 << 7,
+} CpuFeature;
+
+// Usage of the executable memory shared by all modules, in bytes.
+typedef struct {
+    // mapped from the OS
+    size_t mapped;
+    size_t regions;
+    // code of linked modules
+    size_t used;
+    // handed out to linked modules: 'used' plus rounding to size classes and pages
+    size_t allocated;
+    // freed by modules, and waiting to be reused
+    size_t free;
+} CodeHeapStats;
+
+/**
+ * Builds the body of a lazily declared function, on its first call, or of a tiered function once it's hot:
+ * new_function with the marker, up to finalize_function.
+ */
+typedef void (*BuildFunction)(void *module_, Marker marker, void *data);
+
 typedef struct {
     void* (*new_module)();
     Marker (*declare_function)(void *module_);
+    // Declare a function that isn't built before link, but by 'build' when it's first called.
+    Marker (*declare_lazy_function)(void *module_, BuildFunction build, void *data);
+    /**
+     * Declare a function that's built before link like any other, as tier 0, and that counts its calls through a stub.
+     * Once it's hot, a background thread builds it again with 'build', as tier 1, and swaps the stub over to it.
+     * The IR backend leaves out its expensive passes in tier 0; the x86-64 backend builds both tiers the same way.
+     */
+    Marker (*declare_tiered_function)(void *module_, BuildFunction build, void *data);
+    // Resolve a declared marker to a native function. Calls to it can use immediate_function.
+    void (*import_function)(void *module_, Marker marker, void (*funcptr)());
+    // The CPU features detected when the backend was created, which new modules generate code for.
+    unsigned (*get_cpu_features)();
+    // Generate code for these features instead, in functions created after this. For testing and comparing tiers:
+    // code that uses a feature the CPU doesn't have faults when it runs.
+    void (*set_cpu_features)(void *module_, unsigned features);
+    // Whether functions created after this remove redundant moves on finalize. On by default.
+    void (*set_peephole)(void *module_, bool enabled);
+    // How many threads link patches the module's functions on. 1 by default.
+    void (*set_link_threads)(void *module_, int threads);
+    // How many calls make a tiered function hot. 1000 by default.
+    void (*set_tier_threshold)(void *module_, int calls);
+    /**
+     * Functions can be declared, built and finalized from several threads at once, each function
+     * by one thread. Everything else about a module, up to link, is for one thread at a time.
+     */
     void* (*new_function)(void *module_, Marker marker, Types args, CallingConvention *cc, void **entry_bb);
     void (*finalize_function)(void *fun);
     void (*link)(void *module_);
+    // Free the module's code and all its functions.
+    void (*free_module)(void *module_);
     // Get a label marker that can later be resolved to a position in the function
     Marker (*label_marker)(void *fun);
     Reg (*immediate_void)(void *fun, RegList discards);
     Reg (*immediate_int32)(void *fun, int32_t value, RegList discards);
-    // Use this for far calls (native code calls) as well!
     Reg (*immediate_int64)(void *fun, int64_t value, RegList discards);
-    // Use for calling functions in the same module.
+    // Use for calling functions in the same module, or imported into it.
     Reg (*immediate_function)(void *fun, Marker marker, RegList discards);
+    // Binary ops take operands of the same type, but a literal operand can have any type.
     Reg (*add)(void *fun, Reg left, Reg right, RegList discards);
     Reg (*sub)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*mul)(void *fun, Reg left, Reg right, RegList discards);
+    // Division rounds towards zero, the remainder has the sign of left. Like in C, dividing by 0 is undefined.
+    Reg (*div)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*rem)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*udiv)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*urem)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*bit_and)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*bit_or)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*bit_xor)(void *fun, Reg left, Reg right, RegList discards);
+    // Shift counts can have any type, and are taken modulo 64, or 32 for values under 8 bytes.
+    // shr shifts in zeroes, sar copies of the sign bit.
+    Reg (*shl)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*shr)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*sar)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*neg)(void *fun, Reg reg, RegList discards);
+    Reg (*bit_not)(void *fun, Reg reg, RegList discards);
+    // left & ~right
+    Reg (*and_not)(void *fun, Reg left, Reg right, RegList discards);
+    // Bit counts of the value's size: counting leading or trailing zeroes of 0 gives the number of bits.
+    Reg (*count_leading_zeros)(void *fun, Reg reg, RegList discards);
+    Reg (*count_trailing_zeros)(void *fun, Reg reg, RegList discards);
+    Reg (*popcount)(void *fun, Reg reg, RegList discards);
+    // Extend a value to a type at least as large, with zeroes or copies of its sign bit.
+    Reg (*zero_extend)(void *fun, Reg reg, Type to, RegList discards);
+    Reg (*sign_extend)(void *fun, Reg reg, Type to, RegList discards);
+    // Keep the low to.size bytes of a value.
+    Reg (*truncate)(void *fun, Reg reg, Type to, RegList discards);
+    Reg (*immediate_float32)(void *fun, float value, RegList discards);
+    Reg (*immediate_float64)(void *fun, double value, RegList discards);
+    // Floating-point ops take f32 or f64 operands of the same type.
+    Reg (*fadd)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*fsub)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*fmul)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*fdiv)(void *fun, Reg left, Reg right, RegList discards);
+    Reg (*fsqrt)(void *fun, Reg reg, RegList discards);
+    // left * right + addend, rounded once or twice, depending on the CPU.
+    Reg (*fma)(void *fun, Reg left, Reg right, Reg addend, RegList discards);
+    // Between integers (always signed) and floats, or floats of both sizes. Floats are truncated to integers.
+    Reg (*convert)(void *fun, Reg reg, Type to, RegList discards);
+    // Vector ops take 16-byte vectors, of any lanes for add and sub, I16, I32 or float lanes for mul,
+    // and float lanes for div and fma.
+    Reg (*vector_add)(void *fun, Lanes lanes, Reg left, Reg right, RegList discards);
+    Reg (*vector_sub)(void *fun, Lanes lanes, Reg left, Reg right, RegList discards);
+    Reg (*vector_mul)(void *fun, Lanes lanes, Reg left, Reg right, RegList discards);
+    Reg (*vector_div)(void *fun, Lanes lanes, Reg left, Reg right, RegList discards);
+    Reg (*vector_fma)(void *fun, Lanes lanes, Reg left, Reg right, Reg addend, RegList discards);
+    // A vector with every lane set to a scalar of the lanes' type.
+    Reg (*vector_splat)(void *fun, Lanes lanes, Reg scalar, RegList discards);
+    // Lane number 'lane' as a scalar.
+    Reg (*vector_extract)(void *fun, Lanes lanes, Reg vector, int lane, RegList discards);
+    // Lane i of the result is lane indices[i] of the vector. 32 or 64-bit lanes only.
+    Reg (*vector_shuffle)(void *fun, Lanes lanes, Reg vector, const int *indices, RegList discards);
+    // 1 if 'first <comparison> second' holds, else 0. Floats can't use unsigned comparisons; NaNs compare unequal.
+    Reg (*compare)(void *fun, Comparison comparison, Reg first, Reg second, RegList discards);
+    // if_true if 'first <comparison> second' holds, else if_false. Doesn't branch.
+    Reg (*select)(void *fun, Comparison comparison, Reg first, Reg second, Reg if_true, Reg if_false, RegList discards);
+    // Load value_type.size (1, 2, 4 or 8) bytes, sign or zero extended to 64 bits. Floats and vectors keep their type.
+    Reg (*load)(void *fun, Address address, Type value_type, bool sign_extend, RegList discards);
+    // Store the low value_type.size bytes of value. Floats and vectors are stored whole.
+    void (*store)(void *fun, Address address, Reg value, Type value_type, RegList discards);
     Reg (*arg)(void *fun, int arg);
     Reg (*call)(void *fun, Reg target, RegList args, Type ret, Types arg_types, CallingConvention *cc, RegList discards);
+    // Blocks can be used as pred_bb until finalize_function.
     void* (*begin_bb)(void *fun, void *pred_bb);
     // These functions must be succeeded by another begin_bb call.
     void (*ret)(void *fun, Reg reg, Type type, CallingConvention *cc);
     void (*branch)(void *fun, Marker marker);
     void (*branch_if_equal)(void *fun, Marker marker, Reg first, Reg second);
+    void (*branch_if)(void *fun, Comparison comparison, Marker marker, Reg first, Reg second);
     // Assign the current position to the label marker.
     void (*label)(void *fun, Marker marker);
     void (*discard)(void *fun, RegList discards);
+    /**
+     * For frontends that know liveness: the position where 'reg' is used next, in any numbering of the ops that
+     * grows along the code, or 0 if unknown. When it has to spill, the backend picks the value used furthest away.
+     */
+    void (*hint_next_use)(void *fun, Reg reg, int position);
+    /**
+     * For frontends that allocate registers themselves: the class of registers values of 'type' go in, numbered
+     * from 0, and how many registers it has. The first 'preserved' ones keep their value across calls.
+     */
+    int (*get_registers)(Type type, int *count, int *preserved);
+    /**
+     * The register of its class the frontend assigned 'reg', or -1 to keep it in memory. Where that register is free,
+     * the backend reloads the value into it, and moves it there to keep it across calls.
+     */
+    void (*hint_register)(void *fun, Reg reg, int index);
     void (*debug_dump)(void *fun);
+    void (*get_stats)(void *fun, FunctionStats *stats);
+    void (*get_heap_stats)(CodeHeapStats *stats);
     void (*(*get_funcptr)(void *fun))();
-    // Reg (*lt_)(Reg left, Reg right)
+    // Get a callable pointer for a function, lazy function or import of a linked module.
+    void (*(*get_function)(void *module_, Marker marker))();
 } Backend;
 
 #define ND ((RegList){0, NULL})
 
 Backend *create_backend_x86_64();
 
+/**
+ * Records functions as SSA instructions and generates code for them with the x86-64 backend on finalize,
+ * after passes over the whole function. Discards are computed from liveness; the ones given are ignored.
+ */
+Backend *create_backend_ir();
+
 #endif
@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <backend.h>
+
+// Code heap benchmark: keeps compiling and freeing modules of varying size,
+// and reports how much memory the code heap holds on to.
+
+#define LIVE_MODULES 64
+
+X86_64_SysV int1_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 1, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types int1_types = { 1, (Type[]) {{8}} };
+
+// f(x) = x * (length + 1), by adding x to itself 'length' times.
+void *compile(Backend *backend, int length, int64_t (**funcptr)(int64_t)) {
+    void *module = backend->new_module();
+    Marker marker = backend->declare_function(module);
+    void *blk0;
+    void *builder = backend->new_function(module, marker, int1_types, &int1_cc.base, &blk0);
+    Reg x = backend->arg(builder, 0);
+    Reg sum = x;
+    for (int i = 0; i < length; i++) {
+        Reg next = backend->add(builder, sum, x, sum.id == x.id ? ND : (RegList) { 1, &sum });
+        sum = next;
+    }
+    backend->ret(builder, sum, type(8), &int1_cc.base);
+    backend->finalize_function(builder);
+    backend->link(module);
+    *funcptr = (int64_t(*)(int64_t)) backend->get_funcptr(builder);
+    return module;
+}
+
+void report(Backend *backend, int iteration) {
+    CodeHeapStats stats;
+    backend->get_heap_stats(&stats);
+    size_t in_use = stats.allocated + stats.free;
+    printf("%8i modules: %8zu mapped in %3zu regions, %8zu used, %8zu allocated, %8zu free (%2zu%% fragmentation)\n",
+           iteration, stats.mapped, stats.regions, stats.used, stats.allocated, stats.free,
+           in_use ? (stats.free * 100 / in_use) : 0);
+}
+
+int main(int argc, char **argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 20000;
+    Backend *backend = create_backend_x86_64();
+    void *modules[LIVE_MODULES] = {0};
+    srand(0);
+    for (int i = 0; i < iterations; i++) {
+        int slot = i % LIVE_MODULES;
+        if (modules[slot]) backend->free_module(modules[slot]);
+        // mostly small functions, and the occasional one too large for a size class
+        int length = (i % 97 == 0) ? 30000 : rand() % 2000;
+        int64_t (*funcptr)(int64_t);
+        modules[slot] = compile(backend, length, &funcptr);
+        assert(funcptr(3) == 3 * (length + 1));
+        if ((i + 1) % (iterations / 10) == 0) report(backend, i + 1);
+    }
+    for (int i = 0; i < LIVE_MODULES; i++) {
+        if (modules[i]) backend->free_module(modules[i]);
+    }
+    report(backend, iterations);
+    free(backend);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <backend.h>
+
+// Code emission throughput: builds and links modules of large generated functions,
+// and reports how many backend ops (calls like add or load, not machine instructions) it takes
+// and how many bytes of machine code it emits per second. The first module's functions are checked against C.
+
+#define MODULES 100
+#define FUNCTIONS 20
+#define OPS 2000
+#define LIVE 8
+
+X86_64_SysV emit_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 1, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types emit_types = { 1, (Type[]) {{8}} };
+
+// What the function that build_function generates from 'seed' computes,
+// on uint64_t so that overflow wraps as it does there.
+int64_t run_native(unsigned seed, int64_t *data_) {
+    uint64_t *data = (uint64_t*) data_;
+    uint64_t live[LIVE];
+    for (int i = 0; i < LIVE; i++) live[i] = data[i];
+    for (int i = 0; i < OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int a = (seed >> 8) % LIVE, b = (seed >> 16) % LIVE;
+        uint64_t left = live[a], right = live[b];
+        switch ((seed >> 24) % 8) {
+        case 0: live[a] = left + right; break;
+        case 1: live[a] = left - right; break;
+        case 2: live[a] = left ^ right; break;
+        case 3: live[a] = left * right; break;
+        case 4: live[a] = left << b; break;
+        case 5: live[a] = left + i; break;
+        case 6:
+            data[b] = right;
+            live[a] = left & right;
+            break;
+        default: live[a] = left | data[b]; break;
+        }
+    }
+    uint64_t sum = live[0];
+    for (int i = 1; i < LIVE; i++) sum += live[i];
+    return (int64_t) sum;
+}
+
+/**
+ * A straight line of ALU ops, loads and stores over LIVE values, all from memory at arg 0.
+ * Every op replaces one of the values, so nothing needs to be spilled.
+ * Returns the number of ops, and adds the code size to 'bytes'.
+ */
+size_t build_function(Backend *backend, void *module, Marker marker, unsigned seed, size_t *bytes) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, emit_types, &emit_cc.base, &blk0);
+    Reg data = backend->arg(builder, 0);
+    Reg live[LIVE];
+    for (int i = 0; i < LIVE; i++) {
+        live[i] = backend->load(builder, (Address) { data, INVALID_REG, 1, 8 * i }, type(8), false, ND);
+    }
+    size_t ops = LIVE;
+    for (int i = 0; i < OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int a = (seed >> 8) % LIVE, b = (seed >> 16) % LIVE;
+        Reg left = live[a], right = live[b];
+        RegList discards = { 1, &live[a] };
+        switch ((seed >> 24) % 8) {
+        case 0: live[a] = backend->add(builder, left, right, discards); break;
+        case 1: live[a] = backend->sub(builder, left, right, discards); break;
+        case 2: live[a] = backend->bit_xor(builder, left, right, discards); break;
+        case 3: live[a] = backend->mul(builder, left, right, discards); break;
+        case 4: live[a] = backend->shl(builder, left, backend->immediate_int64(builder, b, ND), discards); break;
+        case 5: live[a] = backend->add(builder, left, backend->immediate_int64(builder, i, ND), discards); break;
+        case 6:
+            backend->store(builder, (Address) { data, INVALID_REG, 1, 8 * b }, right, type(8), ND);
+            live[a] = backend->bit_and(builder, left, right, discards);
+            ops++;
+            break;
+        default: {
+            Reg loaded = backend->load(builder, (Address) { data, INVALID_REG, 1, 8 * b }, type(8), false, ND);
+            live[a] = backend->bit_or(builder, left, loaded, (RegList) { 2, (Reg[]) { left, loaded } });
+            ops++;
+            break;
+        }
+        }
+        ops++;
+    }
+    Reg sum = live[0];
+    for (int i = 1; i < LIVE; i++) {
+        sum = backend->add(builder, sum, live[i], (RegList) { 2, (Reg[]) { sum, live[i] } });
+    }
+    backend->ret(builder, sum, type(8), &emit_cc.base);
+    backend->finalize_function(builder);
+    FunctionStats stats;
+    backend->get_stats(builder, &stats);
+    *bytes += stats.code_size;
+    return ops + LIVE;
+}
+
+typedef int64_t (*EmitFunction)(int64_t *data);
+
+int main(int argc, char **argv) {
+    Backend *backend = create_backend_x86_64();
+    size_t ops = 0, bytes = 0;
+    clock_t start = clock();
+    for (int k = 0; k < MODULES; k++) {
+        void *module = backend->new_module();
+        Marker markers[FUNCTIONS];
+        for (int i = 0; i < FUNCTIONS; i++) {
+            markers[i] = backend->declare_function(module);
+            ops += build_function(backend, module, markers[i], i, &bytes);
+        }
+        backend->link(module);
+        for (int i = 0; k == 0 && i < FUNCTIONS; i++) {
+            // The code has to run, not just be emitted.
+            int64_t data[LIVE] = { 1, 2, 3, 4, 5, 6, 7, 8 }, expected_data[LIVE] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+            EmitFunction function = (EmitFunction) backend->get_function(module, markers[i]);
+            assert(function(data) == run_native(i, expected_data));
+            assert(memcmp(data, expected_data, sizeof(data)) == 0);
+        }
+        backend->free_module(module);
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf("%zu backend ops, %zu bytes in %.3f s: %.2f M backend ops/s, %.1f MB/s\n",
+           ops, bytes, seconds, ops / seconds / 1e6, bytes / seconds / 1e6);
+    free(backend);
+    return 0;
+}
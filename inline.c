@@ -0,0 +1,132 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <backend.h>
+
+// Inlining benchmark: a loop that calls tiny accessor and helper functions of the same module,
+// with the x86-64 backend, which calls them, and the IR backend, which inlines them.
+
+#define LENGTH 4096
+#define REPEAT 5000
+
+X86_64_SysV int2_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 2, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types int2_types = { 2, (Type[]) {{8}, {8}} };
+
+X86_64_SysV kernel_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 3, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types kernel_types = { 3, (Type[]) {{8}, {8}, {8}} };
+
+// get(data, i) = data[i]
+void build_get(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, int2_types, &int2_cc.base, &blk0);
+    Reg data = backend->arg(builder, 0);
+    Reg i = backend->arg(builder, 1);
+    Reg value = backend->load(builder, (Address) { data, i, 8, 0 }, type(8), false, (RegList) { 2, (Reg[]) { data, i } });
+    backend->ret(builder, value, type(8), &int2_cc.base);
+    backend->finalize_function(builder);
+}
+
+// mix(a, b) = a * 3 + b
+void build_mix(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, int2_types, &int2_cc.base, &blk0);
+    Reg a = backend->arg(builder, 0);
+    Reg b = backend->arg(builder, 1);
+    Reg three = backend->immediate_int64(builder, 3, ND);
+    Reg product = backend->mul(builder, a, three, (RegList) { 2, (Reg[]) { a, three } });
+    Reg sum = backend->add(builder, product, b, (RegList) { 2, (Reg[]) { product, b } });
+    backend->ret(builder, sum, type(8), &int2_cc.base);
+    backend->finalize_function(builder);
+}
+
+/**
+ * state[1] = mix(state[1], get(data, i)) for every i. The loop counter lives in memory at state[0],
+ * since loop values can't flow through labels.
+ */
+void *build_kernel(Backend *backend, void *module, Marker marker, Marker get, Marker mix) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, kernel_types, &kernel_cc.base, &blk0);
+    Reg state = backend->arg(builder, 0);
+    Reg data = backend->arg(builder, 1);
+    Reg length = backend->arg(builder, 2);
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 0 }, backend->immediate_int64(builder, 0, ND), type(8), ND);
+    Marker loop = backend->label_marker(builder);
+    Marker done = backend->label_marker(builder);
+    backend->label(builder, loop);
+    Reg i = backend->load(builder, (Address) { state, INVALID_REG, 1, 0 }, type(8), false, ND);
+    backend->branch_if(builder, COMPARE_GE, done, i, length);
+    backend->begin_bb(builder, blk0);
+    Reg get_fun = backend->immediate_function(builder, get, ND);
+    Reg value = backend->call(builder, get_fun, (RegList) { 2, (Reg[]) { data, i } }, type(8), int2_types, &int2_cc.base,
+                              (RegList) { 1, &get_fun });
+    Reg total = backend->load(builder, (Address) { state, INVALID_REG, 1, 8 }, type(8), false, ND);
+    Reg mix_fun = backend->immediate_function(builder, mix, ND);
+    total = backend->call(builder, mix_fun, (RegList) { 2, (Reg[]) { total, value } }, type(8), int2_types, &int2_cc.base,
+                          (RegList) { 3, (Reg[]) { mix_fun, total, value } });
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 8 }, total, type(8), (RegList) { 1, &total });
+    Reg next = backend->add(builder, i, backend->immediate_int64(builder, 1, ND), (RegList) { 1, &i });
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 0 }, next, type(8), (RegList) { 1, &next });
+    backend->branch(builder, loop);
+    backend->begin_bb(builder, blk0);
+    backend->label(builder, done);
+    backend->ret(builder, backend->immediate_int64(builder, 0, ND), type(8), &kernel_cc.base);
+    backend->finalize_function(builder);
+    return builder;
+}
+
+typedef int64_t (*KernelFunction)(int64_t *state, int64_t *data, int64_t length);
+
+void run(Backend *backend, const char *name, int64_t *data, int64_t expected) {
+    void *module = backend->new_module();
+    Marker get = backend->declare_function(module);
+    Marker mix = backend->declare_function(module);
+    Marker kernel = backend->declare_function(module);
+    // The callees come first, so they're finalized when the kernel is.
+    build_get(backend, module, get);
+    build_mix(backend, module, mix);
+    void *builder = build_kernel(backend, module, kernel, get, mix);
+    backend->link(module);
+    KernelFunction function = (KernelFunction) backend->get_function(module, kernel);
+    clock_t start = clock();
+    int64_t state[2] = {0};
+    for (int r = 0; r < REPEAT; r++) {
+        state[1] = 0;
+        function(state, data, LENGTH);
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    assert(state[1] == expected);
+    FunctionStats stats;
+    backend->get_stats(builder, &stats);
+    printf("%-6s %5zu bytes %2zu calls inlined %8.3f ns/element\n",
+           name, stats.code_size, stats.calls_inlined, seconds * 1e9 / ((double) REPEAT * LENGTH));
+    backend->free_module(module);
+}
+
+int main(int argc, char **argv) {
+    int64_t *data = malloc(LENGTH * sizeof(int64_t));
+    int64_t expected = 0;
+    for (int i = 0; i < LENGTH; i++) {
+        data[i] = i * 7 - 3;
+        expected = expected * 3 + data[i];
+    }
+    Backend *backends[] = { create_backend_x86_64(), create_backend_ir() };
+    const char *names[] = { "x86-64", "ir" };
+    for (int i = 0; i < 2; i++) {
+        run(backends[i], names[i], data, expected);
+        free(backends[i]);
+    }
+    free(data);
+    return 0;
+}
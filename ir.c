@@ -0,0 +1,1988 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <backend.h>
+
+/**
+ * The IR backend: functions are recorded as SSA instructions instead of being emitted right away.
+ * On finalize, passes run over the whole function, and what's left is replayed into the x86-64 backend.
+ * Modules, markers and linking are the x86-64 backend's: an IR module wraps one.
+ */
+
+// what functions are replayed into
+Backend ir_target;
+
+typedef enum {
+    // removed by a pass
+    IR_NOP,
+    IR_IMMEDIATE_VOID,
+    IR_IMMEDIATE_INT32,
+    IR_IMMEDIATE_INT64,
+    IR_IMMEDIATE_FUNCTION,
+    IR_IMMEDIATE_FLOAT32,
+    IR_IMMEDIATE_FLOAT64,
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_REM,
+    IR_UDIV,
+    IR_UREM,
+    IR_BIT_AND,
+    IR_BIT_OR,
+    IR_BIT_XOR,
+    IR_SHL,
+    IR_SHR,
+    IR_SAR,
+    IR_AND_NOT,
+    IR_FADD,
+    IR_FSUB,
+    IR_FMUL,
+    IR_FDIV,
+    IR_NEG,
+    IR_BIT_NOT,
+    IR_COUNT_LEADING_ZEROS,
+    IR_COUNT_TRAILING_ZEROS,
+    IR_POPCOUNT,
+    IR_FSQRT,
+    IR_ZERO_EXTEND,
+    IR_SIGN_EXTEND,
+    IR_TRUNCATE,
+    IR_CONVERT,
+    IR_FMA,
+    IR_VECTOR_ADD,
+    IR_VECTOR_SUB,
+    IR_VECTOR_MUL,
+    IR_VECTOR_DIV,
+    IR_VECTOR_FMA,
+    IR_VECTOR_SPLAT,
+    IR_VECTOR_EXTRACT,
+    IR_VECTOR_SHUFFLE,
+    IR_COMPARE,
+    IR_SELECT,
+    IR_LOAD,
+    IR_STORE,
+    IR_CALL,
+    IR_BEGIN_BB,
+    IR_RET,
+    IR_BRANCH,
+    IR_BRANCH_IF,
+    IR_LABEL,
+    IR_OPS,
+} IR_Op;
+
+// Pure ops can be removed if their result isn't used. Loads aren't: they can fault.
+#define IR_PURE 1
+// Control flow ends or starts a segment, and doesn't take discards.
+#define IR_CONTROL 2
+
+typedef struct {
+    const char *name;
+    // how many of the instruction's operands it uses; calls use their args too
+    int operands;
+    int flags;
+} IR_Op_Info;
+
+const IR_Op_Info ir_ops[IR_OPS] = {
+    [IR_NOP] = { "nop", 0, 0 },
+    [IR_IMMEDIATE_VOID] = { "immediate_void", 0, IR_PURE },
+    [IR_IMMEDIATE_INT32] = { "immediate_int32", 0, IR_PURE },
+    [IR_IMMEDIATE_INT64] = { "immediate_int64", 0, IR_PURE },
+    [IR_IMMEDIATE_FUNCTION] = { "immediate_function", 0, IR_PURE },
+    [IR_IMMEDIATE_FLOAT32] = { "immediate_float32", 0, IR_PURE },
+    [IR_IMMEDIATE_FLOAT64] = { "immediate_float64", 0, IR_PURE },
+    [IR_ADD] = { "add", 2, IR_PURE },
+    [IR_SUB] = { "sub", 2, IR_PURE },
+    [IR_MUL] = { "mul", 2, IR_PURE },
+    [IR_DIV] = { "div", 2, IR_PURE },
+    [IR_REM] = { "rem", 2, IR_PURE },
+    [IR_UDIV] = { "udiv", 2, IR_PURE },
+    [IR_UREM] = { "urem", 2, IR_PURE },
+    [IR_BIT_AND] = { "bit_and", 2, IR_PURE },
+    [IR_BIT_OR] = { "bit_or", 2, IR_PURE },
+    [IR_BIT_XOR] = { "bit_xor", 2, IR_PURE },
+    [IR_SHL] = { "shl", 2, IR_PURE },
+    [IR_SHR] = { "shr", 2, IR_PURE },
+    [IR_SAR] = { "sar", 2, IR_PURE },
+    [IR_AND_NOT] = { "and_not", 2, IR_PURE },
+    [IR_FADD] = { "fadd", 2, IR_PURE },
+    [IR_FSUB] = { "fsub", 2, IR_PURE },
+    [IR_FMUL] = { "fmul", 2, IR_PURE },
+    [IR_FDIV] = { "fdiv", 2, IR_PURE },
+    [IR_NEG] = { "neg", 1, IR_PURE },
+    [IR_BIT_NOT] = { "bit_not", 1, IR_PURE },
+    [IR_COUNT_LEADING_ZEROS] = { "count_leading_zeros", 1, IR_PURE },
+    [IR_COUNT_TRAILING_ZEROS] = { "count_trailing_zeros", 1, IR_PURE },
+    [IR_POPCOUNT] = { "popcount", 1, IR_PURE },
+    [IR_FSQRT] = { "fsqrt", 1, IR_PURE },
+    [IR_ZERO_EXTEND] = { "zero_extend", 1, IR_PURE },
+    [IR_SIGN_EXTEND] = { "sign_extend", 1, IR_PURE },
+    [IR_TRUNCATE] = { "truncate", 1, IR_PURE },
+    [IR_CONVERT] = { "convert", 1, IR_PURE },
+    [IR_FMA] = { "fma", 3, IR_PURE },
+    [IR_VECTOR_ADD] = { "vector_add", 2, IR_PURE },
+    [IR_VECTOR_SUB] = { "vector_sub", 2, IR_PURE },
+    [IR_VECTOR_MUL] = { "vector_mul", 2, IR_PURE },
+    [IR_VECTOR_DIV] = { "vector_div", 2, IR_PURE },
+    [IR_VECTOR_FMA] = { "vector_fma", 3, IR_PURE },
+    [IR_VECTOR_SPLAT] = { "vector_splat", 1, IR_PURE },
+    [IR_VECTOR_EXTRACT] = { "vector_extract", 1, IR_PURE },
+    [IR_VECTOR_SHUFFLE] = { "vector_shuffle", 1, IR_PURE },
+    [IR_COMPARE] = { "compare", 2, IR_PURE },
+    [IR_SELECT] = { "select", 4, IR_PURE },
+    [IR_LOAD] = { "load", 2, 0 },
+    [IR_STORE] = { "store", 3, 0 },
+    [IR_CALL] = { "call", 1, 0 },
+    [IR_BEGIN_BB] = { "begin_bb", 0, IR_CONTROL },
+    [IR_RET] = { "ret", 1, IR_CONTROL },
+    [IR_BRANCH] = { "branch", 0, IR_CONTROL },
+    [IR_BRANCH_IF] = { "branch_if", 2, IR_CONTROL },
+    [IR_LABEL] = { "label", 0, IR_CONTROL },
+};
+
+// instruction flags
+#define IR_SIGN_EXTEND_LOAD 1
+// The result is never used: it's discarded right away.
+#define IR_UNUSED_RESULT 2
+
+typedef struct {
+    uint8_t op;
+    // Comparison or Lanes
+    uint8_t mode;
+    // loads and stores
+    uint8_t scale;
+    uint8_t flags;
+    Reg result;
+    // INVALID_REG where unused. Loads and stores: the address's base and index, then the stored value.
+    Reg operands[4];
+    // of the result; of the value for loads, stores, extensions and conversions; the return type for calls and rets
+    Type type;
+    // computed on finalize, in the function's reg pool: the operands that are last used here,
+    // or for begin_bb, what the block it continues has that isn't used any more
+    uint32_t discards;
+    uint32_t discard_count;
+    union {
+        int64_t value;
+        float float32;
+        double float64;
+        Marker marker;
+        // an address's offset
+        int32_t offset;
+        int32_t lane;
+        int8_t indices[4];
+        struct {
+            int32_t block;
+            // -1 for none
+            int32_t pred;
+        } bb;
+        // index in the function's calls
+        uint32_t call;
+        struct IR_Signature *signature;
+    };
+} IR_Instruction;
+
+typedef struct {
+    size_t length;
+    IR_Instruction *ptr;
+} IR_Instructions;
+
+/**
+ * A copy of a calling convention and argument types, shared by all functions and calls of a module
+ * that have them, since clients may pass ones that don't live until finalize.
+ */
+typedef struct IR_Signature {
+    Types types;
+    X86_64_SysV cc;
+} IR_Signature;
+
+typedef struct {
+    // in the function's reg pool
+    uint32_t args;
+    uint32_t arg_count;
+    IR_Signature *signature;
+} IR_Call;
+
+typedef struct {
+    size_t length;
+    IR_Call *ptr;
+} IR_Calls;
+
+typedef struct {
+    size_t length;
+    Reg *ptr;
+} IR_Regs;
+
+typedef struct {
+    void *module;
+    BuildFunction build;
+    void *data;
+} IR_Lazy_Function;
+
+/**
+ * A copy of a small straight-line function that ends in its only ret, as recorded,
+ * for callers in the module to inline. Never changed once saved, so callers read it without the lock.
+ */
+typedef struct {
+    IR_Instructions instructions;
+    IR_Calls calls;
+    IR_Regs pool;
+    int next_reg;
+    IR_Signature *signature;
+} IR_Body;
+
+typedef struct {
+    // the x86-64 module
+    void *target;
+    // Functions can be built from several threads: this guards the lists, which they all add to.
+    pthread_mutex_t lock;
+    struct {
+        size_t length;
+        struct IR_Function **ptr;
+    } functions;
+    struct {
+        size_t length;
+        IR_Lazy_Function **ptr;
+    } lazy_functions;
+    struct {
+        size_t length;
+        IR_Signature **ptr;
+    } signatures;
+    // by marker, NULL for functions that can't be inlined
+    struct {
+        size_t length;
+        IR_Body **ptr;
+    } bodies;
+    // by marker: tiered functions that aren't hot yet, which build without the expensive passes
+    struct {
+        size_t length;
+        bool *ptr;
+    } cold;
+} IR_Module;
+
+typedef struct IR_Function {
+    IR_Module *module;
+    Marker marker;
+    IR_Signature *signature;
+    int next_reg;
+    int blocks;
+    int labels;
+    IR_Instructions instructions;
+    IR_Calls calls;
+    IR_Regs pool;
+    // tier 0 of a tiered function
+    bool cold;
+    // once finalized
+    void *target;
+    size_t ops_removed;
+    size_t ops_reused;
+    size_t regs_saved;
+    size_t calls_inlined;
+} IR_Function;
+
+size_t ir_list_capacity(size_t length) {
+    size_t capacity = 4;
+    while (capacity < length) capacity *= 2;
+    return capacity;
+}
+
+// Lists grow to powers of two, so their capacity follows from their length.
+void *ir_grow_list(void *ptr, size_t old_length, size_t length, size_t size) {
+    if (ptr && length <= ir_list_capacity(old_length)) return ptr;
+    return realloc(ptr, ir_list_capacity(length) * size);
+}
+
+IR_Instruction *append_instruction(IR_Function *function, IR_Op op) {
+    IR_Instructions *instructions = &function->instructions;
+    instructions->ptr = ir_grow_list(instructions->ptr, instructions->length, instructions->length + 1, sizeof(IR_Instruction));
+    IR_Instruction *instruction = &instructions->ptr[instructions->length++];
+    *instruction = (IR_Instruction) {
+        .op = op,
+        .result = INVALID_REG,
+        .operands = { INVALID_REG, INVALID_REG, INVALID_REG, INVALID_REG },
+    };
+    return instruction;
+}
+
+uint32_t append_regs(IR_Function *function, Reg *regs, size_t length) {
+    IR_Regs *pool = &function->pool;
+    pool->ptr = ir_grow_list(pool->ptr, pool->length, pool->length + length, sizeof(Reg));
+    // empty lists may be NULL
+    if (length) memcpy(pool->ptr + pool->length, regs, length * sizeof(Reg));
+    pool->length += length;
+    return pool->length - length;
+}
+
+bool same_signature(IR_Signature *signature, Types types, X86_64_SysV *cc) {
+    return signature->types.length == types.length
+        && (types.length == 0 || memcmp(signature->types.ptr, types.ptr, types.length * sizeof(Type)) == 0)
+        && signature->cc.arguments.length == cc->arguments.length
+        && (cc->arguments.length == 0
+            || memcmp(signature->cc.arguments.ptr, cc->arguments.ptr, cc->arguments.length * sizeof(X86_64_ArgumentClass)) == 0)
+        && signature->cc.ret_class == cc->ret_class;
+}
+
+IR_Signature *intern_signature(IR_Module *module, Types types, CallingConvention *cc) {
+    assert(cc->type == CALLING_CONVENTION_X86_64_SYSV);
+    X86_64_SysV *sysv_cc = (X86_64_SysV*) cc;
+    pthread_mutex_lock(&module->lock);
+    // Most recent first: calls tend to repeat the last one.
+    for (size_t i = module->signatures.length; i-- > 0;) {
+        if (same_signature(module->signatures.ptr[i], types, sysv_cc)) {
+            IR_Signature *signature = module->signatures.ptr[i];
+            pthread_mutex_unlock(&module->lock);
+            return signature;
+        }
+    }
+    size_t classes_size = sysv_cc->arguments.length * sizeof(X86_64_ArgumentClass);
+    IR_Signature *signature = malloc(sizeof(IR_Signature) + types.length * sizeof(Type) + classes_size);
+    // the arrays follow the struct
+    Type *type_copies = (Type*) (signature + 1);
+    X86_64_ArgumentClass *class_copies = (X86_64_ArgumentClass*) (type_copies + types.length);
+    if (types.length) memcpy(type_copies, types.ptr, types.length * sizeof(Type));
+    if (classes_size) memcpy(class_copies, sysv_cc->arguments.ptr, classes_size);
+    *signature = (IR_Signature) {
+        .types = { types.length, type_copies },
+        .cc = *sysv_cc,
+    };
+    signature->cc.arguments.ptr = class_copies;
+    module->signatures.ptr = ir_grow_list(module->signatures.ptr, module->signatures.length,
+                                          module->signatures.length + 1, sizeof(IR_Signature*));
+    module->signatures.ptr[module->signatures.length++] = signature;
+    pthread_mutex_unlock(&module->lock);
+    return signature;
+}
+
+Reg record_value(IR_Function *function, IR_Instruction *instruction) {
+    instruction->result = (Reg) { function->next_reg++ };
+    return instruction->result;
+}
+
+Reg record_op(void *fun, IR_Op op, Reg a, Reg b, Reg c) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, op);
+    instruction->operands[0] = a;
+    instruction->operands[1] = b;
+    instruction->operands[2] = c;
+    return record_value(function, instruction);
+}
+
+Reg record_typed_op(void *fun, IR_Op op, Reg reg, Type to) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, op);
+    instruction->operands[0] = reg;
+    instruction->type = to;
+    return record_value(function, instruction);
+}
+
+Reg record_immediate(void *fun, IR_Op op, Type type, int64_t value) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, op);
+    instruction->type = type;
+    instruction->value = value;
+    return record_value(function, instruction);
+}
+
+Reg record_vector_op(void *fun, IR_Op op, Lanes lanes, Reg a, Reg b, Reg c) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, op);
+    instruction->mode = lanes;
+    instruction->operands[0] = a;
+    instruction->operands[1] = b;
+    instruction->operands[2] = c;
+    return record_value(function, instruction);
+}
+
+void *ir_new_module() {
+    IR_Module *module = calloc(1, sizeof(IR_Module));
+    module->target = ir_target.new_module();
+    pthread_mutex_init(&module->lock, NULL);
+    return module;
+}
+
+Marker ir_declare_function(void *module_) {
+    IR_Module *module = (IR_Module*) module_;
+    return ir_target.declare_function(module->target);
+}
+
+// Lazy functions are built with the x86-64 module: give the build the IR module instead.
+void ir_build_lazy_function(void *target_module, Marker marker, void *data) {
+    IR_Lazy_Function *lazy = (IR_Lazy_Function*) data;
+    lazy->build(lazy->module, marker, lazy->data);
+}
+
+Marker ir_declare_lazy_function(void *module_, BuildFunction build, void *data) {
+    IR_Module *module = (IR_Module*) module_;
+    IR_Lazy_Function *lazy = malloc(sizeof(IR_Lazy_Function));
+    *lazy = (IR_Lazy_Function) { module, build, data };
+    pthread_mutex_lock(&module->lock);
+    module->lazy_functions.ptr = ir_grow_list(module->lazy_functions.ptr, module->lazy_functions.length,
+                                              module->lazy_functions.length + 1, sizeof(IR_Lazy_Function*));
+    module->lazy_functions.ptr[module->lazy_functions.length++] = lazy;
+    pthread_mutex_unlock(&module->lock);
+    return ir_target.declare_lazy_function(module->target, ir_build_lazy_function, lazy);
+}
+
+// Tiered functions are rebuilt by the x86-64 module's tier thread once hot: that build gets the passes.
+void ir_build_tiered_function(void *target_module, Marker marker, void *data) {
+    IR_Lazy_Function *lazy = (IR_Lazy_Function*) data;
+    IR_Module *module = (IR_Module*) lazy->module;
+    pthread_mutex_lock(&module->lock);
+    module->cold.ptr[marker.id] = false;
+    pthread_mutex_unlock(&module->lock);
+    lazy->build(module, marker, lazy->data);
+}
+
+Marker ir_declare_tiered_function(void *module_, BuildFunction build, void *data) {
+    IR_Module *module = (IR_Module*) module_;
+    IR_Lazy_Function *lazy = malloc(sizeof(IR_Lazy_Function));
+    *lazy = (IR_Lazy_Function) { module, build, data };
+    Marker marker = ir_target.declare_tiered_function(module->target, ir_build_tiered_function, lazy);
+    pthread_mutex_lock(&module->lock);
+    module->lazy_functions.ptr = ir_grow_list(module->lazy_functions.ptr, module->lazy_functions.length,
+                                              module->lazy_functions.length + 1, sizeof(IR_Lazy_Function*));
+    module->lazy_functions.ptr[module->lazy_functions.length++] = lazy;
+    if (marker.id >= module->cold.length) {
+        module->cold.ptr = ir_grow_list(module->cold.ptr, module->cold.length, marker.id + 1, sizeof(bool));
+        for (size_t i = module->cold.length; i <= marker.id; i++) module->cold.ptr[i] = false;
+        module->cold.length = marker.id + 1;
+    }
+    module->cold.ptr[marker.id] = true;
+    pthread_mutex_unlock(&module->lock);
+    return marker;
+}
+
+void ir_set_tier_threshold(void *module_, int calls) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.set_tier_threshold(module->target, calls);
+}
+
+void ir_import_function(void *module_, Marker marker, void (*funcptr)()) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.import_function(module->target, marker, funcptr);
+}
+
+unsigned ir_get_cpu_features() {
+    return ir_target.get_cpu_features();
+}
+
+void ir_set_cpu_features(void *module_, unsigned features) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.set_cpu_features(module->target, features);
+}
+
+void ir_set_link_threads(void *module_, int threads) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.set_link_threads(module->target, threads);
+}
+
+void ir_set_peephole(void *module_, bool enabled) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.set_peephole(module->target, enabled);
+}
+
+void ir_link(void *module_) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.link(module->target);
+}
+
+void free_function_lists(IR_Function *function) {
+    free(function->instructions.ptr);
+    free(function->calls.ptr);
+    free(function->pool.ptr);
+    function->instructions = (IR_Instructions) {0};
+    function->calls = (IR_Calls) {0};
+    function->pool = (IR_Regs) {0};
+}
+
+void free_body(IR_Body *body) {
+    free(body->instructions.ptr);
+    free(body->calls.ptr);
+    free(body->pool.ptr);
+    free(body);
+}
+
+void ir_free_module(void *module_) {
+    IR_Module *module = (IR_Module*) module_;
+    ir_target.free_module(module->target);
+    for (int i = 0; i < module->functions.length; i++) {
+        free_function_lists(module->functions.ptr[i]);
+        free(module->functions.ptr[i]);
+    }
+    for (int i = 0; i < module->lazy_functions.length; i++) {
+        free(module->lazy_functions.ptr[i]);
+    }
+    for (int i = 0; i < module->signatures.length; i++) {
+        free(module->signatures.ptr[i]);
+    }
+    for (int i = 0; i < module->bodies.length; i++) {
+        if (module->bodies.ptr[i]) free_body(module->bodies.ptr[i]);
+    }
+    free(module->functions.ptr);
+    free(module->lazy_functions.ptr);
+    free(module->signatures.ptr);
+    free(module->bodies.ptr);
+    free(module->cold.ptr);
+    pthread_mutex_destroy(&module->lock);
+    free(module);
+}
+
+// Block handles are block numbers plus one, so the entry block isn't NULL.
+void *ir_block_handle(int block) {
+    return (void*) (intptr_t) (block + 1);
+}
+
+int ir_block_number(void *handle) {
+    return (int) (intptr_t) handle - 1;
+}
+
+void *ir_new_function(void *module_, Marker marker, Types args, CallingConvention *cc, void **entry_bb) {
+    IR_Module *module = (IR_Module*) module_;
+    IR_Function *function = malloc(sizeof(IR_Function));
+    *function = (IR_Function) {
+        .module = module,
+        .marker = marker,
+        .signature = intern_signature(module, args, cc),
+        // args are the first regs
+        .next_reg = args.length,
+        .blocks = 1,
+    };
+    pthread_mutex_lock(&module->lock);
+    module->functions.ptr = ir_grow_list(module->functions.ptr, module->functions.length,
+                                         module->functions.length + 1, sizeof(IR_Function*));
+    module->functions.ptr[module->functions.length++] = function;
+    function->cold = marker.id < module->cold.length && module->cold.ptr[marker.id];
+    pthread_mutex_unlock(&module->lock);
+    *entry_bb = ir_block_handle(0);
+    return function;
+}
+
+Marker ir_label_marker(void *fun) {
+    IR_Function *function = (IR_Function*) fun;
+    return (Marker) { function->labels++ };
+}
+
+Reg ir_arg(void *fun, int arg) {
+    IR_Function *function = (IR_Function*) fun;
+    assert(arg >= 0 && arg < function->signature->types.length);
+    return (Reg) { arg };
+}
+
+// Client discards are dropped: they're recomputed from liveness on finalize.
+Reg ir_immediate_void(void *fun, RegList discards) {
+    return record_immediate(fun, IR_IMMEDIATE_VOID, type(0), 0);
+}
+
+Reg ir_immediate_int32(void *fun, int32_t value, RegList discards) {
+    return record_immediate(fun, IR_IMMEDIATE_INT32, type(4), value);
+}
+
+Reg ir_immediate_int64(void *fun, int64_t value, RegList discards) {
+    return record_immediate(fun, IR_IMMEDIATE_INT64, type(8), value);
+}
+
+Reg ir_immediate_function(void *fun, Marker marker, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_IMMEDIATE_FUNCTION);
+    instruction->type = type(8);
+    instruction->marker = marker;
+    return record_value(function, instruction);
+}
+
+Reg ir_immediate_float32(void *fun, float value, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_IMMEDIATE_FLOAT32);
+    instruction->type = float_type(4);
+    instruction->float32 = value;
+    return record_value(function, instruction);
+}
+
+Reg ir_immediate_float64(void *fun, double value, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_IMMEDIATE_FLOAT64);
+    instruction->type = float_type(8);
+    instruction->float64 = value;
+    return record_value(function, instruction);
+}
+
+Reg ir_add(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_ADD, left, right, INVALID_REG);
+}
+
+Reg ir_sub(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_SUB, left, right, INVALID_REG);
+}
+
+Reg ir_mul(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_MUL, left, right, INVALID_REG);
+}
+
+Reg ir_div(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_DIV, left, right, INVALID_REG);
+}
+
+Reg ir_rem(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_REM, left, right, INVALID_REG);
+}
+
+Reg ir_udiv(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_UDIV, left, right, INVALID_REG);
+}
+
+Reg ir_urem(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_UREM, left, right, INVALID_REG);
+}
+
+Reg ir_bit_and(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_BIT_AND, left, right, INVALID_REG);
+}
+
+Reg ir_bit_or(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_BIT_OR, left, right, INVALID_REG);
+}
+
+Reg ir_bit_xor(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_BIT_XOR, left, right, INVALID_REG);
+}
+
+Reg ir_shl(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_SHL, left, right, INVALID_REG);
+}
+
+Reg ir_shr(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_SHR, left, right, INVALID_REG);
+}
+
+Reg ir_sar(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_SAR, left, right, INVALID_REG);
+}
+
+Reg ir_and_not(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_AND_NOT, left, right, INVALID_REG);
+}
+
+Reg ir_fadd(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_FADD, left, right, INVALID_REG);
+}
+
+Reg ir_fsub(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_FSUB, left, right, INVALID_REG);
+}
+
+Reg ir_fmul(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_FMUL, left, right, INVALID_REG);
+}
+
+Reg ir_fdiv(void *fun, Reg left, Reg right, RegList discards) {
+    return record_op(fun, IR_FDIV, left, right, INVALID_REG);
+}
+
+Reg ir_neg(void *fun, Reg reg, RegList discards) {
+    return record_op(fun, IR_NEG, reg, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_bit_not(void *fun, Reg reg, RegList discards) {
+    return record_op(fun, IR_BIT_NOT, reg, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_count_leading_zeros(void *fun, Reg reg, RegList discards) {
+    return record_op(fun, IR_COUNT_LEADING_ZEROS, reg, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_count_trailing_zeros(void *fun, Reg reg, RegList discards) {
+    return record_op(fun, IR_COUNT_TRAILING_ZEROS, reg, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_popcount(void *fun, Reg reg, RegList discards) {
+    return record_op(fun, IR_POPCOUNT, reg, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_fsqrt(void *fun, Reg reg, RegList discards) {
+    return record_op(fun, IR_FSQRT, reg, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_zero_extend(void *fun, Reg reg, Type to, RegList discards) {
+    return record_typed_op(fun, IR_ZERO_EXTEND, reg, to);
+}
+
+Reg ir_sign_extend(void *fun, Reg reg, Type to, RegList discards) {
+    return record_typed_op(fun, IR_SIGN_EXTEND, reg, to);
+}
+
+Reg ir_truncate(void *fun, Reg reg, Type to, RegList discards) {
+    return record_typed_op(fun, IR_TRUNCATE, reg, to);
+}
+
+Reg ir_convert(void *fun, Reg reg, Type to, RegList discards) {
+    return record_typed_op(fun, IR_CONVERT, reg, to);
+}
+
+Reg ir_fma(void *fun, Reg left, Reg right, Reg addend, RegList discards) {
+    return record_op(fun, IR_FMA, left, right, addend);
+}
+
+Reg ir_vector_add(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
+    return record_vector_op(fun, IR_VECTOR_ADD, lanes, left, right, INVALID_REG);
+}
+
+Reg ir_vector_sub(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
+    return record_vector_op(fun, IR_VECTOR_SUB, lanes, left, right, INVALID_REG);
+}
+
+Reg ir_vector_mul(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
+    return record_vector_op(fun, IR_VECTOR_MUL, lanes, left, right, INVALID_REG);
+}
+
+Reg ir_vector_div(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
+    return record_vector_op(fun, IR_VECTOR_DIV, lanes, left, right, INVALID_REG);
+}
+
+Reg ir_vector_fma(void *fun, Lanes lanes, Reg left, Reg right, Reg addend, RegList discards) {
+    return record_vector_op(fun, IR_VECTOR_FMA, lanes, left, right, addend);
+}
+
+Reg ir_vector_splat(void *fun, Lanes lanes, Reg scalar, RegList discards) {
+    return record_vector_op(fun, IR_VECTOR_SPLAT, lanes, scalar, INVALID_REG, INVALID_REG);
+}
+
+Reg ir_vector_extract(void *fun, Lanes lanes, Reg vector, int lane, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_VECTOR_EXTRACT);
+    instruction->mode = lanes;
+    instruction->operands[0] = vector;
+    instruction->lane = lane;
+    return record_value(function, instruction);
+}
+
+Reg ir_vector_shuffle(void *fun, Lanes lanes, Reg vector, const int *indices, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_VECTOR_SHUFFLE);
+    instruction->mode = lanes;
+    instruction->operands[0] = vector;
+    // 32 or 64-bit lanes: 4 or 2 of them
+    int count = (lanes == LANES_I32 || lanes == LANES_F32) ? 4 : 2;
+    for (int i = 0; i < count; i++) instruction->indices[i] = indices[i];
+    return record_value(function, instruction);
+}
+
+Reg ir_compare(void *fun, Comparison comparison, Reg first, Reg second, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_COMPARE);
+    instruction->mode = comparison;
+    instruction->operands[0] = first;
+    instruction->operands[1] = second;
+    return record_value(function, instruction);
+}
+
+Reg ir_select(void *fun, Comparison comparison, Reg first, Reg second, Reg if_true, Reg if_false, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_SELECT);
+    instruction->mode = comparison;
+    instruction->operands[0] = first;
+    instruction->operands[1] = second;
+    instruction->operands[2] = if_true;
+    instruction->operands[3] = if_false;
+    return record_value(function, instruction);
+}
+
+IR_Instruction *record_address(IR_Function *function, IR_Op op, Address address, Type value_type) {
+    IR_Instruction *instruction = append_instruction(function, op);
+    instruction->operands[0] = address.base;
+    instruction->operands[1] = address.index;
+    instruction->scale = address.scale;
+    instruction->offset = address.offset;
+    instruction->type = value_type;
+    return instruction;
+}
+
+Reg ir_load(void *fun, Address address, Type value_type, bool sign_extend, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = record_address(function, IR_LOAD, address, value_type);
+    if (sign_extend) instruction->flags |= IR_SIGN_EXTEND_LOAD;
+    return record_value(function, instruction);
+}
+
+void ir_store(void *fun, Address address, Reg value, Type value_type, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = record_address(function, IR_STORE, address, value_type);
+    instruction->operands[2] = value;
+}
+
+Reg ir_call(void *fun, Reg target, RegList args, Type ret, Types arg_types, CallingConvention *cc, RegList discards) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Calls *calls = &function->calls;
+    calls->ptr = ir_grow_list(calls->ptr, calls->length, calls->length + 1, sizeof(IR_Call));
+    calls->ptr[calls->length] = (IR_Call) {
+        .args = append_regs(function, args.ptr, args.length),
+        .arg_count = args.length,
+        .signature = intern_signature(function->module, arg_types, cc),
+    };
+    IR_Instruction *instruction = append_instruction(function, IR_CALL);
+    instruction->operands[0] = target;
+    instruction->type = ret;
+    instruction->call = calls->length++;
+    // void calls return INVALID_REG, like in the x86-64 backend
+    if (ret.size == 0) return INVALID_REG;
+    return record_value(function, instruction);
+}
+
+void *ir_begin_bb(void *fun, void *pred_bb) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_BEGIN_BB);
+    instruction->bb.block = function->blocks++;
+    instruction->bb.pred = pred_bb ? ir_block_number(pred_bb) : -1;
+    return ir_block_handle(instruction->bb.block);
+}
+
+void ir_ret(void *fun, Reg reg, Type type, CallingConvention *cc) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_RET);
+    instruction->operands[0] = reg;
+    instruction->type = type;
+    instruction->signature = intern_signature(function->module, (Types) {0}, cc);
+}
+
+void ir_branch(void *fun, Marker marker) {
+    IR_Function *function = (IR_Function*) fun;
+    append_instruction(function, IR_BRANCH)->marker = marker;
+}
+
+void ir_branch_if(void *fun, Comparison comparison, Marker marker, Reg first, Reg second) {
+    IR_Function *function = (IR_Function*) fun;
+    IR_Instruction *instruction = append_instruction(function, IR_BRANCH_IF);
+    instruction->mode = comparison;
+    instruction->operands[0] = first;
+    instruction->operands[1] = second;
+    instruction->marker = marker;
+}
+
+void ir_branch_if_equal(void *fun, Marker marker, Reg first, Reg second) {
+    ir_branch_if(fun, COMPARE_EQ, marker, first, second);
+}
+
+void ir_label(void *fun, Marker marker) {
+    IR_Function *function = (IR_Function*) fun;
+    append_instruction(function, IR_LABEL)->marker = marker;
+}
+
+void ir_discard(void *fun, RegList discards) {
+}
+
+// The IR has liveness of its own, which it hints to the target.
+void ir_hint_next_use(void *fun, Reg reg, int position) {
+}
+
+int ir_get_registers(Type type, int *count, int *preserved) {
+    return ir_target.get_registers(type, count, preserved);
+}
+
+// The IR assigns registers itself, on finalize.
+void ir_hint_register(void *fun, Reg reg, int index) {
+}
+
+static inline Reg replayed_reg(Reg *regs, Reg reg) {
+    return IS_VALID_REG(reg) ? regs[reg.id] : reg;
+}
+
+// Callees with at most this many ops besides their ret are inlined.
+#define IR_INLINE_LIMIT 16
+
+void *copy_list(void *ptr, size_t length, size_t size) {
+    void *copy = ir_grow_list(NULL, 0, length, size);
+    if (length) memcpy(copy, ptr, length * size);
+    return copy;
+}
+
+/**
+ * Keep a copy of the function for callers to inline, if it's small and straight-line.
+ * A tiered function's hot rebuild keeps its tier-0 body, which callers may be inlining.
+ */
+void save_body(IR_Function *function) {
+    IR_Instructions *instructions = &function->instructions;
+    if (function->blocks != 1 || function->labels != 0 || instructions->length == 0) return;
+    if (instructions->ptr[instructions->length - 1].op != IR_RET) return;
+    size_t ops = 0;
+    for (size_t i = 0; i + 1 < instructions->length; i++) {
+        IR_Op op = instructions->ptr[i].op;
+        if (ir_ops[op].flags & IR_CONTROL) return;
+        if (op != IR_NOP) ops++;
+    }
+    if (ops > IR_INLINE_LIMIT) return;
+    IR_Body *body = malloc(sizeof(IR_Body));
+    *body = (IR_Body) {
+        .instructions = { instructions->length, copy_list(instructions->ptr, instructions->length, sizeof(IR_Instruction)) },
+        .calls = { function->calls.length, copy_list(function->calls.ptr, function->calls.length, sizeof(IR_Call)) },
+        .pool = { function->pool.length, copy_list(function->pool.ptr, function->pool.length, sizeof(Reg)) },
+        .next_reg = function->next_reg,
+        .signature = function->signature,
+    };
+    IR_Module *module = function->module;
+    int id = function->marker.id;
+    pthread_mutex_lock(&module->lock);
+    if (id >= module->bodies.length) {
+        module->bodies.ptr = ir_grow_list(module->bodies.ptr, module->bodies.length, id + 1, sizeof(IR_Body*));
+        for (size_t i = module->bodies.length; i <= id; i++) module->bodies.ptr[i] = NULL;
+        module->bodies.length = id + 1;
+    }
+    IR_Body *saved = module->bodies.ptr[id];
+    if (!saved) module->bodies.ptr[id] = body;
+    pthread_mutex_unlock(&module->lock);
+    if (saved) free_body(body);
+}
+
+static inline Reg renamed_reg(Reg *renamed, int count, Reg reg) {
+    return IS_VALID_REG(reg) && reg.id < count ? renamed[reg.id] : reg;
+}
+
+/**
+ * Copy the body in place of the call, with the callee's args taking the call's args, and return what it returns.
+ * The body's values become new regs of the function.
+ */
+Reg inline_body(IR_Function *function, IR_Body *body, uint32_t args) {
+    Reg *map = malloc(body->next_reg * sizeof(Reg));
+    for (int i = 0; i < body->signature->types.length; i++) map[i] = function->pool.ptr[args + i];
+    for (size_t i = 0; i + 1 < body->instructions.length; i++) {
+        IR_Instruction *from = &body->instructions.ptr[i];
+        if (from->op == IR_NOP) continue;
+        IR_Instruction *instruction = append_instruction(function, from->op);
+        *instruction = *from;
+        for (int k = 0; k < 4; k++) instruction->operands[k] = replayed_reg(map, from->operands[k]);
+        if (from->op == IR_CALL) {
+            IR_Call *call = &body->calls.ptr[from->call];
+            uint32_t call_args = append_regs(function, body->pool.ptr + call->args, call->arg_count);
+            for (int k = 0; k < call->arg_count; k++) {
+                function->pool.ptr[call_args + k] = map[function->pool.ptr[call_args + k].id];
+            }
+            IR_Calls *calls = &function->calls;
+            calls->ptr = ir_grow_list(calls->ptr, calls->length, calls->length + 1, sizeof(IR_Call));
+            calls->ptr[calls->length] = (IR_Call) { call_args, call->arg_count, call->signature };
+            instruction->call = calls->length++;
+        }
+        if (IS_VALID_REG(from->result)) map[from->result.id] = record_value(function, instruction);
+    }
+    Reg result = replayed_reg(map, body->instructions.ptr[body->instructions.length - 1].operands[0]);
+    free(map);
+    return result;
+}
+
+/**
+ * Inline the calls to immediate_function markers of small functions that have already been finalized.
+ * Calls in the copied bodies stay calls, so recursion ends after one level.
+ */
+void inline_calls(IR_Function *function) {
+    IR_Module *module = function->module;
+    if (function->calls.length == 0) return;
+    IR_Instructions recorded = function->instructions;
+    function->instructions = (IR_Instructions) {0};
+    int count = function->next_reg;
+    // the function marker each reg has, if any, and the value each call's result is replaced with
+    int *markers = malloc(count * sizeof(int));
+    Reg *renamed = malloc(count * sizeof(Reg));
+    for (int i = 0; i < count; i++) {
+        markers[i] = -1;
+        renamed[i] = (Reg) { i };
+    }
+    for (size_t i = 0; i < recorded.length; i++) {
+        IR_Instruction *instruction = &recorded.ptr[i];
+        for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+            instruction->operands[k] = renamed_reg(renamed, count, instruction->operands[k]);
+        }
+        if (instruction->op == IR_IMMEDIATE_FUNCTION) markers[instruction->result.id] = instruction->marker.id;
+        if (instruction->op == IR_CALL) {
+            IR_Call *call = &function->calls.ptr[instruction->call];
+            for (int k = 0; k < call->arg_count; k++) {
+                function->pool.ptr[call->args + k] = renamed_reg(renamed, count, function->pool.ptr[call->args + k]);
+            }
+            Reg target = instruction->operands[0];
+            int marker = target.id < count ? markers[target.id] : -1;
+            pthread_mutex_lock(&module->lock);
+            IR_Body *body = marker != -1 && marker != function->marker.id && marker < module->bodies.length
+                ? module->bodies.ptr[marker] : NULL;
+            pthread_mutex_unlock(&module->lock);
+            IR_Instruction *ret = body ? &body->instructions.ptr[body->instructions.length - 1] : NULL;
+            if (body && body->signature == call->signature && call->arg_count == body->signature->types.length
+                && memcmp(&ret->type, &instruction->type, sizeof(Type)) == 0) {
+                Reg result = inline_body(function, body, call->args);
+                if (IS_VALID_REG(instruction->result)) renamed[instruction->result.id] = result;
+                function->calls_inlined++;
+                continue;
+            }
+        }
+        IR_Instruction *copy = append_instruction(function, instruction->op);
+        *copy = *instruction;
+    }
+    free(markers);
+    free(renamed);
+    free(recorded.ptr);
+}
+
+/**
+ * Remove pure ops whose values aren't used, in reverse, so that whole chains of them go.
+ * Counts the uses of every value in 'uses'.
+ */
+void remove_dead_ops(IR_Function *function, int *uses) {
+    IR_Instructions *instructions = &function->instructions;
+    for (size_t i = 0; i < instructions->length; i++) {
+        IR_Instruction *instruction = &instructions->ptr[i];
+        for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+            Reg reg = instruction->operands[k];
+            if (IS_VALID_REG(reg)) uses[reg.id]++;
+        }
+        if (instruction->op == IR_CALL) {
+            IR_Call *call = &function->calls.ptr[instruction->call];
+            for (int k = 0; k < call->arg_count; k++) uses[function->pool.ptr[call->args + k].id]++;
+        }
+    }
+    for (size_t i = instructions->length; i-- > 0;) {
+        IR_Instruction *instruction = &instructions->ptr[i];
+        if (!(ir_ops[instruction->op].flags & IR_PURE) || uses[instruction->result.id] > 0) continue;
+        for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+            Reg reg = instruction->operands[k];
+            if (IS_VALID_REG(reg)) uses[reg.id]--;
+        }
+        instruction->op = IR_NOP;
+        function->ops_removed++;
+    }
+}
+
+/**
+ * A straight run of instructions: from the start of a block or a label, up to the next one.
+ * Control only enters at the start and leaves at the end.
+ */
+typedef struct {
+    size_t start;
+    size_t end;
+    // For segments that start a block: the segment whose end state the block continues, or -1.
+    int pred;
+} IR_Segment;
+
+typedef struct {
+    int from;
+    int to;
+} IR_Edge;
+
+typedef struct {
+    int length;
+    IR_Segment *ptr;
+    int edge_count;
+    IR_Edge *edges;
+} IR_Flow_Graph;
+
+/**
+ * Split the function into segments, with an edge for every way control can get from one to another.
+ * A block that continues another one is treated as a successor of where that one ended:
+ * it starts with its register state. Extra edges only make values live longer.
+ * With 'state_edges', only edges that carry register state are kept: a block only has the one from the block
+ * it continues, and none if it starts a new state, not the one from the conditional branch that falls into it.
+ */
+IR_Flow_Graph build_flow_graph(IR_Function *function, bool state_edges) {
+    IR_Instructions *instructions = &function->instructions;
+    IR_Flow_Graph graph = {0};
+    int max_segments = function->blocks + function->labels;
+    graph.ptr = malloc(max_segments * sizeof(IR_Segment));
+    graph.edges = malloc(3 * max_segments * sizeof(IR_Edge));
+    // where each block and label is, so far
+    int *block_segment = malloc((function->blocks + function->labels) * sizeof(int));
+    int *label_segment = block_segment + function->blocks;
+    graph.ptr[graph.length++] = (IR_Segment) { 0, 0, -1 };
+    block_segment[0] = 0;
+    int block = 0;
+    // the segment ended with a branch or ret
+    bool ended = false;
+    IR_Op last_op = IR_NOP;
+    for (size_t i = 0; i < instructions->length; i++) {
+        IR_Instruction *instruction = &instructions->ptr[i];
+        if (instruction->op == IR_BEGIN_BB || instruction->op == IR_LABEL) {
+            int segment = graph.length;
+            graph.ptr[segment - 1].end = i;
+            graph.ptr[graph.length++] = (IR_Segment) { i, i, -1 };
+            if (instruction->op == IR_BEGIN_BB) {
+                int pred = instruction->bb.pred;
+                if (pred != -1) {
+                    graph.ptr[segment].pred = block_segment[pred];
+                    graph.edges[graph.edge_count++] = (IR_Edge) { block_segment[pred], segment };
+                }
+                // falling through from a conditional branch
+                if (last_op == IR_BRANCH_IF && !state_edges) graph.edges[graph.edge_count++] = (IR_Edge) { segment - 1, segment };
+                block = instruction->bb.block;
+            } else {
+                if (!ended) graph.edges[graph.edge_count++] = (IR_Edge) { segment - 1, segment };
+                label_segment[instruction->marker.id] = segment;
+            }
+            block_segment[block] = segment;
+            ended = false;
+        } else if (instruction->op == IR_RET || instruction->op == IR_BRANCH || instruction->op == IR_BRANCH_IF) {
+            ended = true;
+        }
+        if (instruction->op != IR_NOP) last_op = instruction->op;
+    }
+    graph.ptr[graph.length - 1].end = instructions->length;
+    // branches to labels, which may come after them
+    for (int s = 0; s < graph.length; s++) {
+        IR_Segment *segment = &graph.ptr[s];
+        if (segment->end == segment->start) continue;
+        IR_Instruction *last = &instructions->ptr[segment->end - 1];
+        if (last->op == IR_BRANCH || last->op == IR_BRANCH_IF) {
+            graph.edges[graph.edge_count++] = (IR_Edge) { s, label_segment[last->marker.id] };
+        }
+    }
+    free(block_segment);
+    return graph;
+}
+
+static inline bool bit_set(uint64_t *bits, int index) {
+    return bits[index / 64] & (1ull << (index % 64));
+}
+
+static inline void set_bit(uint64_t *bits, int index) {
+    bits[index / 64] |= 1ull << (index % 64);
+}
+
+static inline void clear_bit(uint64_t *bits, int index) {
+    bits[index / 64] &= ~(1ull << (index % 64));
+}
+
+// Mark the value if it's not live yet, and add it to 'regs': this is its last use.
+void last_use(uint64_t *live, Reg reg, IR_Regs *regs, bool discard) {
+    if (!IS_VALID_REG(reg) || bit_set(live, reg.id)) return;
+    set_bit(live, reg.id);
+    if (!discard) return;
+    regs->ptr = ir_grow_list(regs->ptr, regs->length, regs->length + 1, sizeof(Reg));
+    regs->ptr[regs->length++] = reg;
+}
+
+// Add the values in a segment's end state: its live values, and what its branch or ret used last.
+void add_end_state(IR_Function *function, IR_Flow_Graph *graph, uint64_t *out, int words, int segment, uint64_t *live) {
+    for (int w = 0; w < words; w++) live[w] |= out[segment * words + w];
+    IR_Segment *end_segment = &graph->ptr[segment];
+    if (end_segment->end == end_segment->start) return;
+    IR_Instruction *last = &function->instructions.ptr[end_segment->end - 1];
+    if (last->op != IR_BRANCH_IF && last->op != IR_RET) return;
+    for (int k = 0; k < ir_ops[last->op].operands; k++) {
+        if (IS_VALID_REG(last->operands[k])) set_bit(live, last->operands[k].id);
+    }
+}
+
+// Where a value is live, as instruction indices plus one: from where it's defined, or 0 for args, up to its last use
+// or the end of the last segment it's live out of. Positions in between may be on other paths.
+typedef struct {
+    size_t start;
+    size_t end;
+} IR_Interval;
+
+static inline void widen_interval(IR_Interval *interval, size_t position) {
+    if (interval->end < position) interval->end = position;
+}
+
+/**
+ * Discard every value right after its last use, from liveness over the flow graph.
+ * Branches and rets can't discard: values last used there are discarded at the start of the blocks
+ * and labels they reach, along with what's only live on other edges.
+ * 'intervals' gets where each value is live, for register allocation.
+ */
+void compute_discards(IR_Function *function, IR_Interval *intervals) {
+    IR_Instructions *instructions = &function->instructions;
+    IR_Flow_Graph graph = build_flow_graph(function, false);
+    int words = (function->next_reg + 63) / 64;
+    // per segment: used before defined, defined, live in, live out
+    uint64_t *bits = calloc(4 * graph.length * words + words, sizeof(uint64_t));
+    uint64_t *use = bits, *def = use + graph.length * words;
+    uint64_t *in = def + graph.length * words, *out = in + graph.length * words;
+    uint64_t *live = out + graph.length * words;
+    IR_Regs regs = {0};
+    for (int s = 0; s < graph.length; s++) {
+        for (size_t i = graph.ptr[s].start; i < graph.ptr[s].end; i++) {
+            IR_Instruction *instruction = &instructions->ptr[i];
+            for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+                Reg reg = instruction->operands[k];
+                if (IS_VALID_REG(reg) && !bit_set(def + s * words, reg.id)) set_bit(use + s * words, reg.id);
+            }
+            if (instruction->op == IR_CALL) {
+                IR_Call *call = &function->calls.ptr[instruction->call];
+                for (int k = 0; k < call->arg_count; k++) {
+                    Reg reg = function->pool.ptr[call->args + k];
+                    if (!bit_set(def + s * words, reg.id)) set_bit(use + s * words, reg.id);
+                }
+            }
+            if (IS_VALID_REG(instruction->result)) {
+                set_bit(def + s * words, instruction->result.id);
+                intervals[instruction->result.id] = (IR_Interval) { i + 1, i + 1 };
+            }
+        }
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int e = graph.edge_count - 1; e >= 0; e--) {
+            uint64_t *from_out = out + graph.edges[e].from * words, *to_in = in + graph.edges[e].to * words;
+            for (int w = 0; w < words; w++) from_out[w] |= to_in[w];
+        }
+        for (int s = graph.length - 1; s >= 0; s--) {
+            for (int w = 0; w < words; w++) {
+                uint64_t value = use[s * words + w] | (out[s * words + w] & ~def[s * words + w]);
+                if (value != in[s * words + w]) changed = true;
+                in[s * words + w] = value;
+            }
+        }
+    }
+    for (int s = 0; s < graph.length; s++) {
+        memcpy(live, out + s * words, words * sizeof(uint64_t));
+        for (int w = 0; w < words; w++) {
+            for (uint64_t bits = live[w]; bits; bits &= bits - 1) {
+                widen_interval(&intervals[w * 64 + __builtin_ctzll(bits)], graph.ptr[s].end);
+            }
+        }
+        for (size_t i = graph.ptr[s].end; i-- > graph.ptr[s].start;) {
+            IR_Instruction *instruction = &instructions->ptr[i];
+            if (instruction->op == IR_NOP) continue;
+            Reg result = instruction->result;
+            if (IS_VALID_REG(result)) {
+                if (!bit_set(live, result.id)) instruction->flags |= IR_UNUSED_RESULT;
+                clear_bit(live, result.id);
+            }
+            bool discard = !(ir_ops[instruction->op].flags & IR_CONTROL);
+            regs.length = 0;
+            for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+                Reg reg = instruction->operands[k];
+                if (IS_VALID_REG(reg)) widen_interval(&intervals[reg.id], i + 1);
+                last_use(live, reg, &regs, discard);
+            }
+            if (instruction->op == IR_CALL) {
+                IR_Call *call = &function->calls.ptr[instruction->call];
+                for (int k = 0; k < call->arg_count; k++) {
+                    Reg reg = function->pool.ptr[call->args + k];
+                    widen_interval(&intervals[reg.id], i + 1);
+                    last_use(live, reg, &regs, true);
+                }
+            }
+            if (regs.length) {
+                instruction->discards = append_regs(function, regs.ptr, regs.length);
+                instruction->discard_count = regs.length;
+            }
+        }
+    }
+    for (int s = 0; s < graph.length; s++) {
+        IR_Instruction *first = &instructions->ptr[graph.ptr[s].start];
+        if (graph.ptr[s].end == graph.ptr[s].start) continue;
+        // What the segment's starting state may have: a block continues its pred's state,
+        // and a label takes the state of whichever edge reaches it first.
+        memset(live, 0, words * sizeof(uint64_t));
+        if (first->op == IR_BEGIN_BB) {
+            if (graph.ptr[s].pred == -1) continue;
+            add_end_state(function, &graph, out, words, graph.ptr[s].pred, live);
+        } else if (first->op == IR_LABEL) {
+            for (int e = 0; e < graph.edge_count; e++) {
+                if (graph.edges[e].to == s) add_end_state(function, &graph, out, words, graph.edges[e].from, live);
+            }
+        } else {
+            continue;
+        }
+        regs.length = 0;
+        for (int w = 0; w < words; w++) {
+            uint64_t dead = live[w] & ~in[s * words + w];
+            for (int b = 0; dead; b++, dead >>= 1) {
+                // Values defined further down, like those a back edge uses, aren't replayed yet.
+                Reg reg = { w * 64 + b };
+                if ((dead & 1) && intervals[reg.id].start <= graph.ptr[s].start + 1) last_use(in + s * words, reg, &regs, true);
+            }
+        }
+        if (regs.length) {
+            first->discards = append_regs(function, regs.ptr, regs.length);
+            first->discard_count = regs.length;
+        }
+    }
+    free(regs.ptr);
+    free(bits);
+    free(graph.ptr);
+    free(graph.edges);
+}
+
+/**
+ * Immediate dominators of the segments, from the flow graph, as in Cooper, Harvey and Kennedy.
+ * Segments without edges into them, like the entry, are roots: they hang off a virtual root at index graph->length,
+ * so no segment dominates another one's tree.
+ * 'order' gets each segment's position in reverse postorder, or -1 where it can't be reached; the root is at 0.
+ */
+int *compute_dominators(IR_Flow_Graph *graph, int *order) {
+    int n = graph->length + 1, root = graph->length;
+    // the graph's edges, and one from the root to each segment nothing else leads to
+    IR_Edge *edges = malloc((graph->edge_count + n) * sizeof(IR_Edge));
+    memcpy(edges, graph->edges, graph->edge_count * sizeof(IR_Edge));
+    bool *entered = calloc(n, sizeof(bool));
+    for (int e = 0; e < graph->edge_count; e++) entered[graph->edges[e].to] = true;
+    int edge_count = graph->edge_count;
+    for (int s = 0; s < root; s++) {
+        if (!entered[s]) edges[edge_count++] = (IR_Edge) { root, s };
+    }
+    free(entered);
+    // edges by source and by target
+    int *succ_start = calloc(2 * (n + 1), sizeof(int)), *pred_start = succ_start + n + 1;
+    int *succs = malloc(2 * (edge_count + 1) * sizeof(int)), *preds = succs + edge_count + 1;
+    for (int e = 0; e < edge_count; e++) {
+        succ_start[edges[e].from + 1]++;
+        pred_start[edges[e].to + 1]++;
+    }
+    for (int s = 0; s < n; s++) {
+        succ_start[s + 1] += succ_start[s];
+        pred_start[s + 1] += pred_start[s];
+    }
+    int *fill = malloc(2 * n * sizeof(int));
+    memcpy(fill, succ_start, n * sizeof(int));
+    memcpy(fill + n, pred_start, n * sizeof(int));
+    for (int e = 0; e < edge_count; e++) {
+        succs[fill[edges[e].from]++] = edges[e].to;
+        preds[fill[n + edges[e].to]++] = edges[e].from;
+    }
+    free(edges);
+    // postorder by depth-first search from the root, then reversed
+    int *postorder = malloc(n * sizeof(int)), *stack = fill, *next_succ = fill + n, count = 0, depth = 0;
+    for (int s = 0; s < n; s++) order[s] = -1;
+    stack[depth++] = root;
+    order[root] = 0;
+    next_succ[root] = succ_start[root];
+    while (depth) {
+        int s = stack[depth - 1];
+        if (next_succ[s] < succ_start[s + 1]) {
+            int succ = succs[next_succ[s]++];
+            if (order[succ] == -1) {
+                order[succ] = 0;
+                next_succ[succ] = succ_start[succ];
+                stack[depth++] = succ;
+            }
+        } else {
+            postorder[count++] = s;
+            depth--;
+        }
+    }
+    for (int i = 0; i < count; i++) order[postorder[count - 1 - i]] = i;
+    int *idom = malloc(n * sizeof(int));
+    for (int s = 0; s < n; s++) idom[s] = -1;
+    idom[root] = root;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = count - 2; i >= 0; i--) {
+            int s = postorder[i], new_idom = -1;
+            for (int k = pred_start[s]; k < pred_start[s + 1]; k++) {
+                int pred = preds[k];
+                if (idom[pred] == -1) continue;
+                if (new_idom == -1) {
+                    new_idom = pred;
+                    continue;
+                }
+                // walk both up to their common dominator
+                int a = pred, b = new_idom;
+                while (a != b) {
+                    while (order[a] > order[b]) a = idom[a];
+                    while (order[b] > order[a]) b = idom[b];
+                }
+                new_idom = a;
+            }
+            if (new_idom != idom[s]) {
+                idom[s] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    free(postorder);
+    free(fill);
+    free(succs);
+    free(succ_start);
+    return idom;
+}
+
+bool dominates(int *idom, int *order, int dominator, int segment) {
+    if (order[dominator] == -1 || order[segment] == -1) return dominator == segment;
+    while (order[segment] > order[dominator]) segment = idom[segment];
+    return segment == dominator;
+}
+
+// An add, sub or literal that later ones with the same key can reuse, where its segment dominates theirs.
+typedef struct {
+    uint8_t op;
+    Reg operands[2];
+    // the literal's bits, or the function's marker
+    int64_t value;
+    Reg result;
+    int segment;
+} IR_Value;
+
+static inline bool numbered_op(IR_Op op) {
+    return op == IR_ADD || op == IR_SUB || (op >= IR_IMMEDIATE_INT32 && op <= IR_IMMEDIATE_FLOAT64);
+}
+
+static inline size_t value_hash(IR_Value *value) {
+    uint64_t hash = value->op;
+    hash = hash * 0x9e3779b97f4a7c15ull + (uint32_t) value->operands[0].id;
+    hash = hash * 0x9e3779b97f4a7c15ull + (uint32_t) value->operands[1].id;
+    hash = hash * 0x9e3779b97f4a7c15ull + (uint64_t) value->value;
+    return hash ^ (hash >> 29);
+}
+
+/**
+ * Value numbering: an add, sub or literal that's already been computed in a dominating segment
+ * is removed, and its uses take the earlier value instead. Segments go in reverse postorder,
+ * so operands are renamed before the ops that use them are looked up.
+ */
+void reuse_values(IR_Function *function) {
+    IR_Instructions *instructions = &function->instructions;
+    size_t candidates = 0;
+    for (size_t i = 0; i < instructions->length; i++) {
+        if (numbered_op(instructions->ptr[i].op)) candidates++;
+    }
+    if (candidates < 2) return;
+    // Values can only be reused where the backend still has them: along the edges that carry register state.
+    IR_Flow_Graph graph = build_flow_graph(function, true);
+    int *order = malloc((graph.length + 1) * sizeof(int));
+    int *idom = compute_dominators(&graph, order);
+    int *by_order = malloc((graph.length + 1) * sizeof(int));
+    int reachable = 0;
+    for (int s = 0; s < graph.length; s++) {
+        if (order[s] != -1) {
+            by_order[order[s]] = s;
+            reachable++;
+        }
+    }
+    size_t capacity = ir_list_capacity(2 * candidates);
+    IR_Value *table = malloc(capacity * sizeof(IR_Value));
+    for (size_t i = 0; i < capacity; i++) table[i].segment = -1;
+    Reg *renamed = malloc((function->next_reg + 1) * sizeof(Reg));
+    for (int i = 0; i < function->next_reg; i++) renamed[i] = (Reg) { i };
+    for (int k = 1; k <= reachable; k++) {
+        int s = by_order[k];
+        for (size_t i = graph.ptr[s].start; i < graph.ptr[s].end; i++) {
+            IR_Instruction *instruction = &instructions->ptr[i];
+            if (!numbered_op(instruction->op)) continue;
+            IR_Value value = { instruction->op, { INVALID_REG, INVALID_REG }, 0, instruction->result, s };
+            if (instruction->op == IR_ADD || instruction->op == IR_SUB) {
+                value.operands[0] = renamed[instruction->operands[0].id];
+                value.operands[1] = renamed[instruction->operands[1].id];
+                // a + b is b + a
+                if (instruction->op == IR_ADD && value.operands[0].id > value.operands[1].id) {
+                    value.operands[0] = value.operands[1];
+                    value.operands[1] = renamed[instruction->operands[0].id];
+                }
+            } else if (instruction->op == IR_IMMEDIATE_FUNCTION) {
+                value.value = instruction->marker.id;
+            } else if (instruction->op == IR_IMMEDIATE_FLOAT32) {
+                uint32_t bits;
+                memcpy(&bits, &instruction->float32, sizeof(bits));
+                value.value = bits;
+            } else {
+                // int32 and int64 literals, and float64 bits
+                value.value = instruction->value;
+            }
+            size_t slot = value_hash(&value) & (capacity - 1);
+            bool reused = false;
+            for (; table[slot].segment != -1; slot = (slot + 1) & (capacity - 1)) {
+                IR_Value *entry = &table[slot];
+                if (entry->op == value.op && entry->operands[0].id == value.operands[0].id
+                    && entry->operands[1].id == value.operands[1].id && entry->value == value.value
+                    && dominates(idom, order, entry->segment, s)) {
+                    renamed[instruction->result.id] = entry->result;
+                    instruction->op = IR_NOP;
+                    function->ops_reused++;
+                    reused = true;
+                    break;
+                }
+            }
+            if (!reused) table[slot] = value;
+        }
+    }
+    // rename the uses, wherever they are
+    for (size_t i = 0; i < instructions->length; i++) {
+        IR_Instruction *instruction = &instructions->ptr[i];
+        for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+            Reg *reg = &instruction->operands[k];
+            if (IS_VALID_REG(*reg)) *reg = renamed[reg->id];
+        }
+    }
+    for (size_t i = 0; i < function->calls.length; i++) {
+        IR_Call *call = &function->calls.ptr[i];
+        for (int k = 0; k < call->arg_count; k++) {
+            Reg *reg = &function->pool.ptr[call->args + k];
+            *reg = renamed[reg->id];
+        }
+    }
+    free(renamed);
+    free(table);
+    free(by_order);
+    free(idom);
+    free(order);
+    free(graph.ptr);
+    free(graph.edges);
+}
+
+/**
+ * Where every value is used, as instruction indices plus one, in instruction order:
+ * value v's uses are at positions[starts[v]] up to positions[starts[v + 1]].
+ */
+typedef struct {
+    int *starts;
+    int *positions;
+} IR_Use_Positions;
+
+IR_Use_Positions collect_use_positions(IR_Function *function) {
+    IR_Instructions *instructions = &function->instructions;
+    int *starts = calloc(function->next_reg + 2, sizeof(int));
+    // count into starts[v + 2], then sum up into starts[v + 1], which fills in moves back to starts[v]
+    for (int pass = 0; pass < 2; pass++) {
+        int *positions = pass ? malloc((starts[function->next_reg + 1] + 1) * sizeof(int)) : NULL;
+        for (size_t i = 0; i < instructions->length; i++) {
+            IR_Instruction *instruction = &instructions->ptr[i];
+            if (instruction->op == IR_NOP) continue;
+            IR_Call *call = instruction->op == IR_CALL ? &function->calls.ptr[instruction->call] : NULL;
+            int operands = ir_ops[instruction->op].operands, count = operands + (call ? call->arg_count : 0);
+            for (int k = 0; k < count; k++) {
+                Reg reg = k < operands ? instruction->operands[k] : function->pool.ptr[call->args + k - operands];
+                if (!IS_VALID_REG(reg)) continue;
+                if (pass) positions[starts[reg.id + 1]++] = i + 1;
+                else starts[reg.id + 2]++;
+            }
+        }
+        if (pass) return (IR_Use_Positions) { starts, positions };
+        for (int v = 2; v <= function->next_reg + 1; v++) starts[v] += starts[v - 1];
+    }
+    assert(false);
+}
+
+// Tell the target where the value is used next after 'position', from its cursor into its use positions.
+void hint_next_use(void *fun, IR_Use_Positions *uses, int *cursors, Reg reg, Reg replayed, int position) {
+    while (cursors[reg.id] < uses->starts[reg.id + 1] && uses->positions[cursors[reg.id]] <= position) cursors[reg.id]++;
+    int next = cursors[reg.id] < uses->starts[reg.id + 1] ? uses->positions[cursors[reg.id]] : 0;
+    ir_target.hint_next_use(fun, replayed, next);
+}
+
+// The target's register classes and counts are small.
+#define IR_REGISTER_CLASSES 4
+#define IR_MAX_REGISTERS 32
+
+/**
+ * The type of an instruction's result, as far as the register class goes, from the types of the values before it.
+ * Most ops don't record one: their result has their first operand's type.
+ */
+Type result_type(Type *types, IR_Instruction *instruction) {
+    switch (instruction->op) {
+    case IR_IMMEDIATE_VOID: case IR_IMMEDIATE_INT32: case IR_IMMEDIATE_INT64: case IR_IMMEDIATE_FUNCTION:
+    case IR_IMMEDIATE_FLOAT32: case IR_IMMEDIATE_FLOAT64: case IR_ZERO_EXTEND: case IR_SIGN_EXTEND: case IR_TRUNCATE:
+    case IR_CONVERT: case IR_LOAD: case IR_CALL:
+        return instruction->type;
+    case IR_COMPARE: return type(8);
+    case IR_SELECT: return types[instruction->operands[2].id];
+    case IR_VECTOR_EXTRACT: {
+        int size = 1 << (instruction->mode == LANES_F32 ? 2 : instruction->mode == LANES_F64 ? 3 : instruction->mode);
+        return instruction->mode >= LANES_F32 ? float_type(size) : type(size);
+    }
+    case IR_VECTOR_ADD: case IR_VECTOR_SUB: case IR_VECTOR_MUL: case IR_VECTOR_DIV: case IR_VECTOR_FMA:
+    case IR_VECTOR_SPLAT: case IR_VECTOR_SHUFFLE:
+        return vector_type(16);
+    default: return types[instruction->operands[0].id];
+    }
+}
+
+/**
+ * Linear scan register allocation, as in Poletto and Sarkar: the values take the target's registers in the order
+ * they're defined, and when a class runs out, of the value and those in the registers it could take, the one that's
+ * live the furthest goes to memory. Values live across a call only take registers that calls preserve;
+ * the others try the ones that calls don't first. Literals and unused results don't need one.
+ * 'assigned' gets each value's register in its class, -1 for memory, or -2 where it needs none.
+ */
+void assign_registers(IR_Function *function, IR_Interval *intervals, int *assigned) {
+    IR_Instructions *instructions = &function->instructions;
+    IR_Signature *signature = function->signature;
+    Type *types = malloc((function->next_reg + 1) * sizeof(Type));
+    // values by where they're defined, and how many calls there are before each position
+    int *order = malloc((function->next_reg + 1) * sizeof(int)), count = 0;
+    size_t *calls_before = malloc((instructions->length + 2) * sizeof(size_t));
+    for (int v = 0; v < function->next_reg; v++) assigned[v] = -2;
+    for (int i = 0; i < signature->types.length; i++) {
+        types[i] = signature->types.ptr[i];
+        order[count++] = i;
+    }
+    calls_before[0] = calls_before[1] = 0;
+    for (size_t i = 0; i < instructions->length; i++) {
+        IR_Instruction *instruction = &instructions->ptr[i];
+        calls_before[i + 2] = calls_before[i + 1] + (instruction->op == IR_CALL);
+        if (instruction->op == IR_NOP || !IS_VALID_REG(instruction->result)) continue;
+        types[instruction->result.id] = result_type(types, instruction);
+        bool literal = instruction->op >= IR_IMMEDIATE_VOID && instruction->op <= IR_IMMEDIATE_FLOAT64;
+        if (!literal && !(instruction->flags & IR_UNUSED_RESULT)) order[count++] = instruction->result.id;
+    }
+    // the value in each register, or -1
+    int owners[IR_REGISTER_CLASSES][IR_MAX_REGISTERS];
+    memset(owners, -1, sizeof(owners));
+    for (int k = 0; k < count; k++) {
+        int v = order[k], registers, preserved;
+        int class = ir_target.get_registers(types[v], &registers, &preserved);
+        assert(class < IR_REGISTER_CLASSES && registers <= IR_MAX_REGISTERS);
+        int *owner = owners[class];
+        IR_Interval *interval = &intervals[v];
+        for (int r = 0; r < registers; r++) {
+            if (owner[r] != -1 && intervals[owner[r]].end <= interval->start) owner[r] = -1;
+        }
+        bool across_call = calls_before[interval->end] > calls_before[interval->start + 1];
+        int allowed = across_call ? preserved : registers, chosen = -1;
+        for (int r = across_call ? 0 : preserved; r < allowed && chosen == -1; r++) {
+            if (owner[r] == -1) chosen = r;
+        }
+        for (int r = 0; r < preserved && chosen == -1; r++) {
+            if (owner[r] == -1) chosen = r;
+        }
+        if (chosen == -1) {
+            int furthest = -1;
+            for (int r = 0; r < allowed; r++) {
+                if (furthest == -1 || intervals[owner[r]].end > intervals[owner[furthest]].end) furthest = r;
+            }
+            if (furthest != -1 && intervals[owner[furthest]].end > interval->end) {
+                assigned[owner[furthest]] = -1;
+                chosen = furthest;
+            }
+        }
+        assigned[v] = chosen;
+        if (chosen != -1) owner[chosen] = v;
+    }
+    free(calls_before);
+    free(order);
+    free(types);
+}
+
+// A list of regs in the function's pool, replayed into 'mapped', at the same offset.
+RegList replayed_list(IR_Function *function, Reg *regs, Reg *mapped, uint32_t offset, uint32_t length) {
+    for (uint32_t i = offset; i < offset + length; i++) {
+        mapped[i] = replayed_reg(regs, function->pool.ptr[i]);
+        assert(IS_VALID_REG(mapped[i]));
+    }
+    return (RegList) { length, mapped + offset };
+}
+
+// Build the function with the target backend, op by op, with the registers in 'assigned' as hints.
+void replay_function(IR_Function *function, int *uses, int *assigned) {
+    Backend *t = &ir_target;
+    void *entry;
+    IR_Signature *signature = function->signature;
+    void *fun = t->new_function(function->module->target, function->marker, signature->types, &signature->cc.base, &entry);
+    function->target = fun;
+    Reg *regs = malloc((function->next_reg + 1) * sizeof(Reg));
+    for (int i = 0; i <= function->next_reg; i++) regs[i] = INVALID_REG;
+    Reg *mapped = malloc((function->pool.length + 1) * sizeof(Reg));
+    void **blocks = malloc(function->blocks * sizeof(void*));
+    Marker *labels = malloc((function->labels + 1) * sizeof(Marker));
+    blocks[0] = entry;
+    for (int i = 0; i < function->labels; i++) labels[i] = t->label_marker(fun);
+    // Liveness tells the target which values are used furthest away, for when it has to spill.
+    IR_Use_Positions use_positions = collect_use_positions(function);
+    int *cursors = malloc((function->next_reg + 1) * sizeof(int));
+    memcpy(cursors, use_positions.starts, (function->next_reg + 1) * sizeof(int));
+    // values created in the target, args first
+    int replayed = signature->types.length;
+    for (int i = 0; i < signature->types.length; i++) {
+        regs[i] = t->arg(fun, i);
+        if (uses[i] == 0) {
+            t->discard(fun, (RegList) { 1, &regs[i] });
+            continue;
+        }
+        hint_next_use(fun, &use_positions, cursors, (Reg) { i }, regs[i], 0);
+        t->hint_register(fun, regs[i], assigned[i]);
+    }
+    IR_Instructions *instructions = &function->instructions;
+    for (size_t i = 0; i < instructions->length; i++) {
+        IR_Instruction *instruction = &instructions->ptr[i];
+        Reg a = replayed_reg(regs, instruction->operands[0]);
+        Reg b = replayed_reg(regs, instruction->operands[1]);
+        Reg c = replayed_reg(regs, instruction->operands[2]);
+        Reg d = replayed_reg(regs, instruction->operands[3]);
+        RegList discards = replayed_list(function, regs, mapped, instruction->discards, instruction->discard_count);
+        Reg result = INVALID_REG;
+        switch (instruction->op) {
+        case IR_NOP: continue;
+        case IR_IMMEDIATE_VOID: result = t->immediate_void(fun, discards); break;
+        case IR_IMMEDIATE_INT32: result = t->immediate_int32(fun, (int32_t) instruction->value, discards); break;
+        case IR_IMMEDIATE_INT64: result = t->immediate_int64(fun, instruction->value, discards); break;
+        case IR_IMMEDIATE_FUNCTION: result = t->immediate_function(fun, instruction->marker, discards); break;
+        case IR_IMMEDIATE_FLOAT32: result = t->immediate_float32(fun, instruction->float32, discards); break;
+        case IR_IMMEDIATE_FLOAT64: result = t->immediate_float64(fun, instruction->float64, discards); break;
+        case IR_ADD: result = t->add(fun, a, b, discards); break;
+        case IR_SUB: result = t->sub(fun, a, b, discards); break;
+        case IR_MUL: result = t->mul(fun, a, b, discards); break;
+        case IR_DIV: result = t->div(fun, a, b, discards); break;
+        case IR_REM: result = t->rem(fun, a, b, discards); break;
+        case IR_UDIV: result = t->udiv(fun, a, b, discards); break;
+        case IR_UREM: result = t->urem(fun, a, b, discards); break;
+        case IR_BIT_AND: result = t->bit_and(fun, a, b, discards); break;
+        case IR_BIT_OR: result = t->bit_or(fun, a, b, discards); break;
+        case IR_BIT_XOR: result = t->bit_xor(fun, a, b, discards); break;
+        case IR_SHL: result = t->shl(fun, a, b, discards); break;
+        case IR_SHR: result = t->shr(fun, a, b, discards); break;
+        case IR_SAR: result = t->sar(fun, a, b, discards); break;
+        case IR_AND_NOT: result = t->and_not(fun, a, b, discards); break;
+        case IR_FADD: result = t->fadd(fun, a, b, discards); break;
+        case IR_FSUB: result = t->fsub(fun, a, b, discards); break;
+        case IR_FMUL: result = t->fmul(fun, a, b, discards); break;
+        case IR_FDIV: result = t->fdiv(fun, a, b, discards); break;
+        case IR_NEG: result = t->neg(fun, a, discards); break;
+        case IR_BIT_NOT: result = t->bit_not(fun, a, discards); break;
+        case IR_COUNT_LEADING_ZEROS: result = t->count_leading_zeros(fun, a, discards); break;
+        case IR_COUNT_TRAILING_ZEROS: result = t->count_trailing_zeros(fun, a, discards); break;
+        case IR_POPCOUNT: result = t->popcount(fun, a, discards); break;
+        case IR_FSQRT: result = t->fsqrt(fun, a, discards); break;
+        case IR_ZERO_EXTEND: result = t->zero_extend(fun, a, instruction->type, discards); break;
+        case IR_SIGN_EXTEND: result = t->sign_extend(fun, a, instruction->type, discards); break;
+        case IR_TRUNCATE: result = t->truncate(fun, a, instruction->type, discards); break;
+        case IR_CONVERT: result = t->convert(fun, a, instruction->type, discards); break;
+        case IR_FMA: result = t->fma(fun, a, b, c, discards); break;
+        case IR_VECTOR_ADD: result = t->vector_add(fun, instruction->mode, a, b, discards); break;
+        case IR_VECTOR_SUB: result = t->vector_sub(fun, instruction->mode, a, b, discards); break;
+        case IR_VECTOR_MUL: result = t->vector_mul(fun, instruction->mode, a, b, discards); break;
+        case IR_VECTOR_DIV: result = t->vector_div(fun, instruction->mode, a, b, discards); break;
+        case IR_VECTOR_FMA: result = t->vector_fma(fun, instruction->mode, a, b, c, discards); break;
+        case IR_VECTOR_SPLAT: result = t->vector_splat(fun, instruction->mode, a, discards); break;
+        case IR_VECTOR_EXTRACT: result = t->vector_extract(fun, instruction->mode, a, instruction->lane, discards); break;
+        case IR_VECTOR_SHUFFLE: {
+            int indices[4];
+            for (int k = 0; k < 4; k++) indices[k] = instruction->indices[k];
+            result = t->vector_shuffle(fun, instruction->mode, a, indices, discards);
+            break;
+        }
+        case IR_COMPARE: result = t->compare(fun, instruction->mode, a, b, discards); break;
+        case IR_SELECT: result = t->select(fun, instruction->mode, a, b, c, d, discards); break;
+        case IR_LOAD: {
+            Address address = { a, b, instruction->scale, instruction->offset };
+            bool sign_extend = instruction->flags & IR_SIGN_EXTEND_LOAD;
+            result = t->load(fun, address, instruction->type, sign_extend, discards);
+            break;
+        }
+        case IR_STORE:
+            t->store(fun, (Address) { a, b, instruction->scale, instruction->offset }, c, instruction->type, discards);
+            break;
+        case IR_CALL: {
+            IR_Call *call = &function->calls.ptr[instruction->call];
+            RegList args = replayed_list(function, regs, mapped, call->args, call->arg_count);
+            result = t->call(fun, a, args, instruction->type, call->signature->types, &call->signature->cc.base, discards);
+            break;
+        }
+        case IR_BEGIN_BB: {
+            int pred = instruction->bb.pred;
+            blocks[instruction->bb.block] = t->begin_bb(fun, pred == -1 ? NULL : blocks[pred]);
+            if (discards.length) t->discard(fun, discards);
+            break;
+        }
+        case IR_RET: t->ret(fun, a, instruction->type, &instruction->signature->cc.base); break;
+        case IR_BRANCH: t->branch(fun, labels[instruction->marker.id]); break;
+        case IR_BRANCH_IF: t->branch_if(fun, instruction->mode, labels[instruction->marker.id], a, b); break;
+        case IR_LABEL:
+            t->label(fun, labels[instruction->marker.id]);
+            if (discards.length) t->discard(fun, discards);
+            break;
+        default: assert(false);
+        }
+        if (IS_VALID_REG(instruction->result)) {
+            regs[instruction->result.id] = result;
+            if (instruction->flags & IR_UNUSED_RESULT) t->discard(fun, (RegList) { 1, &result });
+            else if (assigned[instruction->result.id] != -2) t->hint_register(fun, result, assigned[instruction->result.id]);
+            replayed++;
+        }
+        // Control ops end the target's block: the next one starts with these hints.
+        if (ir_ops[instruction->op].flags & IR_CONTROL) continue;
+        int position = i + 1;
+        if (IS_VALID_REG(instruction->result) && !(instruction->flags & IR_UNUSED_RESULT)) {
+            hint_next_use(fun, &use_positions, cursors, instruction->result, result, position);
+        }
+        for (int k = 0; k < ir_ops[instruction->op].operands; k++) {
+            Reg reg = instruction->operands[k];
+            if (IS_VALID_REG(reg)) hint_next_use(fun, &use_positions, cursors, reg, regs[reg.id], position);
+        }
+        if (instruction->op == IR_CALL) {
+            IR_Call *call = &function->calls.ptr[instruction->call];
+            for (int k = 0; k < call->arg_count; k++) {
+                Reg reg = function->pool.ptr[call->args + k];
+                hint_next_use(fun, &use_positions, cursors, reg, regs[reg.id], position);
+            }
+        }
+    }
+    free(use_positions.starts);
+    free(use_positions.positions);
+    free(cursors);
+    function->regs_saved = function->next_reg - replayed;
+    free(regs);
+    free(mapped);
+    free(blocks);
+    free(labels);
+}
+
+void ir_finalize_function(void *fun) {
+    IR_Function *function = (IR_Function*) fun;
+    // Tier 0 leaves out inlining and value reuse, the passes that cost the most.
+    if (!function->cold) inline_calls(function);
+    save_body(function);
+    int *uses = calloc(function->next_reg + 1, sizeof(int));
+    if (!function->cold) reuse_values(function);
+    remove_dead_ops(function, uses);
+    IR_Interval *intervals = calloc(function->next_reg + 1, sizeof(IR_Interval));
+    compute_discards(function, intervals);
+    int *assigned = malloc((function->next_reg + 1) * sizeof(int));
+    assign_registers(function, intervals, assigned);
+    replay_function(function, uses, assigned);
+    free(assigned);
+    free(intervals);
+    free(uses);
+    free_function_lists(function);
+    ir_target.finalize_function(function->target);
+}
+
+void ir_get_stats(void *fun, FunctionStats *stats) {
+    IR_Function *function = (IR_Function*) fun;
+    if (function->target) {
+        ir_target.get_stats(function->target, stats);
+    } else {
+        *stats = (FunctionStats) {0};
+    }
+    stats->ops_removed = function->ops_removed;
+    stats->ops_reused = function->ops_reused;
+    stats->regs_saved = function->regs_saved;
+    stats->calls_inlined = function->calls_inlined;
+}
+
+void (*ir_get_funcptr(void *fun))() {
+    IR_Function *function = (IR_Function*) fun;
+    return ir_target.get_funcptr(function->target);
+}
+
+void (*ir_get_function(void *module_, Marker marker))() {
+    IR_Module *module = (IR_Module*) module_;
+    return ir_target.get_function(module->target, marker);
+}
+
+void print_reg(Reg reg) {
+    if (IS_VALID_REG(reg)) printf(" v%i", reg.id);
+    else printf(" -");
+}
+
+// The recorded instructions until finalize, the target's code after.
+void ir_debug_dump(void *fun) {
+    IR_Function *function = (IR_Function*) fun;
+    if (function->target) {
+        ir_target.debug_dump(function->target);
+        return;
+    }
+    printf("function recorded by IR backend: %zu instructions\n", function->instructions.length);
+    for (size_t i = 0; i < function->instructions.length; i++) {
+        IR_Instruction *instruction = &function->instructions.ptr[i];
+        if (IS_VALID_REG(instruction->result)) printf("v%i = ", instruction->result.id);
+        printf("%s", ir_ops[instruction->op].name);
+        for (int k = 0; k < ir_ops[instruction->op].operands; k++) print_reg(instruction->operands[k]);
+        switch (instruction->op) {
+        case IR_IMMEDIATE_INT32:
+        case IR_IMMEDIATE_INT64: printf(" %lli", (long long) instruction->value); break;
+        case IR_IMMEDIATE_FLOAT32: printf(" %g", instruction->float32); break;
+        case IR_IMMEDIATE_FLOAT64: printf(" %g", instruction->float64); break;
+        case IR_IMMEDIATE_FUNCTION: printf(" function %i", instruction->marker.id); break;
+        case IR_LOAD:
+        case IR_STORE: printf(" * %i + %i", instruction->scale, instruction->offset); break;
+        case IR_CALL: {
+            IR_Call *call = &function->calls.ptr[instruction->call];
+            for (int k = 0; k < call->arg_count; k++) print_reg(function->pool.ptr[call->args + k]);
+            break;
+        }
+        case IR_BEGIN_BB: printf(" %i from %i", instruction->bb.block, instruction->bb.pred); break;
+        case IR_BRANCH:
+        case IR_BRANCH_IF:
+        case IR_LABEL: printf(" label %i", instruction->marker.id); break;
+        default: break;
+        }
+        printf("\n");
+    }
+}
+
+Backend *create_backend_ir() {
+    Backend *x86_64 = create_backend_x86_64();
+    ir_target = *x86_64;
+    free(x86_64);
+    Backend *backend = malloc(sizeof(Backend));
+    *backend = (Backend) {
+        .declare_function = ir_declare_function,
+        .declare_lazy_function = ir_declare_lazy_function,
+        .declare_tiered_function = ir_declare_tiered_function,
+        .import_function = ir_import_function,
+        .new_module = ir_new_module,
+        .get_cpu_features = ir_get_cpu_features,
+        .set_cpu_features = ir_set_cpu_features,
+        .set_peephole = ir_set_peephole,
+        .set_link_threads = ir_set_link_threads,
+        .set_tier_threshold = ir_set_tier_threshold,
+        .new_function = ir_new_function,
+        .immediate_void = ir_immediate_void,
+        .immediate_int32 = ir_immediate_int32,
+        .immediate_int64 = ir_immediate_int64,
+        .immediate_function = ir_immediate_function,
+        .add = ir_add,
+        .sub = ir_sub,
+        .mul = ir_mul,
+        .div = ir_div,
+        .rem = ir_rem,
+        .udiv = ir_udiv,
+        .urem = ir_urem,
+        .bit_and = ir_bit_and,
+        .bit_or = ir_bit_or,
+        .bit_xor = ir_bit_xor,
+        .shl = ir_shl,
+        .shr = ir_shr,
+        .sar = ir_sar,
+        .neg = ir_neg,
+        .bit_not = ir_bit_not,
+        .and_not = ir_and_not,
+        .count_leading_zeros = ir_count_leading_zeros,
+        .count_trailing_zeros = ir_count_trailing_zeros,
+        .popcount = ir_popcount,
+        .zero_extend = ir_zero_extend,
+        .sign_extend = ir_sign_extend,
+        .truncate = ir_truncate,
+        .immediate_float32 = ir_immediate_float32,
+        .immediate_float64 = ir_immediate_float64,
+        .fadd = ir_fadd,
+        .fsub = ir_fsub,
+        .fmul = ir_fmul,
+        .fdiv = ir_fdiv,
+        .fsqrt = ir_fsqrt,
+        .fma = ir_fma,
+        .convert = ir_convert,
+        .vector_add = ir_vector_add,
+        .vector_sub = ir_vector_sub,
+        .vector_mul = ir_vector_mul,
+        .vector_div = ir_vector_div,
+        .vector_fma = ir_vector_fma,
+        .vector_splat = ir_vector_splat,
+        .vector_extract = ir_vector_extract,
+        .vector_shuffle = ir_vector_shuffle,
+        .load = ir_load,
+        .store = ir_store,
+        .arg = ir_arg,
+        .discard = ir_discard,
+        .call = ir_call,
+        .begin_bb = ir_begin_bb,
+        .ret = ir_ret,
+        .branch = ir_branch,
+        .branch_if_equal = ir_branch_if_equal,
+        .branch_if = ir_branch_if,
+        .compare = ir_compare,
+        .select = ir_select,
+        .label = ir_label,
+        .hint_next_use = ir_hint_next_use,
+        .get_registers = ir_get_registers,
+        .hint_register = ir_hint_register,
+        .debug_dump = ir_debug_dump,
+        .get_stats = ir_get_stats,
+        .finalize_function = ir_finalize_function,
+        .link = ir_link,
+        .free_module = ir_free_module,
+        .get_heap_stats = ir_target.get_heap_stats,
+        .get_funcptr = ir_get_funcptr,
+        .get_function = ir_get_function,
+        .label_marker = ir_label_marker,
+    };
+    return backend;
+}
@@ -0,0 +1,107 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <backend.h>
+
+// Lazy compilation benchmark: a module of many functions, of which only a few are ever called,
+// built either before link or on their first call.
+
+#define FUNCTIONS 5000
+#define LENGTH 100
+// every CALLED-th function is called
+#define CALLED 20
+// every CALLING-th function calls the next one
+#define CALLING 10
+
+X86_64_SysV int1_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 1, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types int1_types = { 1, (Type[]) {{8}} };
+
+typedef struct {
+    Backend *backend;
+    Marker markers[FUNCTIONS];
+} Program;
+
+// f_i(x) = x * (LENGTH + 1) + i, plus f_(i + 1)(x) for every CALLING-th function.
+int64_t expected(int i, int64_t x) {
+    int64_t result = x * (LENGTH + 1) + i;
+    if (i % CALLING == 0) result += expected(i + 1, x);
+    return result;
+}
+
+typedef struct {
+    Program *program;
+    int index;
+} Function;
+
+void build(void *module, Marker marker, void *data) {
+    Function *function = (Function*) data;
+    Backend *backend = function->program->backend;
+    int i = function->index;
+    void *blk0;
+    void *builder = backend->new_function(module, marker, int1_types, &int1_cc.base, &blk0);
+    Reg x = backend->arg(builder, 0);
+    Reg sum = x;
+    for (int k = 0; k < LENGTH; k++) {
+        Reg next = backend->add(builder, sum, x, k ? (RegList) { 1, &sum } : ND);
+        sum = next;
+    }
+    Reg index = backend->immediate_int64(builder, i, ND);
+    sum = backend->add(builder, sum, index, (RegList) { 2, (Reg[]) { sum, index } });
+    if (i % CALLING == 0) {
+        Reg next_fun = backend->immediate_function(builder, function->program->markers[i + 1], ND);
+        Reg next = backend->call(builder, next_fun, (RegList) { 1, &x }, type(8), int1_types, &int1_cc.base,
+                                 (RegList) { 2, (Reg[]) { next_fun, x } });
+        sum = backend->add(builder, sum, next, (RegList) { 2, (Reg[]) { sum, next } });
+    }
+    backend->ret(builder, sum, type(8), &int1_cc.base);
+    backend->finalize_function(builder);
+}
+
+void run(Backend *backend, bool lazy) {
+    clock_t start = clock();
+    Program *program = malloc(sizeof(Program));
+    program->backend = backend;
+    Function *functions = malloc(FUNCTIONS * sizeof(Function));
+    void *module = backend->new_module();
+    for (int i = 0; i < FUNCTIONS; i++) {
+        functions[i] = (Function) { program, i };
+        program->markers[i] = lazy
+            ? backend->declare_lazy_function(module, build, &functions[i])
+            : backend->declare_function(module);
+    }
+    if (!lazy) {
+        for (int i = 0; i < FUNCTIONS; i++) {
+            build(module, program->markers[i], &functions[i]);
+        }
+    }
+    backend->link(module);
+    for (int i = 0; i < FUNCTIONS; i += CALLED) {
+        int64_t (*funcptr)(int64_t) = (int64_t(*)(int64_t)) backend->get_function(module, program->markers[i]);
+        assert(funcptr(3) == expected(i, 3));
+        assert(funcptr(5) == expected(i, 5));
+    }
+    double ms = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    CodeHeapStats stats;
+    backend->get_heap_stats(&stats);
+    printf("%-5s %5i functions, %4i called: %6.1fms, %8zu bytes of code\n",
+           lazy ? "lazy" : "eager", FUNCTIONS, FUNCTIONS / CALLED, ms, stats.used);
+    backend->free_module(module);
+    free(functions);
+    free(program);
+}
+
+int main() {
+    Backend *backend = create_backend_x86_64();
+    run(backend, false);
+    run(backend, true);
+    free(backend);
+    return 0;
+}
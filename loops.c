@@ -0,0 +1,276 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <backend.h>
+
+// Nested loops checked against C: the args get stack copies across a call before the loops,
+// and both loops keep more values live than there are registers, so they spill and reuse stack slots.
+// The loop counters and the checksum are kept by native functions, which the loops call.
+
+#define LIVE 20
+#define CASES 64
+#define ARGS 6
+// values live across the first call, besides the args
+#define ACROSS 8
+#define COUNTDOWNS 64
+
+X86_64_SysV nest_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { ARGS, (X86_64_ArgumentClass[]) {
+        X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER,
+        X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER,
+    } },
+    X86_64_CLASS_INTEGER,
+};
+Types nest_types = { ARGS, (Type[]) {{8}, {8}, {8}, {8}, {8}, {8}} };
+
+X86_64_SysV int1_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 1, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types int1_types = { 1, (Type[]) {{8}} };
+
+// what the loops of the current case went through so far, and the calls to the counters, to stop loops that don't end
+#define MAX_CALLS 1000
+int64_t outer_count, inner_count, calls;
+uint64_t checksum;
+
+// 1, 2, ... up to n, then 0
+int64_t outer_next(int64_t n) {
+    calls++;
+    assert(calls < MAX_CALLS);
+    outer_count = outer_count < n ? outer_count + 1 : 0;
+    return outer_count;
+}
+
+// 0, 1, ... up to m, then 0 again
+int64_t inner_next(int64_t m) {
+    calls++;
+    assert(calls < MAX_CALLS);
+    int64_t count = inner_count;
+    inner_count = inner_count < m ? inner_count + 1 : 0;
+    return count;
+}
+
+int64_t record(int64_t value) {
+    checksum = checksum * 31 + value;
+    return 0;
+}
+
+// The sum of LIVE values, all live at once, computed from x and the args.
+int64_t mix_native(int64_t x, int64_t *args) {
+    int64_t w[LIVE];
+    w[0] = x + args[2];
+    for (int k = 1; k < LIVE; k++) w[k] = w[k - 1] + args[2 + k % 4];
+    int64_t s = w[LIVE - 1];
+    for (int k = LIVE - 2; k >= 0; k--) s = (k & 1) ? s - w[k] : s + w[k];
+    return s;
+}
+
+// args are n, m, a, b, c, d
+int64_t nest_native(int64_t *args) {
+    int64_t total = 0;
+    for (int k = 0; k < ARGS; k++) total += args[k];
+    for (int k = 0; k < ACROSS; k++) total += args[k % 2 ? 0 : 2 + k / 2 % 4] + args[2 + k % 4];
+    for (int64_t i = 1; i <= args[0]; i++) {
+        for (int64_t j = 0; j < args[1]; j++) record(mix_native(j, args) + args[0]);
+        record(mix_native(i, args));
+    }
+    return total;
+}
+
+Reg build_native_call(Backend *backend, void *builder, int64_t (*native)(int64_t), Reg arg, RegList discards) {
+    Reg target = backend->immediate_int64(builder, (int64_t) native, ND);
+    Reg call_discards[3] = { target };
+    for (int i = 0; i < discards.length; i++) call_discards[1 + i] = discards.ptr[i];
+    return backend->call(builder, target, (RegList) { 1, &arg }, type(8), int1_types, &int1_cc.base,
+                         (RegList) { 1 + discards.length, call_discards });
+}
+
+void build_record(Backend *backend, void *builder, Reg value) {
+    Reg recorded = build_native_call(backend, builder, record, value, (RegList) { 1, &value });
+    backend->discard(builder, (RegList) { 1, &recorded });
+}
+
+// mix_native(x, args), with all LIVE values live at once. Discards x.
+Reg build_mix(Backend *backend, void *builder, Reg x, Reg *args) {
+    Reg w[LIVE];
+    w[0] = backend->add(builder, x, args[2], (RegList) { 1, &x });
+    for (int k = 1; k < LIVE; k++) w[k] = backend->add(builder, w[k - 1], args[2 + k % 4], ND);
+    Reg s = w[LIVE - 1];
+    for (int k = LIVE - 2; k >= 0; k--) {
+        RegList discards = { 2, (Reg[]) { s, w[k] } };
+        s = (k & 1) ? backend->sub(builder, s, w[k], discards) : backend->add(builder, s, w[k], discards);
+    }
+    return s;
+}
+
+void build_nest(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, nest_types, &nest_cc.base, &blk0);
+    Reg args[ARGS];
+    for (int k = 0; k < ARGS; k++) args[k] = backend->arg(builder, k);
+    Reg zero = backend->immediate_int64(builder, 0, ND);
+    // More values are live across this call than there are callee-saved registers, so m, which is used the least,
+    // goes to a stack slot. The total uses it again: it's in a register at the loop head, with its stack copy.
+    Reg across[ACROSS];
+    for (int k = 0; k < ACROSS; k++) across[k] = backend->add(builder, args[k % 2 ? 0 : 2 + k / 2 % 4], args[2 + k % 4], ND);
+    build_record(backend, builder, backend->immediate_int64(builder, 0, ND));
+    Reg total = args[0];
+    for (int k = 1; k < ARGS; k++) total = backend->add(builder, total, args[k], k > 1 ? (RegList) { 1, &total } : ND);
+    for (int k = 0; k < ACROSS; k++) {
+        total = backend->add(builder, total, across[k], (RegList) { 2, (Reg[]) { total, across[k] } });
+    }
+    Marker outer = backend->label_marker(builder);
+    Marker inner = backend->label_marker(builder);
+    Marker inner_done = backend->label_marker(builder);
+    Marker done = backend->label_marker(builder);
+
+    backend->label(builder, outer);
+    Reg i = build_native_call(backend, builder, outer_next, args[0], ND);
+    backend->branch_if_equal(builder, done, i, zero);
+    void *blk1 = backend->begin_bb(builder, blk0);
+
+    backend->label(builder, inner);
+    Reg j = build_native_call(backend, builder, inner_next, args[1], ND);
+    // m is in a register here, so it has no stack copy at inner_done
+    backend->branch_if_equal(builder, inner_done, j, args[1]);
+    backend->begin_bb(builder, blk1);
+    Reg s = build_mix(backend, builder, j, args);
+    build_record(backend, builder, backend->add(builder, s, args[0], (RegList) { 1, &s }));
+    backend->branch(builder, inner);
+
+    backend->begin_bb(builder, blk1);
+    backend->label(builder, inner_done);
+    build_record(backend, builder, build_mix(backend, builder, i, args));
+    backend->branch(builder, outer);
+
+    backend->begin_bb(builder, blk0);
+    backend->label(builder, done);
+    backend->ret(builder, total, type(8), &nest_cc.base);
+    backend->finalize_function(builder);
+}
+
+X86_64_SysV countdown_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 2, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types countdown_types = { 2, (Type[]) {{8}, {8}} };
+
+void store_slot(Backend *backend, void *builder, Reg p, int slot, Reg value) {
+    backend->store(builder, (Address) { p, INVALID_REG, 1, 8 * slot }, value, type(8), (RegList) { 1, &value });
+}
+
+Reg load_slot(Backend *backend, void *builder, Reg p, int slot) {
+    return backend->load(builder, (Address) { p, INVALID_REG, 1, 8 * slot }, type(8), false, ND);
+}
+
+/**
+ * do { p[1] += 2; } while (--p[0]), after 'literals' unused literals, so the values the loop's back edge uses
+ * get different numbers.
+ */
+void build_countdown(Backend *backend, void *module, Marker marker, int literals) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, countdown_types, &countdown_cc.base, &blk0);
+    Reg p = backend->arg(builder, 0);
+    Reg n = backend->arg(builder, 1);
+    for (int k = 0; k < literals; k++) {
+        Reg literal = backend->immediate_int64(builder, k, ND);
+        backend->discard(builder, (RegList) { 1, &literal });
+    }
+    store_slot(backend, builder, p, 0, n);
+    store_slot(backend, builder, p, 1, backend->immediate_int64(builder, 0, ND));
+    Marker loop = backend->label_marker(builder);
+    backend->label(builder, loop);
+    Reg k = load_slot(backend, builder, p, 0);
+    Reg k1 = backend->sub(builder, k, backend->immediate_int64(builder, 1, ND), (RegList) { 1, &k });
+    backend->store(builder, (Address) { p, INVALID_REG, 1, 0 }, k1, type(8), ND);
+    Reg sum = load_slot(backend, builder, p, 1);
+    store_slot(backend, builder, p, 1, backend->add(builder, sum, backend->immediate_int64(builder, 2, ND), (RegList) { 1, &sum }));
+    Reg zero = backend->immediate_int64(builder, 0, ND);
+    backend->branch_if(builder, COMPARE_NE, loop, k1, zero);
+    backend->begin_bb(builder, blk0);
+    backend->discard(builder, (RegList) { 2, (Reg[]) { k1, zero } });
+    backend->ret(builder, load_slot(backend, builder, p, 1), type(8), &countdown_cc.base);
+    backend->finalize_function(builder);
+}
+
+/**
+ * x > 5 ? 9 : 5, where the block after the branch starts with a new state, so it has to make its own 5,
+ * even though the literal before the branch is the same.
+ */
+void build_fresh_block(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, countdown_types, &countdown_cc.base, &blk0);
+    Reg x = backend->arg(builder, 0);
+    Reg unused = backend->arg(builder, 1);
+    backend->discard(builder, (RegList) { 1, &unused });
+    Reg five = backend->immediate_int64(builder, 5, ND);
+    Marker greater = backend->label_marker(builder);
+    backend->branch_if(builder, COMPARE_GT, greater, x, five);
+    backend->begin_bb(builder, NULL);
+    backend->ret(builder, backend->immediate_int64(builder, 5, ND), type(8), &countdown_cc.base);
+    backend->begin_bb(builder, blk0);
+    backend->label(builder, greater);
+    backend->ret(builder, backend->immediate_int64(builder, 9, ND), type(8), &countdown_cc.base);
+    backend->finalize_function(builder);
+}
+
+typedef int64_t (*NestFunction)(int64_t n, int64_t m, int64_t a, int64_t b, int64_t c, int64_t d);
+typedef int64_t (*CountdownFunction)(int64_t *p, int64_t n);
+typedef int64_t (*FreshBlockFunction)(int64_t x, int64_t unused);
+
+void run(Backend *backend, const char *name) {
+    void *module = backend->new_module();
+    Marker nest = backend->declare_function(module);
+    build_nest(backend, module, nest);
+    backend->link(module);
+    NestFunction function = (NestFunction) backend->get_function(module, nest);
+    srand(1);
+    for (int c = 0; c < CASES; c++) {
+        int64_t args[ARGS] = { rand() % 6, rand() % 6 };
+        for (int k = 2; k < ARGS; k++) args[k] = ((int64_t) rand() << 32) ^ rand();
+        outer_count = inner_count = calls = checksum = 0;
+        int64_t expected = nest_native(args);
+        uint64_t expected_checksum = checksum;
+        outer_count = inner_count = calls = checksum = 0;
+        assert(function(args[0], args[1], args[2], args[3], args[4], args[5]) == expected);
+        assert(checksum == expected_checksum);
+    }
+    backend->free_module(module);
+
+    for (int literals = 0; literals <= COUNTDOWNS; literals++) {
+        module = backend->new_module();
+        Marker countdown = backend->declare_function(module);
+        build_countdown(backend, module, countdown, literals);
+        backend->link(module);
+        CountdownFunction countdown_function = (CountdownFunction) backend->get_function(module, countdown);
+        int64_t data[2];
+        for (int64_t n = 1; n < 5; n++) assert(countdown_function(data, n) == 2 * n);
+        backend->free_module(module);
+    }
+
+    module = backend->new_module();
+    Marker fresh = backend->declare_function(module);
+    build_fresh_block(backend, module, fresh);
+    backend->link(module);
+    FreshBlockFunction fresh_function = (FreshBlockFunction) backend->get_function(module, fresh);
+    assert(fresh_function(0, 0) == 5 && fresh_function(6, 0) == 9);
+    backend->free_module(module);
+    printf("%-6s nested loops: %d cases match C, countdowns after 0 to %d literals, fresh block\n", name, CASES, COUNTDOWNS);
+}
+
+int main(int argc, char **argv) {
+    Backend *backends[] = { create_backend_x86_64(), create_backend_ir() };
+    const char *names[] = { "x86-64", "ir" };
+    for (int i = 0; i < 2; i++) {
+        run(backends[i], names[i]);
+        free(backends[i]);
+    }
+    return 0;
+}
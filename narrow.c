@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <backend.h>
+
+// 1 and 2-byte sums passed to a native function, which reads them as 32 bits, as C compilers do.
+// The sums carry out of their bytes in registers: the call has to clear the upper bits.
+
+#define CASES 256
+
+X86_64_SysV sums_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 4, (X86_64_ArgumentClass[]) {
+        X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER,
+    } },
+    X86_64_CLASS_INTEGER,
+};
+Types sums_types = { 4, (Type[]) {{1}, {1}, {2}, {2}} };
+
+X86_64_SysV widen_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 2, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types widen_types = { 2, (Type[]) {{1}, {2}} };
+
+// Takes a byte and a 16-bit value, as 32 bits.
+int64_t widen(uint32_t byte, uint32_t half) {
+    assert(byte <= UINT8_MAX && half <= UINT16_MAX);
+    return (int64_t) byte << 16 | half;
+}
+
+// widen(a + b, c + d)
+void build_sums(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, sums_types, &sums_cc.base, &blk0);
+    Reg args[4];
+    for (int k = 0; k < 4; k++) args[k] = backend->arg(builder, k);
+    Reg byte = backend->add(builder, args[0], args[1], (RegList) { 2, args });
+    Reg half = backend->add(builder, args[2], args[3], (RegList) { 2, args + 2 });
+    Reg target = backend->immediate_int64(builder, (int64_t) widen, ND);
+    Reg result = backend->call(builder, target, (RegList) { 2, (Reg[]) { byte, half } }, type(8), widen_types,
+                               &widen_cc.base, (RegList) { 3, (Reg[]) { target, byte, half } });
+    backend->ret(builder, result, type(8), &sums_cc.base);
+    backend->finalize_function(builder);
+}
+
+typedef int64_t (*SumsFunction)(uint8_t a, uint8_t b, uint16_t c, uint16_t d);
+
+void run(Backend *backend, const char *name) {
+    void *module = backend->new_module();
+    Marker sums = backend->declare_function(module);
+    build_sums(backend, module, sums);
+    backend->link(module);
+    SumsFunction function = (SumsFunction) backend->get_function(module, sums);
+    srand(1);
+    for (int k = 0; k < CASES; k++) {
+        // the largest values first, which always carry
+        uint8_t a = k ? rand() : UINT8_MAX, b = k ? rand() : UINT8_MAX;
+        uint16_t c = k ? rand() : UINT16_MAX, d = k ? rand() : UINT16_MAX;
+        assert(function(a, b, c, d) == widen((uint8_t) (a + b), (uint16_t) (c + d)));
+    }
+    backend->free_module(module);
+    printf("%-6s narrow args: %d cases match C\n", name, CASES);
+}
+
+int main(int argc, char **argv) {
+    Backend *backends[] = { create_backend_x86_64(), create_backend_ir() };
+    const char *names[] = { "x86-64", "ir" };
+    for (int i = 0; i < 2; i++) {
+        run(backends[i], names[i]);
+        free(backends[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <backend.h>
+
+// Parallel compilation benchmark: builds a module of thousands of functions on a pool of 1..N threads,
+// links it on as many, and reports the wall time and speedup of each, with both backends.
+// With the IR backend, the threads share its signatures, function lists and the bodies it inlines.
+
+#define LENGTH 200
+// the callees are short enough for the IR backend to inline, when they're finalized before their callers
+#define SHORT 4
+// every CALLING-th function calls another one
+#define CALLING 8
+
+X86_64_SysV int1_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 1, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types int1_types = { 1, (Type[]) {{8}} };
+
+// The adds in f_i: f_(i / 2) is called by every CALLING-th function, so that's every (CALLING / 2)-th.
+int length(int i) {
+    return i % (CALLING / 2) == 0 ? SHORT : LENGTH;
+}
+
+// f_i(x) = x * (length(i) + 1) ^ i, plus f_(i / 2)(x) for every CALLING-th function.
+int64_t expected(int i, int64_t x) {
+    int64_t result = x * (length(i) + 1);
+    result ^= i;
+    if (i % CALLING == 1) result += expected(i / 2, x);
+    return result;
+}
+
+typedef struct {
+    Backend *backend;
+    void *module;
+    Marker *markers;
+    int functions;
+    // the next function to build, taken by the workers
+    int next;
+} Program;
+
+void build(Program *program, int i) {
+    Backend *backend = program->backend;
+    void *blk0;
+    void *builder = backend->new_function(program->module, program->markers[i], int1_types, &int1_cc.base, &blk0);
+    Reg x = backend->arg(builder, 0);
+    Reg sum = x;
+    for (int k = 0; k < length(i); k++) {
+        Reg next = backend->add(builder, sum, x, k ? (RegList) { 1, &sum } : ND);
+        sum = next;
+    }
+    Reg index = backend->immediate_int64(builder, i, ND);
+    sum = backend->bit_xor(builder, sum, index, (RegList) { 2, (Reg[]) { sum, index } });
+    if (i % CALLING == 1) {
+        Reg callee = backend->immediate_function(builder, program->markers[i / 2], ND);
+        Reg called = backend->call(builder, callee, (RegList) { 1, &x }, type(8), int1_types, &int1_cc.base,
+                                   (RegList) { 2, (Reg[]) { callee, x } });
+        sum = backend->add(builder, sum, called, (RegList) { 2, (Reg[]) { sum, called } });
+    }
+    backend->ret(builder, sum, type(8), &int1_cc.base);
+    backend->finalize_function(builder);
+}
+
+void *worker(void *program_) {
+    Program *program = (Program*) program_;
+    for (;;) {
+        int i = __atomic_fetch_add(&program->next, 1, __ATOMIC_RELAXED);
+        if (i >= program->functions) return NULL;
+        build(program, i);
+    }
+}
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Build and link on 'threads' threads. Returns the wall time.
+double run(Backend *backend, int functions, int threads, double *link_seconds) {
+    Program program = { backend, backend->new_module(), malloc(functions * sizeof(Marker)), functions };
+    backend->set_link_threads(program.module, threads);
+    double start = now();
+    for (int i = 0; i < functions; i++) program.markers[i] = backend->declare_function(program.module);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    for (int t = 1; t < threads; t++) pthread_create(&workers[t], NULL, worker, &program);
+    worker(&program);
+    for (int t = 1; t < threads; t++) pthread_join(workers[t], NULL);
+    double linked = now();
+    backend->link(program.module);
+    double end = now();
+    *link_seconds = end - linked;
+    for (int i = 0; i < functions; i++) {
+        int64_t (*function)(int64_t) = (int64_t(*)(int64_t)) backend->get_function(program.module, program.markers[i]);
+        assert(function(3) == expected(i, 3));
+    }
+    backend->free_module(program.module);
+    free(program.markers);
+    free(workers);
+    return end - start;
+}
+
+int main(int argc, char **argv) {
+    int functions = (argc > 1) ? atoi(argv[1]) : 4000;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    Backend *backends[] = { create_backend_x86_64(), create_backend_ir() };
+    const char *names[] = { "x86-64", "ir" };
+    for (int i = 0; i < 2; i++) {
+        double single = 0;
+        for (int threads = 1; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads) ? max_threads : threads * 2) {
+            double link_seconds;
+            double seconds = run(backends[i], functions, threads, &link_seconds);
+            if (threads == 1) single = seconds;
+            printf("%-6s %2d threads: %5d functions in %8.1f ms (link %6.1f ms), %5.2fx\n",
+                   names[i], threads, functions, seconds * 1e3, link_seconds * 1e3, single / seconds);
+        }
+        free(backends[i]);
+    }
+    return 0;
+}
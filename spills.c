@@ -0,0 +1,280 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <backend.h>
+
+// Register allocator benchmark: counts the spill and reload instructions
+// emitted for the ack function and a few larger generated functions.
+// With the argument 'ir', the functions go through the IR backend instead.
+
+int64_t mix(int64_t a, int64_t b) {
+    return a * 3 + b;
+}
+
+typedef struct {
+    Backend *backend;
+    void *module;
+    Marker marker;
+    // native function imported into the module
+    Marker mix_marker;
+    void *builder;
+    CallingConvention *cc;
+} Function;
+
+Function start_function(Backend *backend, int num_args, void **blk0) {
+    Function fn = { backend, backend->new_module() };
+    fn.marker = backend->declare_function(fn.module);
+    fn.mix_marker = backend->declare_function(fn.module);
+    backend->import_function(fn.module, fn.mix_marker, (void(*)()) mix);
+    static Type arg_types[6] = {{8}, {8}, {8}, {8}, {8}, {8}};
+    static X86_64_ArgumentClass arg_classes[6] = {
+        X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER,
+        X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER,
+    };
+    static X86_64_SysV cc = { { CALLING_CONVENTION_X86_64_SYSV }, { 0, arg_classes }, X86_64_CLASS_INTEGER };
+    cc.arguments.length = num_args;
+    Types types = { num_args, arg_types };
+    fn.builder = backend->new_function(fn.module, fn.marker, types, &cc.base, blk0);
+    fn.cc = &cc.base;
+    return fn;
+}
+
+// what the peephole pass removed in all functions, by PeepholePattern
+size_t peephole_hits[PEEPHOLE_PATTERNS];
+// what the IR backend's passes saved in all functions
+size_t ops_removed, ops_reused, regs_saved;
+
+void report(Function fn, const char *name) {
+    FunctionStats stats;
+    fn.backend->get_stats(fn.builder, &stats);
+    printf("%-34s %6zu bytes %4zu frame %4zu spills %4zu reloads\n",
+           name, stats.code_size, stats.frame_size, stats.spills, stats.reloads);
+    for (int i = 0; i < PEEPHOLE_PATTERNS; i++) peephole_hits[i] += stats.peephole_hits[i];
+    ops_removed += stats.ops_removed;
+    ops_reused += stats.ops_reused;
+    regs_saved += stats.regs_saved;
+}
+
+X86_64_SysV int2_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 2, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types int2_types = { 2, (Type[]) {{8}, {8}} };
+
+/**
+ * Same as ack.c. With 'recompute', every block makes its own literals, function address and m - 1,
+ * as a front-end that doesn't track values across blocks would.
+ */
+void bench_ack(Backend *backend, bool recompute) {
+    void *blk0;
+    Function fn = start_function(backend, 2, &blk0);
+    void *builder = fn.builder;
+    Reg m = backend->arg(builder, 0);
+    Reg n = backend->arg(builder, 1);
+    Reg zero = backend->immediate_int64(builder, 0, ND);
+    Reg one = backend->immediate_int64(builder, 1, ND);
+    Reg m_1 = backend->sub(builder, m, one, ND);
+    Reg ack_fun = backend->immediate_function(builder, fn.marker, ND);
+    Marker m_zero_marker = backend->label_marker(builder);
+    backend->branch_if_equal(builder, m_zero_marker, m, zero);
+    void *blk1 = backend->begin_bb(builder, blk0);
+    Marker n_zero_marker = backend->label_marker(builder);
+    backend->branch_if_equal(builder, n_zero_marker, n, zero);
+    backend->begin_bb(builder, blk1);
+    if (recompute) {
+        one = backend->immediate_int64(builder, 1, ND);
+        m_1 = backend->sub(builder, m, one, ND);
+        ack_fun = backend->immediate_function(builder, fn.marker, ND);
+    }
+    Reg n_1 = backend->sub(builder, n, one, ND);
+    Reg ack_inner = backend->call(builder, ack_fun, (RegList) { 2, (Reg[]) { m, n_1 } }, type(8), int2_types, &int2_cc.base,
+                                  (RegList) { 3, (Reg[]) { m, n, n_1 } });
+    Reg ack_outer = backend->call(builder, ack_fun, (RegList) { 2, (Reg[]) { m_1, ack_inner } }, type(8), int2_types, &int2_cc.base,
+                                  (RegList) { 2, (Reg[]) { m_1, ack_inner } });
+    backend->ret(builder, ack_outer, type(8), &int2_cc.base);
+    backend->begin_bb(builder, blk0);
+    backend->label(builder, m_zero_marker);
+    if (recompute) one = backend->immediate_int64(builder, 1, ND);
+    backend->ret(builder, backend->add(builder, n, one, ND), type(8), &int2_cc.base);
+    backend->begin_bb(builder, blk1);
+    backend->label(builder, n_zero_marker);
+    if (recompute) {
+        one = backend->immediate_int64(builder, 1, ND);
+        m_1 = backend->sub(builder, m, one, ND);
+        ack_fun = backend->immediate_function(builder, fn.marker, ND);
+    }
+    Reg ack_ret = backend->call(builder, ack_fun, (RegList) { 2, (Reg[]) { m_1, one } }, type(8), int2_types, &int2_cc.base,
+                                (RegList) { 3, (Reg[]) { m, n, m_1 } });
+    backend->ret(builder, ack_ret, type(8), &int2_cc.base);
+    backend->finalize_function(builder);
+    backend->link(fn.module);
+
+    int64_t (*funcptr)(int64_t, int64_t) = (int64_t(*)(int64_t, int64_t)) backend->get_funcptr(builder);
+    assert(funcptr(2, 3) == 9);
+    report(fn, recompute ? "ack+recompute" : "ack");
+    backend->free_module(fn.module);
+}
+
+#define CHAIN_HOT_ARGS 1
+#define CHAIN_CALLS 2
+#define CHAIN_DISCARDS 4
+
+/**
+ * Straight-line function over six arguments: v[i] = v[i - 1] +/- v[k], for some k in [i - window, i - 2],
+ * followed by the sum of the last 'window' values.
+ * About 'window' values are live at any time.
+ * CHAIN_HOT_ARGS: every other k is one of the arguments instead, which stay live throughout.
+ * CHAIN_CALLS: every fourth value is computed by calling a native function instead.
+ * CHAIN_DISCARDS: discard every value at its last use.
+ */
+void bench_chain(Backend *backend, int length, int window, int flags) {
+    // value i is computed from values left[i] and right[i].
+    int total = length + window - 1;
+    int *left = malloc(total * sizeof(int)), *right = malloc(total * sizeof(int));
+    for (int i = 6; i < length; i++) {
+        int k = i - 2 - (i * 7) % (window - 1);
+        if (k < 0) k = 0;
+        if ((flags & CHAIN_HOT_ARGS) && i % 2) k = i % 6;
+        left[i] = i - 1;
+        right[i] = k;
+    }
+    for (int i = length; i < total; i++) {
+        left[i] = i - 1;
+        right[i] = length - window + (i - length);
+    }
+    int *last_use = calloc(total, sizeof(int));
+    for (int i = 6; i < total; i++) {
+        last_use[left[i]] = i;
+        last_use[right[i]] = i;
+    }
+
+    void *blk0;
+    Function fn = start_function(backend, 6, &blk0);
+    void *builder = fn.builder;
+    Reg *regs = malloc(total * sizeof(Reg));
+    int64_t *values = malloc(total * sizeof(int64_t));
+    for (int i = 0; i < 6; i++) {
+        regs[i] = backend->arg(builder, i);
+        values[i] = i + 1;
+    }
+    Reg mix_fun = backend->immediate_function(builder, fn.mix_marker, ND);
+    for (int i = 6; i < total; i++) {
+        Reg a = regs[left[i]], b = regs[right[i]];
+        int64_t va = values[left[i]], vb = values[right[i]];
+        Reg discards_list[2];
+        RegList discards = { 0, discards_list };
+        if (flags & CHAIN_DISCARDS) {
+            if (last_use[left[i]] == i) discards.ptr[discards.length++] = a;
+            if (last_use[right[i]] == i && right[i] != left[i]) discards.ptr[discards.length++] = b;
+        }
+        if (i < length && (flags & CHAIN_CALLS) && i % 4 == 0) {
+            regs[i] = backend->call(builder, mix_fun, (RegList) { 2, (Reg[]) { a, b } }, type(8), int2_types, &int2_cc.base, discards);
+            values[i] = mix(va, vb);
+        } else if (i >= length || i % 2) {
+            regs[i] = backend->add(builder, a, b, discards);
+            values[i] = va + vb;
+        } else {
+            regs[i] = backend->sub(builder, a, b, discards);
+            values[i] = va - vb;
+        }
+    }
+    backend->ret(builder, regs[total - 1], type(8), fn.cc);
+    backend->finalize_function(builder);
+    backend->link(fn.module);
+
+    int64_t (*funcptr)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t) =
+        (int64_t(*)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t)) backend->get_funcptr(builder);
+    assert(funcptr(1, 2, 3, 4, 5, 6) == values[total - 1]);
+    char name[64];
+    snprintf(name, sizeof(name), "chain%s%s%s(%i, %i)",
+             (flags & CHAIN_HOT_ARGS) ? "+args" : "",
+             (flags & CHAIN_CALLS) ? "+calls" : "",
+             (flags & CHAIN_DISCARDS) ? "+discards" : "",
+             length, window);
+    report(fn, name);
+    backend->free_module(fn.module);
+    free(left);
+    free(right);
+    free(last_use);
+    free(regs);
+    free(values);
+}
+
+/**
+ * Functions that leave a move of the given pattern for the peephole pass to remove, checked against C.
+ * PEEPHOLE_MOVE_BACK: (a / b) / b + a / b. The second divide moves a / b out of rax to keep it,
+ * then copies it right back as its dividend.
+ * PEEPHOLE_DEAD_MOVE: a / b + v + ten more values, which leave one hwreg free. v was spilled and reloaded into rax,
+ * and it's the cheapest to spill: the divide moves it out of rax into the free hwreg, then spills it again,
+ * which its stack copy makes free, to move the value in rdx there instead.
+ */
+void check_peephole(Backend *backend, PeepholePattern pattern) {
+    void *blk0;
+    Function fn = start_function(backend, 2, &blk0);
+    void *builder = fn.builder;
+    Reg a = backend->arg(builder, 0), b = backend->arg(builder, 1);
+    int64_t va = 1000003, vb = 7, expected;
+    Reg result;
+    if (pattern == PEEPHOLE_MOVE_BACK) {
+        Reg q = backend->udiv(builder, a, b, ND);
+        Reg r = backend->udiv(builder, q, b, (RegList) { 1, &b });
+        result = backend->add(builder, q, r, (RegList) { 2, (Reg[]) { q, r } });
+        expected = va / vb / vb + va / vb;
+    } else {
+        // 12 more values than the hwregs a and b leave spill v; once they're gone, v is reloaded into rax.
+        Reg v = backend->add(builder, a, b, ND);
+        Reg others[12];
+        for (int i = 0; i < 12; i++) others[i] = backend->add(builder, a, backend->immediate_int64(builder, i, ND), ND);
+        backend->discard(builder, (RegList) { 12, others });
+        Reg used = backend->add(builder, a, v, ND);
+        backend->discard(builder, (RegList) { 1, &used });
+        // all but one of the hwregs that are left, each used once, like v
+        for (int i = 0; i < 10; i++) others[i] = backend->add(builder, i ? others[i - 1] : a, b, ND);
+        result = backend->add(builder, backend->udiv(builder, a, b, ND), v, (RegList) { 1, &v });
+        expected = va / vb + va + vb;
+        for (int i = 0; i < 10; i++) {
+            result = backend->add(builder, result, others[i], (RegList) { 2, (Reg[]) { result, others[i] } });
+            expected += va + (i + 1) * vb;
+        }
+    }
+    backend->ret(builder, result, type(8), fn.cc);
+    backend->finalize_function(builder);
+    backend->link(fn.module);
+    int64_t (*funcptr)(int64_t, int64_t) = (int64_t(*)(int64_t, int64_t)) backend->get_funcptr(builder);
+    assert(funcptr(va, vb) == expected);
+    FunctionStats stats;
+    backend->get_stats(builder, &stats);
+    assert(stats.peephole_hits[pattern] > 0);
+    report(fn, pattern == PEEPHOLE_MOVE_BACK ? "peephole move back" : "peephole dead move");
+    backend->free_module(fn.module);
+}
+
+int main(int argc, char **argv) {
+    bool ir = argc > 1 && strcmp(argv[1], "ir") == 0;
+    Backend *backend = ir ? create_backend_ir() : create_backend_x86_64();
+    bench_ack(backend, false);
+    bench_ack(backend, true);
+    int configs[][2] = { { 64, 4 }, { 64, 12 }, { 256, 24 } };
+    int variants[] = { 0, CHAIN_HOT_ARGS, CHAIN_CALLS, CHAIN_HOT_ARGS | CHAIN_CALLS };
+    for (int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        for (int k = 0; k < sizeof(configs) / sizeof(configs[0]); k++) {
+            bench_chain(backend, configs[k][0], configs[k][1], variants[i]);
+            bench_chain(backend, configs[k][0], configs[k][1], variants[i] | CHAIN_DISCARDS);
+        }
+    }
+    // The one-pass emitter leaves these moves where clients keep values live; the IR backend's clients don't.
+    if (!ir) {
+        check_peephole(backend, PEEPHOLE_MOVE_BACK);
+        check_peephole(backend, PEEPHOLE_DEAD_MOVE);
+    }
+    printf("peephole: %zu spill-reloads, %zu moves back, %zu dead moves removed\n",
+           peephole_hits[PEEPHOLE_SPILL_RELOAD], peephole_hits[PEEPHOLE_MOVE_BACK], peephole_hits[PEEPHOLE_DEAD_MOVE]);
+    if (ir) printf("ir: %zu dead ops removed, %zu ops reused, %zu regs saved\n", ops_removed, ops_reused, regs_saved);
+    free(backend);
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <backend.h>
+
+// Tiered compilation benchmark: a hash kernel that calls small helpers is linked as tier 0 and called in a loop,
+// while the module's background thread rebuilds it once hot. Reports the time per element in each window
+// of the run, and the slowest call, which would include any wait for the rebuild.
+
+#define LENGTH 1024
+#define WINDOWS 12
+#define WINDOW_SECONDS 0.02
+#define THRESHOLD 20000
+
+X86_64_SysV scramble_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 1, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types scramble_types = { 1, (Type[]) {{8}} };
+
+X86_64_SysV fold_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 2, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types fold_types = { 2, (Type[]) {{8}, {8}} };
+
+X86_64_SysV hash_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 3, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types hash_types = { 3, (Type[]) {{8}, {8}, {8}} };
+
+// FNV-1a, a word at a time
+#define FNV_BASIS 0xcbf29ce484222325
+#define FNV_PRIME 0x100000001b3
+
+typedef struct {
+    Backend *backend;
+    Marker scramble;
+    Marker fold;
+} Program;
+
+uint64_t scramble_native(uint64_t x) {
+    return x ^ x >> 29;
+}
+
+uint64_t fold_native(uint64_t h, uint64_t x) {
+    return (h ^ x) * FNV_PRIME;
+}
+
+// scramble(x) = x ^ x >> 29
+void build_scramble(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, scramble_types, &scramble_cc.base, &blk0);
+    Reg x = backend->arg(builder, 0);
+    Reg shifted = backend->shr(builder, x, backend->immediate_int64(builder, 29, ND), ND);
+    Reg result = backend->bit_xor(builder, x, shifted, (RegList) { 2, (Reg[]) { x, shifted } });
+    backend->ret(builder, result, type(8), &scramble_cc.base);
+    backend->finalize_function(builder);
+}
+
+// fold(h, x) = (h ^ x) * FNV_PRIME
+void build_fold(Backend *backend, void *module, Marker marker) {
+    void *blk0;
+    void *builder = backend->new_function(module, marker, fold_types, &fold_cc.base, &blk0);
+    Reg h = backend->arg(builder, 0);
+    Reg x = backend->arg(builder, 1);
+    Reg mixed = backend->bit_xor(builder, h, x, (RegList) { 2, (Reg[]) { h, x } });
+    Reg prime = backend->immediate_int64(builder, FNV_PRIME, ND);
+    Reg result = backend->mul(builder, mixed, prime, (RegList) { 2, (Reg[]) { mixed, prime } });
+    backend->ret(builder, result, type(8), &fold_cc.base);
+    backend->finalize_function(builder);
+}
+
+/**
+ * Returns the hash of data[0..length), state[1] = fold(state[1], scramble(data[i])) from FNV_BASIS,
+ * with the loop counter in memory at state[0]. Built once before link, and again on the tier thread.
+ */
+void build_hash(void *module, Marker marker, void *data_) {
+    Program *program = (Program*) data_;
+    Backend *backend = program->backend;
+    void *blk0;
+    void *builder = backend->new_function(module, marker, hash_types, &hash_cc.base, &blk0);
+    Reg state = backend->arg(builder, 0);
+    Reg data = backend->arg(builder, 1);
+    Reg length = backend->arg(builder, 2);
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 0 }, backend->immediate_int64(builder, 0, ND), type(8), ND);
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 8 }, backend->immediate_int64(builder, FNV_BASIS, ND), type(8), ND);
+    Marker loop = backend->label_marker(builder);
+    Marker done = backend->label_marker(builder);
+    backend->label(builder, loop);
+    Reg i = backend->load(builder, (Address) { state, INVALID_REG, 1, 0 }, type(8), false, ND);
+    backend->branch_if(builder, COMPARE_GE, done, i, length);
+    backend->begin_bb(builder, blk0);
+    Reg value = backend->load(builder, (Address) { data, i, 8, 0 }, type(8), false, ND);
+    Reg scramble_fun = backend->immediate_function(builder, program->scramble, ND);
+    value = backend->call(builder, scramble_fun, (RegList) { 1, &value }, type(8), scramble_types, &scramble_cc.base,
+                          (RegList) { 2, (Reg[]) { scramble_fun, value } });
+    Reg h = backend->load(builder, (Address) { state, INVALID_REG, 1, 8 }, type(8), false, ND);
+    Reg fold_fun = backend->immediate_function(builder, program->fold, ND);
+    h = backend->call(builder, fold_fun, (RegList) { 2, (Reg[]) { h, value } }, type(8), fold_types, &fold_cc.base,
+                      (RegList) { 3, (Reg[]) { fold_fun, h, value } });
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 8 }, h, type(8), (RegList) { 1, &h });
+    Reg next = backend->add(builder, i, backend->immediate_int64(builder, 1, ND), (RegList) { 1, &i });
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 0 }, next, type(8), (RegList) { 1, &next });
+    backend->branch(builder, loop);
+    backend->begin_bb(builder, blk0);
+    backend->label(builder, done);
+    Reg hash = backend->load(builder, (Address) { state, INVALID_REG, 1, 8 }, type(8), false, (RegList) { 1, &state });
+    backend->ret(builder, hash, type(8), &hash_cc.base);
+    backend->finalize_function(builder);
+}
+
+typedef uint64_t (*HashFunction)(uint64_t *state, uint64_t *data, int64_t length);
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+void run(Backend *backend, const char *name, uint64_t *data, uint64_t expected) {
+    void *module = backend->new_module();
+    backend->set_tier_threshold(module, THRESHOLD);
+    Program program = { backend, backend->declare_function(module), backend->declare_function(module) };
+    Marker hash = backend->declare_tiered_function(module, build_hash, &program);
+    build_scramble(backend, module, program.scramble);
+    build_fold(backend, module, program.fold);
+    build_hash(module, hash, &program);
+    backend->link(module);
+    HashFunction function = (HashFunction) backend->get_function(module, hash);
+    printf("%-6s ns/element:", name);
+    double slowest = 0;
+    for (int w = 0; w < WINDOWS; w++) {
+        double start = now(), end = start;
+        long calls = 0;
+        while (end - start < WINDOW_SECONDS) {
+            uint64_t state[2];
+            assert(function(state, data, LENGTH) == expected);
+            double called = now();
+            if (called - end > slowest) slowest = called - end;
+            end = called;
+            calls++;
+        }
+        printf(" %5.2f", (end - start) * 1e9 / ((double) calls * LENGTH));
+    }
+    printf("   slowest call %.1f us\n", slowest * 1e6);
+    backend->free_module(module);
+}
+
+int main(int argc, char **argv) {
+    uint64_t *data = malloc(LENGTH * sizeof(uint64_t));
+    uint64_t expected = FNV_BASIS;
+    for (int i = 0; i < LENGTH; i++) {
+        data[i] = (uint64_t) i * 0x9e3779b97f4a7c15;
+        expected = fold_native(expected, scramble_native(data[i]));
+    }
+    Backend *backends[] = { create_backend_x86_64(), create_backend_ir() };
+    const char *names[] = { "x86-64", "ir" };
+    for (int i = 0; i < 2; i++) {
+        run(backends[i], names[i], data, expected);
+        free(backends[i]);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <backend.h>
+
+// Instruction set tiers benchmark: the same kernels, generated for increasing sets of CPU features,
+// up to what the CPU has.
+
+#define LENGTH 4096
+#define REPEAT 5000
+
+typedef struct {
+    const char *name;
+    unsigned features;
+} Tier;
+
+Tier tiers[] = {
+    { "baseline", 0 },
+    { "+popcnt+lzcnt", CPU_POPCNT | CPU_LZCNT },
+    { "+bmi1+bmi2", CPU_POPCNT | CPU_LZCNT | CPU_BMI1 | CPU_BMI2 },
+    { "+avx+avx2+fma", CPU_POPCNT | CPU_LZCNT | CPU_BMI1 | CPU_BMI2 | CPU_AVX | CPU_AVX2 | CPU_FMA },
+};
+
+X86_64_SysV kernel_cc = {
+    { CALLING_CONVENTION_X86_64_SYSV },
+    { 3, (X86_64_ArgumentClass[]) { X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER, X86_64_CLASS_INTEGER } },
+    X86_64_CLASS_INTEGER,
+};
+Types kernel_types = { 3, (Type[]) {{8}, {8}, {8}} };
+
+typedef struct {
+    Backend *backend;
+    void *module;
+    void *builder;
+    void *blk0;
+    Reg i;
+    Marker loop;
+    Marker done;
+} Kernel;
+
+// Loop values can't flow through labels, so the counter lives in memory, at state[0].
+Kernel begin_kernel(Backend *backend, unsigned features, Reg *state, Reg *length) {
+    Kernel kernel = { backend, backend->new_module() };
+    backend->set_cpu_features(kernel.module, features);
+    Marker marker = backend->declare_function(kernel.module);
+    kernel.builder = backend->new_function(kernel.module, marker, kernel_types, &kernel_cc.base, &kernel.blk0);
+    void *builder = kernel.builder;
+    *state = backend->arg(builder, 0);
+    *length = backend->arg(builder, 2);
+    backend->store(builder, (Address) { *state, INVALID_REG, 1, 0 }, backend->immediate_int64(builder, 0, ND), type(8), ND);
+    kernel.loop = backend->label_marker(builder);
+    kernel.done = backend->label_marker(builder);
+    backend->label(builder, kernel.loop);
+    kernel.i = backend->load(builder, (Address) { *state, INVALID_REG, 1, 0 }, type(8), false, ND);
+    backend->branch_if(builder, COMPARE_GE, kernel.done, kernel.i, *length);
+    backend->begin_bb(builder, kernel.blk0);
+    return kernel;
+}
+
+Kernel end_kernel(Kernel kernel, Reg state, int step) {
+    Backend *backend = kernel.backend;
+    void *builder = kernel.builder;
+    Reg next = backend->add(builder, kernel.i, backend->immediate_int64(builder, step, ND), (RegList) { 1, &kernel.i });
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 0 }, next, type(8), (RegList) { 1, &next });
+    backend->branch(builder, kernel.loop);
+    backend->begin_bb(builder, kernel.blk0);
+    backend->label(builder, kernel.done);
+    backend->ret(builder, backend->immediate_int64(builder, 0, ND), type(8), &kernel_cc.base);
+    backend->finalize_function(builder);
+    backend->link(kernel.module);
+    return kernel;
+}
+
+/**
+ * Bit twiddling: state[1] += popcount(x) + clz(x) + ctz(x) + (x << i) + (x & ~(x >> i)) for every x of data.
+ * Variable shifts and and_not use shlx, shrx and andn with BMI.
+ */
+Kernel build_bits(Backend *backend, unsigned features) {
+    Reg state, length;
+    Kernel kernel = begin_kernel(backend, features, &state, &length);
+    void *builder = kernel.builder;
+    Reg data = backend->arg(builder, 1);
+    Reg x = backend->load(builder, (Address) { data, kernel.i, 8, 0 }, type(8), false, ND);
+    Reg sum = backend->popcount(builder, x, ND);
+    Reg count = backend->count_leading_zeros(builder, x, ND);
+    sum = backend->add(builder, sum, count, (RegList) { 2, (Reg[]) { sum, count } });
+    count = backend->count_trailing_zeros(builder, x, ND);
+    sum = backend->add(builder, sum, count, (RegList) { 2, (Reg[]) { sum, count } });
+    Reg shifted = backend->shl(builder, x, kernel.i, ND);
+    sum = backend->add(builder, sum, shifted, (RegList) { 2, (Reg[]) { sum, shifted } });
+    shifted = backend->shr(builder, x, kernel.i, ND);
+    Reg masked = backend->and_not(builder, x, shifted, (RegList) { 2, (Reg[]) { x, shifted } });
+    sum = backend->add(builder, sum, masked, (RegList) { 2, (Reg[]) { sum, masked } });
+    Reg total = backend->load(builder, (Address) { state, INVALID_REG, 1, 8 }, type(8), false, ND);
+    total = backend->add(builder, total, sum, (RegList) { 2, (Reg[]) { total, sum } });
+    backend->store(builder, (Address) { state, INVALID_REG, 1, 8 }, total, type(8), (RegList) { 1, &total });
+    return end_kernel(kernel, state, 1);
+}
+
+int64_t expected_bits(const uint64_t *data) {
+    uint64_t total = 0;
+    for (int i = 0; i < LENGTH; i++) {
+        uint64_t x = data[i];
+        total += __builtin_popcountll(x) + (x ? __builtin_clzll(x) : 64) + (x ? __builtin_ctzll(x) : 64);
+        total += (x << (i & 63)) + (x & ~(x >> (i & 63)));
+    }
+    return total;
+}
+
+/**
+ * y = 2 * x + y over floats, four at a time. The values are small integers,
+ * so the result doesn't depend on whether the multiply-add is fused.
+ */
+Kernel build_saxpy(Backend *backend, unsigned features) {
+    Reg state, length;
+    Kernel kernel = begin_kernel(backend, features, &state, &length);
+    void *builder = kernel.builder;
+    Reg data = backend->arg(builder, 1);
+    Reg factor = backend->vector_splat(builder, LANES_F32, backend->immediate_float32(builder, 2.0f, ND), ND);
+    Reg x = backend->load(builder, (Address) { data, kernel.i, 4, 0 }, vector_type(16), false, ND);
+    Reg y = backend->load(builder, (Address) { data, kernel.i, 4, LENGTH * 4 }, vector_type(16), false, ND);
+    Reg result = backend->vector_fma(builder, LANES_F32, factor, x, y, (RegList) { 3, (Reg[]) { factor, x, y } });
+    backend->store(builder, (Address) { data, kernel.i, 4, LENGTH * 4 }, result, vector_type(16), (RegList) { 1, &result });
+    return end_kernel(kernel, state, 4);
+}
+
+void report(Kernel kernel, const char *name, Tier tier, clock_t start) {
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    FunctionStats stats;
+    kernel.backend->get_stats(kernel.builder, &stats);
+    printf("%-6s %-14s %5zu bytes %8.3f ns/element\n", name, tier.name, stats.code_size, seconds * 1e9 / ((double) REPEAT * LENGTH));
+    kernel.backend->free_module(kernel.module);
+}
+
+typedef int64_t (*BitsFunction)(int64_t *state, uint64_t *data, int64_t length);
+typedef int64_t (*SaxpyFunction)(int64_t *state, float *data, int64_t length);
+
+int main(int argc, char **argv) {
+    Backend *backend = create_backend_x86_64();
+    unsigned detected = backend->get_cpu_features();
+    uint64_t *bits_data = malloc(LENGTH * sizeof(uint64_t));
+    float *saxpy_data = aligned_alloc(16, 2 * LENGTH * sizeof(float));
+    srand(1);
+    for (int i = 0; i < LENGTH; i++) {
+        bits_data[i] = ((uint64_t) rand() << 40) ^ ((uint64_t) rand() << 20) ^ rand();
+        if (i % 16 == 0) bits_data[i] = 0;
+    }
+    for (int i = 0; i < (sizeof(tiers) / sizeof(tiers[0])); i++) {
+        Tier tier = tiers[i];
+        if ((tier.features & detected) != tier.features) break;
+        int64_t state[2] = { 0, 0 };
+        Kernel kernel = build_bits(backend, tier.features);
+        BitsFunction bits = (BitsFunction) backend->get_funcptr(kernel.builder);
+        bits(state, bits_data, LENGTH);
+        assert(state[1] == expected_bits(bits_data));
+        clock_t start = clock();
+        for (int k = 0; k < REPEAT; k++) bits(state, bits_data, LENGTH);
+        report(kernel, "bits", tier, start);
+
+        kernel = build_saxpy(backend, tier.features);
+        SaxpyFunction saxpy = (SaxpyFunction) backend->get_funcptr(kernel.builder);
+        for (int k = 0; k < LENGTH; k++) {
+            saxpy_data[k] = k % 7;
+            saxpy_data[LENGTH + k] = k % 5;
+        }
+        saxpy(state, saxpy_data, LENGTH);
+        for (int k = 0; k < LENGTH; k++) assert(saxpy_data[LENGTH + k] == 2 * (k % 7) + (k % 5));
+        start = clock();
+        // y grows by 2 * x every time, which stays exact for this many repeats.
+        for (int k = 0; k < REPEAT; k++) saxpy(state, saxpy_data, LENGTH);
+        report(kernel, "saxpy", tier, start);
+    }
+    free(bits_data);
+    free(saxpy_data);
+    free(backend);
+    return 0;
+}
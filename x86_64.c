@@ -1,5 +1,10 @@
+// for memfd_create
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <cpuid.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -7,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <backend.h>
 
@@ -27,177 +33,798 @@
 #define X86_64_R14 0xe
 #define X86_64_R15 0xf
 
+#define X86_64_COND_B  0x02
+#define X86_64_COND_AE 0x03
 #define X86_64_COND_EQ 0x04
 #define X86_64_COND_NE 0x05
+#define X86_64_COND_BE 0x06
+#define X86_64_COND_A  0x07
+#define X86_64_COND_P  0x0A
+#define X86_64_COND_NP 0x0B
 #define X86_64_COND_LT 0x0C
 #define X86_64_COND_GE 0x0D
 #define X86_64_COND_LE 0x0E
 #define X86_64_COND_GT 0x0F
 
+// In the order they're assigned save slots below rbp.
+int x86_64_callee_saved_regs[5] = { X86_64_RBX, X86_64_R12, X86_64_R13, X86_64_R14, X86_64_R15 };
+
+bool x86_64_is_callee_saved(int reg) {
+    return reg == X86_64_RBX || reg >= X86_64_R12;
+}
+
+/**
+ * The longest x86-64 instruction. Encoders reserve this much once, then write their fields
+ * without checking the buffer (the put_x86_64_* helpers).
+ */
+#define X86_64_MAX_INSTRUCTION 15
+
 // Helper to avoid gcc -pedantic error for casting from function to data pointer.
 union pedantic_convert {
     void *ptr;
     void (*funcptr)();
 };
 
-void append_x86_64_imm_w(Buffer *buffer, uint32_t imm) {
-    for (int i = 0; i < 4; i++) {
-        append(buffer, imm & 0xff);
-        imm >>= 8;
-    }
+void put_x86_64_imm_w(Buffer *buffer, uint32_t imm) {
+    put_u32(buffer, imm);
 }
 
-void append_x86_64_imm_q(Buffer *buffer, uint64_t imm) {
-    for (int i = 0; i < 8; i++) {
-        append(buffer, imm & 0xff);
-        imm >>= 8;
-    }
+void put_x86_64_imm_q(Buffer *buffer, uint64_t imm) {
+    put_u64(buffer, imm);
+}
+
+// Overwrite an immediate emitted earlier.
+void patch_x86_64_imm_w(Buffer *buffer, size_t offset, uint32_t imm) {
+    memcpy(buffer->ptr + offset, &imm, 4);
+}
+
+void patch_x86_64_imm_q(Buffer *buffer, size_t offset, uint64_t imm) {
+    memcpy(buffer->ptr + offset, &imm, 8);
 }
 
-void append_x86_64_modrm(Buffer *buffer, int mod, int reg, int rm) {
-    append(buffer, (mod << 6) + (reg << 3) + rm);
+void put_x86_64_modrm(Buffer *buffer, int mod, int reg, int rm) {
+    put(buffer, (mod << 6) + (reg << 3) + rm);
 }
 
-void append_x86_64_sib(Buffer *buffer, int scalemode, int index_reg, int base_reg) {
-    append(buffer, (scalemode << 6) + (index_reg << 3) + base_reg);
+void put_x86_64_sib(Buffer *buffer, int scalemode, int index_reg, int base_reg) {
+    put(buffer, (scalemode << 6) + (index_reg << 3) + base_reg);
 }
 
-void append_x86_64_rex(Buffer *buffer, bool w, bool r, bool x, bool b) {
-    append(buffer, 0x40 + (w << 3) + (r << 2) + (x << 1) + b);
+void put_x86_64_rex(Buffer *buffer, bool w, bool r, bool x, bool b) {
+    put(buffer, 0x40 + (w << 3) + (r << 2) + (x << 1) + b);
+}
+
+// Multi-byte nops, as recommended by the Intel manual.
+void append_x86_64_nop(Buffer *buffer, int length) {
+    static const unsigned char nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0F, 0x1F, 0x00 },
+        { 0x0F, 0x1F, 0x40, 0x00 },
+        { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    reserve(buffer, length);
+    while (length > 0) {
+        int step = length > 9 ? 9 : length;
+        memcpy(buffer->ptr + buffer->offset, nops[step - 1], step);
+        buffer->offset += step;
+        length -= step;
+    }
 }
 
 void append_x86_64_push_reg(Buffer *buffer, int reg) {
-    append(buffer, 0x50 + reg);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (reg & 0x8) {
+        put_x86_64_rex(buffer, 0, 0, 0, 1);
+    }
+    put(buffer, 0x50 + (reg & 0x7));
+}
+
+// REX prefix, if any of its bits are set.
+void put_x86_64_rex_if_needed(Buffer *buffer, bool w, bool r, bool x, bool b) {
+    if (w || r || x || b) put_x86_64_rex(buffer, w, r, x, b);
 }
 
+/**
+ * ALU encoders take 'w': operate on all 64 bits, or else on the low 32 bits, which zeroes the upper half.
+ * 32-bit forms don't need a REX prefix unless they use r8-r15.
+ */
+
 // What the docs call 'FF /r': rex, instr, modrm.
-void append_x86_64_op_r_reg_reg(Buffer *buffer, unsigned char instrbyte, int to_reg, int from_reg) {
-    append_x86_64_rex(buffer, 1, from_reg & 0x8, 0, to_reg & 0x8);
-    append(buffer, instrbyte);
-    append_x86_64_modrm(buffer, 3, from_reg & 0x7, to_reg & 0x7);
+void append_x86_64_op_r_reg_reg(Buffer *buffer, bool w, unsigned char instrbyte, int to_reg, int from_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, from_reg & 0x8, 0, to_reg & 0x8);
+    put(buffer, instrbyte);
+    put_x86_64_modrm(buffer, 3, from_reg & 0x7, to_reg & 0x7);
 }
 
 // 81 /7 id, for instance.
-void append_x86_64_op_r_reg_imm32(Buffer *buffer, unsigned char instrbyte, int modifier, int reg, int32_t imm) {
-    append_x86_64_rex(buffer, 1, 0, 0, reg & 0x8);
-    append(buffer, instrbyte);
-    append_x86_64_modrm(buffer, 3, modifier, reg & 0x7);
-    append_x86_64_imm_w(buffer, imm);
+void append_x86_64_op_r_reg_imm32(Buffer *buffer, bool w, unsigned char instrbyte, int modifier, int reg, int32_t imm) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, 0, 0, reg & 0x8);
+    put(buffer, instrbyte);
+    put_x86_64_modrm(buffer, 3, modifier, reg & 0x7);
+    put_x86_64_imm_w(buffer, imm);
 }
 
 void append_x86_64_set_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
-    append_x86_64_op_r_reg_reg(buffer, 0x89, to_reg, from_reg);
+    append_x86_64_op_r_reg_reg(buffer, true, 0x89, to_reg, from_reg);
+}
+
+// mov r32, imm32: zeroes the upper half.
+void append_x86_64_set_reg_imm32(Buffer *buffer, int reg, uint32_t value) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, 0, 0, 0, reg & 0x8);
+    put(buffer, 0xb8 + (reg & 0x7));
+    put_x86_64_imm_w(buffer, value);
 }
 
+// The shortest mov of a 64-bit value: mov r32, imm32, mov r/m64, simm32 (C7 /0), or movabs r64, imm64.
 void append_x86_64_set_reg_imm(Buffer *buffer, int reg, size_t value) {
-    append_x86_64_rex(buffer, 1, 0, 0, reg & 0x8);
-    append(buffer, 0xb8 + (reg & 0x7));
-    append_x86_64_imm_q(buffer, value);
+    if (value <= UINT32_MAX) {
+        append_x86_64_set_reg_imm32(buffer, reg, value);
+    } else if ((int64_t) value >= INT32_MIN && (int64_t) value < 0) {
+        append_x86_64_op_r_reg_imm32(buffer, true, 0xC7, 0, reg, value);
+    } else {
+        reserve(buffer, X86_64_MAX_INSTRUCTION);
+        put_x86_64_rex(buffer, 1, 0, 0, reg & 0x8);
+        put(buffer, 0xb8 + (reg & 0x7));
+        put_x86_64_imm_q(buffer, value);
+    }
 }
 
 size_t append_x86_64_set_reg_marker_placeholder(Buffer *buffer, int reg) {
-    append_x86_64_rex(buffer, 1, 0, 0, reg & 0x8);
-    append(buffer, 0xb8 + (reg & 0x7));
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex(buffer, 1, 0, 0, reg & 0x8);
+    put(buffer, 0xb8 + (reg & 0x7));
     size_t offset = buffer->offset;
-    append_x86_64_imm_q(buffer, 0);
+    put_x86_64_imm_q(buffer, 0);
     return offset;
 }
 
-void append_x86_64_add_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
-    append_x86_64_op_r_reg_reg(buffer, 0x01, to_reg, from_reg);
+void append_x86_64_add_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x01, to_reg, from_reg);
+}
+
+void append_x86_64_add_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_op_r_reg_imm32(buffer, w, 0x81, 0, reg, imm);
+}
+
+void append_x86_64_sub_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x29, to_reg, from_reg);
+}
+
+void append_x86_64_sub_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_op_r_reg_imm32(buffer, w, 0x81, 5, reg, imm);
+}
+
+void append_x86_64_and_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x21, to_reg, from_reg);
+}
+
+void append_x86_64_and_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_op_r_reg_imm32(buffer, w, 0x81, 4, reg, imm);
+}
+
+void append_x86_64_or_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x09, to_reg, from_reg);
+}
+
+void append_x86_64_or_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_op_r_reg_imm32(buffer, w, 0x81, 1, reg, imm);
+}
+
+void append_x86_64_xor_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x31, to_reg, from_reg);
+}
+
+void append_x86_64_xor_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_op_r_reg_imm32(buffer, w, 0x81, 6, reg, imm);
+}
+
+// imul to_reg, from_reg: 0F AF /r has the destination in the reg field.
+void append_x86_64_imul_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, to_reg & 0x8, 0, from_reg & 0x8);
+    put(buffer, 0x0F);
+    put(buffer, 0xAF);
+    put_x86_64_modrm(buffer, 3, to_reg & 0x7, from_reg & 0x7);
+}
+
+// imul to_reg, from_reg, imm32
+void append_x86_64_imul_reg_reg_imm(Buffer *buffer, bool w, int to_reg, int from_reg, int32_t imm) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, to_reg & 0x8, 0, from_reg & 0x8);
+    put(buffer, 0x69);
+    put_x86_64_modrm(buffer, 3, to_reg & 0x7, from_reg & 0x7);
+    put_x86_64_imm_w(buffer, imm);
+}
+
+void append_x86_64_imul_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_imul_reg_reg_imm(buffer, w, reg, reg, imm);
+}
+
+// lea to_reg, [base_reg + index_reg]
+void append_x86_64_lea_reg_reg(Buffer *buffer, bool w, int to_reg, int base_reg, int index_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    // rsp can't be an index, and rbp or r13 as a base need a displacement.
+    assert(index_reg != X86_64_RSP);
+    int mode = ((base_reg & 0x7) == X86_64_RBP) ? 1 : 0;
+    put_x86_64_rex_if_needed(buffer, w, to_reg & 0x8, index_reg & 0x8, base_reg & 0x8);
+    put(buffer, 0x8D);
+    put_x86_64_modrm(buffer, mode, to_reg & 0x7, X86_64_RSP);
+    put_x86_64_sib(buffer, 0, index_reg & 0x7, base_reg & 0x7);
+    if (mode == 1) put(buffer, 0);
+}
+
+// F7 /modifier: 2 is not, 3 is neg, 6 is div, 7 is idiv.
+void append_x86_64_op_f7_reg(Buffer *buffer, bool w, int modifier, int reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, 0, 0, reg & 0x8);
+    put(buffer, 0xF7);
+    put_x86_64_modrm(buffer, 3, modifier, reg & 0x7);
+}
+
+// Sign-extend rax into rdx (cqo), or eax into edx (cdq).
+void append_x86_64_cqo(Buffer *buffer, bool w) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, 0, 0, 0);
+    put(buffer, 0x99);
+}
+
+// Shifts: modifier 4 is shl, 5 is shr, 7 is sar. The count is an imm8, or cl.
+void append_x86_64_shift_reg_imm(Buffer *buffer, bool w, int modifier, int reg, int32_t imm) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, 0, 0, reg & 0x8);
+    put(buffer, 0xC1);
+    put_x86_64_modrm(buffer, 3, modifier, reg & 0x7);
+    // the cpu masks the count the same way
+    put(buffer, imm & (w ? 63 : 31));
+}
+
+void append_x86_64_shift_reg_cl(Buffer *buffer, bool w, int modifier, int reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, 0, 0, reg & 0x8);
+    put(buffer, 0xD3);
+    put_x86_64_modrm(buffer, 3, modifier, reg & 0x7);
+}
+
+// Sets the flags for to_reg - from_reg.
+void append_x86_64_cmp_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x39, to_reg, from_reg);
+}
+
+void append_x86_64_cmp_reg_imm(Buffer *buffer, bool w, int reg, int32_t imm) {
+    append_x86_64_op_r_reg_imm32(buffer, w, 0x81, 7, reg, imm);
 }
 
-void append_x86_64_add_reg_imm(Buffer *buffer, int reg, int32_t imm) {
-    append_x86_64_op_r_reg_imm32(buffer, 0x81, 0, reg, imm);
+void append_x86_64_test_reg_reg(Buffer *buffer, bool w, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, w, 0x85, to_reg, from_reg);
 }
 
-void append_x86_64_sub_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
-    append_x86_64_op_r_reg_reg(buffer, 0x29, to_reg, from_reg);
+// setcc on the low byte of reg, then zero-extend it to the whole reg.
+void append_x86_64_setcc_reg(Buffer *buffer, int cond, int reg) {
+    reserve(buffer, 2 * X86_64_MAX_INSTRUCTION);
+    // Without a rex, spl/bpl/sil/dil would be ah/ch/dh/bh.
+    if (reg >= 4) {
+        put_x86_64_rex(buffer, 0, 0, 0, reg & 0x8);
+    }
+    put(buffer, 0x0F);
+    put(buffer, 0x90 + cond);
+    put_x86_64_modrm(buffer, 3, 0, reg & 0x7);
+    // movzx r32, r/m8
+    if (reg >= 4) {
+        put_x86_64_rex(buffer, 0, reg & 0x8, 0, reg & 0x8);
+    }
+    put(buffer, 0x0F);
+    put(buffer, 0xB6);
+    put_x86_64_modrm(buffer, 3, reg & 0x7, reg & 0x7);
 }
 
-void append_x86_64_sub_reg_imm(Buffer *buffer, int reg, int32_t imm) {
-    append_x86_64_op_r_reg_imm32(buffer, 0x81, 5, reg, imm);
+void append_x86_64_cmov_reg_reg(Buffer *buffer, bool w, int cond, int to_reg, int from_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, to_reg & 0x8, 0, from_reg & 0x8);
+    put(buffer, 0x0F);
+    put(buffer, 0x40 + cond);
+    put_x86_64_modrm(buffer, 3, to_reg & 0x7, from_reg & 0x7);
 }
 
-void append_x86_64_cmp_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
-    append_x86_64_op_r_reg_reg(buffer, 0x3B, to_reg, from_reg);
+/**
+ * to_reg = the low from_size bytes of from_reg, sign or zero extended to to_size bytes.
+ * The extension goes to at least 32 bits: 32-bit forms are shorter, and don't merge with the old value.
+ */
+void append_x86_64_extend_reg(Buffer *buffer, int to_size, int from_size, bool sign_extend, int to_reg, int from_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    bool w = sign_extend && to_size == 8;
+    if (from_size == 4) {
+        if (w) {
+            // movsxd
+            put_x86_64_rex(buffer, 1, to_reg & 0x8, 0, from_reg & 0x8);
+            put(buffer, 0x63);
+            put_x86_64_modrm(buffer, 3, to_reg & 0x7, from_reg & 0x7);
+        } else {
+            // a 32-bit mov zeroes the upper half
+            append_x86_64_op_r_reg_reg(buffer, false, 0x89, to_reg, from_reg);
+        }
+        return;
+    }
+    assert(from_size == 1 || from_size == 2);
+    // byte registers above bl need a rex, or they'd be ah/ch/dh/bh.
+    if (w || (to_reg & 0x8) || (from_reg & 0x8) || (from_size == 1 && from_reg >= 4)) {
+        put_x86_64_rex(buffer, w, to_reg & 0x8, 0, from_reg & 0x8);
+    }
+    put(buffer, 0x0F);
+    // movzx or movsx
+    put(buffer, (sign_extend ? 0xBE : 0xB6) + (from_size == 2));
+    put_x86_64_modrm(buffer, 3, to_reg & 0x7, from_reg & 0x7);
 }
 
-void append_x86_64_cmp_reg_imm(Buffer *buffer, int reg, int32_t imm) {
-    append_x86_64_op_r_reg_imm32(buffer, 0x81, 7, reg, imm);
+void append_x86_64_xchg_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
+    append_x86_64_op_r_reg_reg(buffer, true, 0x87, to_reg, from_reg);
 }
 
 void append_x86_64_call_reg(Buffer *buffer, int reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (reg & 0x8) {
+        put_x86_64_rex(buffer, 0, 0, 0, reg & 0x8);
+    }
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 3, 2, reg & 0x7);
+}
+
+void append_x86_64_jmp_reg(Buffer *buffer, int reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
     if (reg & 0x8) {
-        append_x86_64_rex(buffer, 0, 0, 0, reg & 0x8);
+        put_x86_64_rex(buffer, 0, 0, 0, reg & 0x8);
     }
-    append(buffer, 0xff);
-    append_x86_64_modrm(buffer, 3, 2, reg & 0x7);
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 3, 4, reg & 0x7);
 }
 
 size_t append_x86_64_call_rel(Buffer *buffer) {
-    append(buffer, 0xe8);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put(buffer, 0xe8);
     size_t offset = buffer->offset;
     // placeholder (this will crash by calling itself)
-    append_x86_64_imm_w(buffer, -5);
+    put_x86_64_imm_w(buffer, -5);
     return offset;
 }
 
+// jmp [rip+0], followed by the 8-byte target it jumps to.
+void append_x86_64_veneer(Buffer *buffer, uint64_t target) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 0, 4, 5);
+    put_x86_64_imm_w(buffer, 0);
+    put_x86_64_imm_q(buffer, target);
+}
+
+#define X86_64_VENEER_SIZE 14
+
 void append_x86_64_ret(Buffer *buffer) {
-    append(buffer, 0xc3);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put(buffer, 0xc3);
 }
 
 void append_x86_64_pop_reg(Buffer *buffer, int reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
     if (reg & 0x8) {
-        append_x86_64_rex(buffer, 0, 0, 0, 1);
+        put_x86_64_rex(buffer, 0, 0, 0, 1);
     }
-    append(buffer, 0x58 + (reg & 0x7));
+    put(buffer, 0x58 + (reg & 0x7));
 }
 
 // Note: This function requires fixups, so save the offset *before* appending it.
 size_t append_x86_64_jmp_cond_marker(Buffer *buffer, int cond) {
-    append(buffer, 0x0F);
-    append(buffer, 0x80 + cond);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put(buffer, 0x0F);
+    put(buffer, 0x80 + cond);
     size_t offset = buffer->offset;
     // placeholder (this will hang forever by jumping to itself)
-    append_x86_64_imm_w(buffer, -6);
+    put_x86_64_imm_w(buffer, -6);
     return offset;
 }
 
 size_t append_x86_64_jmp_marker(Buffer *buffer) {
-    append(buffer, 0xE9);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put(buffer, 0xE9);
     size_t offset = buffer->offset;
     // placeholder (this will hang forever by jumping to itself)
-    append_x86_64_imm_w(buffer, -5);
+    put_x86_64_imm_w(buffer, -5);
     return offset;
 }
 
+// cond is -1 for an unconditional jmp. rel is relative to the end of the instruction.
+void append_x86_64_jmp_rel8(Buffer *buffer, int cond, int8_t rel) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put(buffer, cond == -1 ? 0xEB : 0x70 + cond);
+    put(buffer, (unsigned char) rel);
+}
+
+void append_x86_64_jmp_rel32(Buffer *buffer, int cond, int32_t rel) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (cond == -1) {
+        put(buffer, 0xE9);
+    } else {
+        put(buffer, 0x0F);
+        put(buffer, 0x80 + cond);
+    }
+    put_x86_64_imm_w(buffer, rel);
+}
+
+// modrm (and sib) for reg, [base_reg + offset]
+void put_x86_64_base_offset(Buffer *buffer, int reg, int base_reg, int offset) {
+    int basemode = (offset >= -128 && offset < 128) ? 1 : 2;
+    put_x86_64_modrm(buffer, basemode, reg & 0x7, base_reg & 0x7);
+    if ((base_reg & 0x7) == X86_64_RSP) {
+        put_x86_64_sib(buffer, 0, X86_64_RSP, X86_64_RSP);
+    }
+    if (basemode == 1) {
+        put(buffer, (char) offset);
+    } else {
+        put_x86_64_imm_w(buffer, offset);
+    }
+}
+
+// lea to_reg, [base_reg + offset]
+void append_x86_64_lea_reg_offset(Buffer *buffer, bool w, int to_reg, int base_reg, int32_t offset) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_if_needed(buffer, w, to_reg & 0x8, 0, base_reg & 0x8);
+    put(buffer, 0x8D);
+    put_x86_64_base_offset(buffer, to_reg, base_reg, offset);
+}
+
 // reg[offset] = source
 void append_x86_64_store_reg_offset(Buffer *buffer, int base_reg, int offset, int source_reg) {
-    assert(offset >= 0 && offset < 128);
-    append_x86_64_rex(buffer, 1, source_reg & 0x8, 0, base_reg & 0x8);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex(buffer, 1, source_reg & 0x8, 0, base_reg & 0x8);
     // mov reg/mem, reg
-    append(buffer, 0x89);
-    int basemode = 1; // 2 for 4-byte offset
-    append_x86_64_modrm(buffer, basemode, source_reg & 0x7, base_reg & 0x7);
-    if (base_reg == X86_64_RSP) {
-        append_x86_64_sib(buffer, 0, X86_64_RSP, X86_64_RSP);
+    put(buffer, 0x89);
+    put_x86_64_base_offset(buffer, source_reg, base_reg, offset);
+}
+
+// push qword reg[offset]
+void append_x86_64_push_offset(Buffer *buffer, int base_reg, int offset) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (base_reg & 0x8) {
+        put_x86_64_rex(buffer, 0, 0, 0, 1);
+    }
+    put(buffer, 0xFF);
+    put_x86_64_base_offset(buffer, 6, base_reg, offset);
+}
+
+// pop qword reg[offset]
+// Note that the address is computed after rsp is incremented.
+void append_x86_64_pop_offset(Buffer *buffer, int base_reg, int offset) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (base_reg & 0x8) {
+        put_x86_64_rex(buffer, 0, 0, 0, 1);
     }
-    append(buffer, (char) offset);
+    put(buffer, 0x8F);
+    put_x86_64_base_offset(buffer, 0, base_reg, offset);
 }
 
 // dest = reg[offset]
 void append_x86_64_load_reg_offset(Buffer *buffer, int dest_reg, int base_reg, int offset) {
-    assert(offset >= 0 && offset < 128);
-    append_x86_64_rex(buffer, 1, dest_reg & 0x8, 0, base_reg & 0x8);
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex(buffer, 1, dest_reg & 0x8, 0, base_reg & 0x8);
     // mov reg, reg/mem
-    append(buffer, 0x8B);
-    int basemode = 1; // 2 for 4-byte offset
-    append_x86_64_modrm(buffer, basemode, dest_reg & 0x7, base_reg & 0x7);
-    if (base_reg == X86_64_RSP) {
-        append_x86_64_sib(buffer, 0, X86_64_RSP, X86_64_RSP);
+    put(buffer, 0x8B);
+    put_x86_64_base_offset(buffer, dest_reg, base_reg, offset);
+}
+
+// A memory operand: [base_reg + index_reg * scale + offset]. index_reg is -1 if there's none.
+typedef struct {
+    int base_reg;
+    int index_reg;
+    int scale;
+    int32_t offset;
+} X86_64_Address;
+
+// REX prefix for an instruction with a memory operand, if any of its bits are needed.
+// byte_reg: reg is an 8-bit register, where spl, bpl, sil and dil need a REX prefix.
+void put_x86_64_rex_address(Buffer *buffer, bool w, int reg, X86_64_Address address, bool byte_reg) {
+    bool x = address.index_reg != -1 && (address.index_reg & 0x8);
+    if (w || (reg & 0x8) || x || (address.base_reg & 0x8) || (byte_reg && reg >= 4)) {
+        put_x86_64_rex(buffer, w, reg & 0x8, x, address.base_reg & 0x8);
+    }
+}
+
+// modrm, sib and displacement for reg, [address]
+void put_x86_64_address(Buffer *buffer, int reg, X86_64_Address address) {
+    // rsp can't be an index.
+    assert(address.index_reg != X86_64_RSP);
+    int base = address.base_reg & 0x7;
+    int32_t offset = address.offset;
+    // rbp and r13 as a base need a displacement.
+    int mode = (offset == 0 && base != X86_64_RBP) ? 0 : (offset >= -128 && offset < 128) ? 1 : 2;
+    if (address.index_reg == -1 && base != X86_64_RSP) {
+        put_x86_64_modrm(buffer, mode, reg & 0x7, base);
+    } else {
+        static const int scalemodes[9] = { -1, 0, 1, -1, 2, -1, -1, -1, 3 };
+        assert(address.scale >= 1 && address.scale <= 8 && scalemodes[address.scale] != -1);
+        put_x86_64_modrm(buffer, mode, reg & 0x7, X86_64_RSP);
+        // an index of rsp means no index
+        int index = address.index_reg == -1 ? X86_64_RSP : address.index_reg & 0x7;
+        put_x86_64_sib(buffer, scalemodes[address.scale], index, base);
+    }
+    if (mode == 1) {
+        put(buffer, (char) offset);
+    } else if (mode == 2) {
+        put_x86_64_imm_w(buffer, offset);
+    }
+}
+
+/**
+ * dest = the size bytes at address, sign or zero extended to 64 bits.
+ * Writing a 32-bit register zeroes the upper half, so only sign extensions need REX.W.
+ */
+void append_x86_64_load_address(Buffer *buffer, int dest_reg, X86_64_Address address, int size, bool sign_extend) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    put_x86_64_rex_address(buffer, size == 8 || sign_extend, dest_reg, address, false);
+    switch (size) {
+    case 1:
+        // movzx or movsx
+        put(buffer, 0x0F);
+        put(buffer, sign_extend ? 0xBE : 0xB6);
+        break;
+    case 2:
+        put(buffer, 0x0F);
+        put(buffer, sign_extend ? 0xBF : 0xB7);
+        break;
+    case 4:
+        // movsxd, or a 32-bit mov
+        put(buffer, sign_extend ? 0x63 : 0x8B);
+        break;
+    case 8:
+        put(buffer, 0x8B);
+        break;
+    default:
+        assert(false);
+    }
+    put_x86_64_address(buffer, dest_reg, address);
+}
+
+// The low size bytes of source are stored at address.
+void append_x86_64_store_address(Buffer *buffer, X86_64_Address address, int source_reg, int size) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (size == 2) put(buffer, 0x66);
+    put_x86_64_rex_address(buffer, size == 8, source_reg, address, size == 1);
+    put(buffer, size == 1 ? 0x88 : 0x89);
+    put_x86_64_address(buffer, source_reg, address);
+}
+
+// Store the low size bytes of imm, which is sign extended for 8-byte stores.
+void append_x86_64_store_address_imm(Buffer *buffer, X86_64_Address address, int32_t imm, int size) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (size == 2) put(buffer, 0x66);
+    put_x86_64_rex_address(buffer, size == 8, 0, address, false);
+    put(buffer, size == 1 ? 0xC6 : 0xC7);
+    put_x86_64_address(buffer, 0, address);
+    for (int i = 0; i < (size == 8 ? 4 : size); i++) {
+        put(buffer, imm & 0xff);
+        imm >>= 8;
+    }
+}
+
+// Swap the low size bytes of reg with the size bytes at address.
+void append_x86_64_xchg_address(Buffer *buffer, int reg, X86_64_Address address, int size) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (size == 2) put(buffer, 0x66);
+    put_x86_64_rex_address(buffer, size == 8, reg, address, size == 1);
+    put(buffer, size == 1 ? 0x86 : 0x87);
+    put_x86_64_address(buffer, reg, address);
+}
+
+// The spill slot at an rsp-relative offset.
+X86_64_Address x86_64_stack_slot(int offset) {
+    return (X86_64_Address) { X86_64_RSP, -1, 1, offset };
+}
+
+/**
+ * SSE encoders: a mandatory prefix (0x66, 0xF2, 0xF3, or 0 for none), REX, 0F and the opcode.
+ * The modrm reg field is usually the destination, and xmm registers are numbered like the gp ones.
+ */
+void append_x86_64_sse_reg_reg(Buffer *buffer, int prefix, bool w, unsigned char opcode, int reg, int rm_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (prefix) put(buffer, prefix);
+    put_x86_64_rex_if_needed(buffer, w, reg & 0x8, 0, rm_reg & 0x8);
+    put(buffer, 0x0F);
+    put(buffer, opcode);
+    put_x86_64_modrm(buffer, 3, reg & 0x7, rm_reg & 0x7);
+}
+
+void append_x86_64_sse_address(Buffer *buffer, int prefix, unsigned char opcode, int reg, X86_64_Address address) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    if (prefix) put(buffer, prefix);
+    put_x86_64_rex_address(buffer, false, reg, address, false);
+    put(buffer, 0x0F);
+    put(buffer, opcode);
+    put_x86_64_address(buffer, reg, address);
+}
+
+// movss, movsd or movups: the prefix for a float or vector of the given size.
+int x86_64_sse_size_prefix(int size) {
+    switch (size) {
+        case 4: return 0xF3;
+        case 8: return 0xF2;
+        case 16: return 0;
+    }
+    assert(false);
+    return -1;
+}
+
+// The whole register, whatever it holds: movaps.
+void append_x86_64_movaps_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
+    append_x86_64_sse_reg_reg(buffer, 0, false, 0x28, to_reg, from_reg);
+}
+
+// dest = the size bytes at address. Scalars zero the rest of the register.
+void append_x86_64_load_xmm_address(Buffer *buffer, int dest_reg, X86_64_Address address, int size) {
+    append_x86_64_sse_address(buffer, x86_64_sse_size_prefix(size), 0x10, dest_reg, address);
+}
+
+void append_x86_64_store_xmm_address(Buffer *buffer, X86_64_Address address, int source_reg, int size) {
+    append_x86_64_sse_address(buffer, x86_64_sse_size_prefix(size), 0x11, source_reg, address);
+}
+
+void append_x86_64_xorps_reg_reg(Buffer *buffer, int to_reg, int from_reg) {
+    append_x86_64_sse_reg_reg(buffer, 0, false, 0x57, to_reg, from_reg);
+}
+
+// movd or movq xmm, gp: the low 4 or 8 bytes, zeroing the rest.
+void append_x86_64_movq_xmm_reg(Buffer *buffer, bool w, int xmm_reg, int reg) {
+    append_x86_64_sse_reg_reg(buffer, 0x66, w, 0x6E, xmm_reg, reg);
+}
+
+// movd or movq gp, xmm
+void append_x86_64_movq_reg_xmm(Buffer *buffer, bool w, int reg, int xmm_reg) {
+    append_x86_64_sse_reg_reg(buffer, 0x66, w, 0x7E, xmm_reg, reg);
+}
+
+// pshufd, and other ops with an imm8.
+void append_x86_64_sse_reg_reg_imm8(Buffer *buffer, int prefix, unsigned char opcode, int reg, int rm_reg, unsigned char imm) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    append_x86_64_sse_reg_reg(buffer, prefix, false, opcode, reg, rm_reg);
+    put(buffer, imm);
+}
+
+/**
+ * VEX encoders, for AVX and BMI ops: the SSE prefix and the opcode map (1 is 0F, 2 is 0F38) move into
+ * the VEX prefix, which also names a second source register, vreg. 128-bit forms only.
+ */
+void append_x86_64_vex_reg_reg(Buffer *buffer, int prefix, int map, bool w, unsigned char opcode, int reg, int vreg, int rm_reg) {
+    reserve(buffer, X86_64_MAX_INSTRUCTION);
+    int pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2 : prefix == 0xF2 ? 3 : 0;
+    bool r = !(reg & 0x8), b = !(rm_reg & 0x8);
+    // the 2-byte form implies 0F, W0 and no REX.B
+    if (map == 1 && !w && b) {
+        put(buffer, 0xC5);
+        put(buffer, (r << 7) | ((~vreg & 0xF) << 3) | pp);
+    } else {
+        put(buffer, 0xC4);
+        put(buffer, (r << 7) | (1 << 6) | (b << 5) | map);
+        put(buffer, (w << 7) | ((~vreg & 0xF) << 3) | pp);
+    }
+    put(buffer, opcode);
+    put_x86_64_modrm(buffer, 3, reg & 0x7, rm_reg & 0x7);
+}
+
+// andn to_reg, not_reg, reg: to_reg = ~not_reg & reg.
+void append_x86_64_andn_reg_reg(Buffer *buffer, bool w, int to_reg, int not_reg, int reg) {
+    append_x86_64_vex_reg_reg(buffer, 0, 2, w, 0xF2, to_reg, not_reg, reg);
+}
+
+// shlx, shrx or sarx, by modifier like the other shifts: to_reg = from_reg shifted by count_reg.
+void append_x86_64_shift_x_reg_reg(Buffer *buffer, bool w, int modifier, int to_reg, int from_reg, int count_reg) {
+    int prefix = modifier == 4 ? 0x66 : modifier == 5 ? 0xF2 : 0xF3;
+    append_x86_64_vex_reg_reg(buffer, prefix, 2, w, 0xF7, to_reg, count_reg, from_reg);
+}
+
+/**
+ * Bit scans and counts, encoded like SSE ops: bsf (0F BC) and bsr (0F BD),
+ * or with an F3 prefix tzcnt, lzcnt, and popcnt (0F B8).
+ */
+void append_x86_64_bit_count_reg_reg(Buffer *buffer, int prefix, bool w, unsigned char opcode, int to_reg, int from_reg) {
+    append_x86_64_sse_reg_reg(buffer, prefix, w, opcode, to_reg, from_reg);
+}
+
+// Callee-saved registers are saved to and restored from slots below rbp.
+// The prologue and every epilogue reserve space for all of them,
+// which is patched on finalize once we know which ones were used.
+#define X86_64_CALLEE_SAVE_SIZE (5 * 4)
+
+// Returns the length of the saves or restores, without the padding.
+size_t append_x86_64_callee_saves(Buffer *buffer, int used_mask, bool restore) {
+    size_t start = buffer->offset;
+    int slot = 0;
+    for (int i = 0; i < 5; i++) {
+        int reg = x86_64_callee_saved_regs[i];
+        if (!(used_mask & (1 << reg))) continue;
+        slot++;
+        if (restore) {
+            append_x86_64_load_reg_offset(buffer, reg, X86_64_RBP, -8 * slot);
+        } else {
+            append_x86_64_store_reg_offset(buffer, X86_64_RBP, -8 * slot, reg);
+        }
+    }
+    size_t length = buffer->offset - start;
+    append_x86_64_nop(buffer, X86_64_CALLEE_SAVE_SIZE - length);
+    return length;
+}
+
+/**
+ * Bump allocator for the bookkeeping of modules and function builders, which is freed all at once.
+ * Chunks are chained through their first word.
+ */
+#define X86_64_ARENA_CHUNK (1 << 16)
+#define X86_64_ARENA_HEADER 16
+
+typedef struct {
+    unsigned char *chunk;
+    size_t top;
+    size_t size;
+} X86_64_Arena;
+
+void *arena_alloc(X86_64_Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    if (!arena->chunk || arena->top + size > arena->size) {
+        size_t chunk_size = X86_64_ARENA_HEADER + size;
+        if (chunk_size < X86_64_ARENA_CHUNK) chunk_size = X86_64_ARENA_CHUNK;
+        unsigned char *chunk = malloc(chunk_size);
+        *(unsigned char**) chunk = arena->chunk;
+        *arena = (X86_64_Arena) { chunk, X86_64_ARENA_HEADER, chunk_size };
+    }
+    void *ptr = arena->chunk + arena->top;
+    arena->top += size;
+    return ptr;
+}
+
+void *arena_calloc(X86_64_Arena *arena, size_t size) {
+    return memset(arena_alloc(arena, size), 0, size);
+}
+
+// Free all but the current chunk, and start over in it.
+void arena_reset(X86_64_Arena *arena) {
+    if (!arena->chunk) return;
+    unsigned char *chunk = *(unsigned char**) arena->chunk;
+    while (chunk) {
+        unsigned char *previous = *(unsigned char**) chunk;
+        free(chunk);
+        chunk = previous;
     }
-    append(buffer, (char) offset);
+    *(unsigned char**) arena->chunk = NULL;
+    arena->top = X86_64_ARENA_HEADER;
+}
+
+void arena_free(X86_64_Arena *arena) {
+    arena_reset(arena);
+    free(arena->chunk);
+    *arena = (X86_64_Arena) {0};
+}
+
+// Lists grow to powers of two, so appending is amortized constant time.
+size_t list_capacity(size_t length) {
+    size_t capacity = 4;
+    while (capacity < length) capacity *= 2;
+    return capacity;
+}
+
+/**
+ * Make room for 'length' elements of 'size' in a list that has 'old_length'.
+ * Lists live in an arena, or are malloc'd if it's NULL.
+ */
+void *grow_list(X86_64_Arena *arena, void *ptr, size_t old_length, size_t length, size_t size) {
+    if (ptr && length <= list_capacity(old_length)) return ptr;
+    size_t capacity = list_capacity(length);
+    if (!arena) return realloc(ptr, capacity * size);
+    void *grown = arena_alloc(arena, capacity * size);
+    if (old_length) memcpy(grown, ptr, old_length * size);
+    return grown;
 }
 
 typedef enum {
@@ -205,17 +832,29 @@ typedef enum {
     LOC_CPU,
     LOC_LITERAL,
     LOC_RELOC,
+    // no longer used
+    LOC_DISCARDED,
 } RegLocation;
 
 typedef struct {
     RegLocation location;
     Type type;
+    // Stack slot holding a copy of the value, or -1.
+    // Values are never mutated, so a slot stays valid after the value is reloaded,
+    // and spilling it again is free.
+    int stack_offset;
     union {
-        int stack_offset;
         int hw_reg;
         int64_t value;
         Marker marker;
     };
+    // allocator heuristics: tick of the last use, and number of uses so far.
+    int last_use;
+    int uses;
+    // where the frontend says it's used next, from its liveness, or 0
+    int next_use;
+    // the hwreg the frontend's register allocator gave it, plus one; -1 to keep it in memory, 0 for none
+    int assigned;
 } RegRow;
 
 typedef struct {
@@ -229,9 +868,19 @@ typedef struct {
     Reg *ptr;
 } Stackframe;
 
+// offset to the size of the values its slot holds, plus X86_64_SLOT_XMM for xmm values; 0 if it wasn't used yet
+typedef struct {
+    size_t length;
+    unsigned char *ptr;
+} SlotSizes;
+
+#define X86_64_SLOT_XMM 0x80
+
 typedef struct {
     // X86_64_REG to register, -1 is unallocated
     Reg gp_regs[16];
+    // xmm register to register
+    Reg xmm_regs[16];
 } HwRegMap;
 
 typedef struct {
@@ -244,17 +893,22 @@ typedef struct {
     RelocTarget *ptr;
 } RelocTargets;
 
-void alloc_reg(RegMap *map, int reg_id) {
+void alloc_reg(X86_64_Arena *arena, RegMap *map, int reg_id) {
     if (reg_id < map->length)
         return;
+    size_t old_length = map->length;
     map->length = reg_id + 1;
-    map->ptr = realloc(map->ptr, map->length * sizeof(RegRow));
+    map->ptr = grow_list(arena, map->ptr, old_length, map->length, sizeof(RegRow));
+    // regs that were allocated in other blocks are not available in this one.
+    for (size_t i = old_length; i < map->length; i++) {
+        map->ptr[i] = (RegRow) { .location = LOC_DISCARDED, .stack_offset = -1 };
+    }
 }
 
 typedef struct {
     size_t length;
     size_t *ptr;
-} Labels;
+} Offsets;
 
 typedef struct {
     Type type;
@@ -272,9 +926,92 @@ typedef struct {
     HwRegMap hw_reg_map;
 } X86_64_Block_Stats;
 
+// Floats and vectors live in xmm registers, and hwregs of their values are xmm registers.
+bool is_xmm_type(Type type) {
+    return type.kind != TYPE_INTEGER;
+}
+
+// The hw_reg_map entry of a hwreg, in the register class of 'type'.
+Reg *hw_reg_map_entry(X86_64_Block_Stats *block, Type type, int hwreg) {
+    return is_xmm_type(type) ? &block->hw_reg_map.xmm_regs[hwreg] : &block->hw_reg_map.gp_regs[hwreg];
+}
+
+// Load or store a value of the given type, in a hwreg of its register class.
+void append_x86_64_load_value(Buffer *buffer, int hwreg, X86_64_Address address, Type type) {
+    if (is_xmm_type(type)) {
+        append_x86_64_load_xmm_address(buffer, hwreg, address, type.size);
+    } else {
+        append_x86_64_load_address(buffer, hwreg, address, type.size, false);
+    }
+}
+
+void append_x86_64_store_value(Buffer *buffer, X86_64_Address address, int hwreg, Type type) {
+    if (is_xmm_type(type)) {
+        append_x86_64_store_xmm_address(buffer, address, hwreg, type.size);
+    } else {
+        append_x86_64_store_address(buffer, address, hwreg, type.size);
+    }
+}
+
+typedef struct {
+    // offset in the buffer, -1 if not yet placed
+    size_t offset;
+    // The register state that every edge into the label must establish.
+    // Fixed by the first edge that reaches it; NULL until then.
+    X86_64_Block_Stats *state;
+} Label;
+
+typedef struct {
+    size_t length;
+    Label *ptr;
+} Labels;
+
+// A location for moves: a hwreg, or an rsp-relative stack slot, of a register class.
+typedef struct {
+    bool stack;
+    int index;
+    // Stack slots only hold values of one class, so they have one too.
+    bool xmm;
+} X86_64_Location;
+
+/**
+ * A move between hwregs and stack slots, and where its code is: what the peephole pass sees of a function.
+ * Nothing else is recorded, so two moves follow each other in the code if one ends where the other starts.
+ */
+typedef struct {
+    size_t offset;
+    size_t length;
+    X86_64_Location to;
+    X86_64_Location from;
+    // of the value, and so of any stack slot the move reads or writes
+    int size;
+} X86_64_Recorded_Move;
+
+typedef struct {
+    size_t length;
+    X86_64_Recorded_Move *ptr;
+} X86_64_Recorded_Moves;
+
+// A call instruction, remembered to turn it into a jmp if a ret follows immediately.
+typedef struct {
+    size_t start;
+    size_t end;
+    Reg result;
+    // -1 for a call rel32 (the last near function target)
+    int target_hwreg;
+} X86_64_Call_Site;
+
 typedef struct {
+    void *module;
+    // everything that's only needed until finalize; the rest is in the module's arena
+    X86_64_Arena arena;
     Marker declaration;
+    // handed back to the module once the code is written to the code heap
     Buffer buffer;
+    // once finalized
+    size_t code_size;
+    // the module's CpuFeature bits
+    unsigned cpu_features;
     Args args;
     X86_64_Block_Stats *block;
     // label targets are resolved relatively, on finalize.
@@ -282,12 +1019,39 @@ typedef struct {
     RelocTargets near_function_targets;
     RelocTargets far_function_targets;
     RelocTargets label_targets;
-    // offset of each label in the buffer
     Labels labels;
+    // Whether the current position can be reached from the code before it.
+    bool reachable;
+    // If we're between a conditional branch and the next begin_bb, the state at the branch.
+    X86_64_Block_Stats *fallthrough_block;
     int next_reg;
     size_t frame_sub_offset;
     int frame_high_water_mark;
+    // Every spill slot only ever holds values of one size and register class, in all blocks.
+    // So two slots are either the same or don't overlap, which keeps parallel moves simple.
+    SlotSizes slot_sizes;
+    // callee-saved hwregs that were used (bitmask)
+    int callee_saved_used;
+    // placeholders for saving and restoring callee-saved regs
+    size_t callee_save_offset;
+    Offsets callee_restore_offsets;
+    // incremented for every op; values used in the current tick can't be spilled.
+    int tick;
+    // hwregs holding temporaries of the current op (bitmasks)
+    int scratch_regs;
+    int scratch_xmm_regs;
+    // Set between a compare and the instruction that reads its flags, where literals can't be xor-zeroed.
+    bool keep_flags;
+    size_t spills;
+    size_t reloads;
+    // Moves are recorded for the peephole pass, if it's enabled.
+    bool peephole;
+    X86_64_Recorded_Moves moves;
+    size_t peephole_hits[PEEPHOLE_PATTERNS];
+    X86_64_Call_Site last_call;
     void (*funcptr)();
+    // own allocation in the code heap, for functions built after link
+    unsigned char *code;
 } X86_64_Function_Builder;
 
 typedef struct {
@@ -305,339 +1069,2642 @@ typedef struct {
     X86_64_Fixed_Resolution *ptr;
 } X86_64_Fixed_Resolutions;
 
+/**
+ * A function that's built on its first call. Until then, its stub jumps to the module's resolver thunk,
+ * which calls x86_64_resolve_lazy_function with the record in r11.
+ * A tiered function is built before link instead, and its stub counts its calls: on the threshold-th one,
+ * it goes through the thunk too, which queues it for the module's tier thread to build again.
+ */
+typedef struct X86_64_Lazy_Function {
+    void *module;
+    Marker marker;
+    BuildFunction build;
+    void *data;
+    unsigned char *stub;
+    // the address the stub jumps to
+    unsigned char *slot;
+    // once built and linked
+    unsigned char *code;
+    bool tiered;
+    // counts up to 0 from minus the threshold, in the stub
+    int64_t calls;
+    // in the module's queue of hot functions
+    struct X86_64_Lazy_Function *next_hot;
+} X86_64_Lazy_Function;
+
 typedef struct {
+    size_t length;
+    X86_64_Lazy_Function **ptr;
+} X86_64_Lazy_Functions;
+
+typedef struct {
+    // handed out atomically, so functions can be declared from several threads
     size_t next_marker;
+    unsigned cpu_features;
+    bool peephole;
+    int link_threads;
+    // Functions can be built from several threads, one thread per builder: this guards the builder list,
+    // the arena and the spare buffer and arena, which all builders share.
+    pthread_mutex_t lock;
+    // Lazy functions are built by the first thread that calls them.
+    pthread_mutex_t lazy_lock;
+    // Tiered functions that got hot wait in this queue, under lazy_lock, for the tier thread to rebuild them.
+    int tier_threshold;
+    X86_64_Lazy_Function *hot_first;
+    X86_64_Lazy_Function *hot_last;
+    pthread_cond_t hot_cond;
+    pthread_t tier_thread;
+    bool tier_thread_running;
+    bool stopping;
     X86_64_Function_Builders builders;
+    // The largest buffer of the linked builders, for the next new function to reuse,
+    // and what they emitted so far, to size new buffers up front.
+    Buffer spare_buffer;
+    size_t code_emitted;
+    size_t functions_emitted;
+    // The builders, their relocations and the module's own lists.
+    X86_64_Arena arena;
+    // the arena of a finalized builder, for the next new function to reuse
+    X86_64_Arena spare_arena;
     X86_64_Fixed_Resolutions resolutions;
+    X86_64_Lazy_Functions lazy_functions;
+    // in the code heap, once linked
+    unsigned char *code;
+    size_t code_length;
+    // Once linked: the address of every marker (lazy functions are their stub),
+    // and of the veneer to use for rel32 calls that don't reach, or 0.
+    uint64_t *marker_values;
+    uint64_t *veneers;
 } X86_64_Module;
 
+// Start a new op: forget the previous op's temporaries.
+void begin_op(X86_64_Function_Builder *builder) {
+    builder->tick++;
+    builder->scratch_regs = 0;
+    builder->scratch_xmm_regs = 0;
+}
+
+// Keep a hwreg from being allocated until the next op.
+void add_scratch_hwreg(X86_64_Function_Builder *builder, bool xmm, int hwreg) {
+    if (xmm) {
+        builder->scratch_xmm_regs |= 1 << hwreg;
+    } else {
+        builder->scratch_regs |= 1 << hwreg;
+    }
+}
+
+void use_reg(X86_64_Function_Builder *builder, Reg reg) {
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    row->last_use = builder->tick;
+    row->uses++;
+}
+
 Reg alloc_next_reg(X86_64_Function_Builder *builder, Type type) {
     int reg = builder->next_reg++;
-    alloc_reg(&builder->block->registers, reg);
-    builder->block->registers.ptr[reg].type = type;
+    alloc_reg(&builder->arena, &builder->block->registers, reg);
+    builder->block->registers.ptr[reg] = (RegRow) {
+        .type = type,
+        .stack_offset = -1,
+        .last_use = builder->tick,
+    };
     return (Reg) { reg };
 }
 
 void set_reg_in_hwreg(X86_64_Function_Builder *builder, Reg reg, int hwreg) {
     RegRow *row = &builder->block->registers.ptr[reg.id];
-    assert(row->type.size == 8);
-    assert(!IS_VALID_REG(builder->block->hw_reg_map.gp_regs[hwreg]));
-    builder->block->hw_reg_map.gp_regs[hwreg] = reg;
+    assert(row->type.size > 0);
+    Reg *entry = hw_reg_map_entry(builder->block, row->type, hwreg);
+    assert(!IS_VALID_REG(*entry));
+    *entry = reg;
     row->location = LOC_CPU;
     row->hw_reg = hwreg;
 }
 
+/**
+ * Find a spill slot for a value of the given type, aligned to its size (or more, if the type says so).
+ * Slots are packed: smaller values share 8-byte words.
+ * Slots for gp and xmm values are kept apart, so a parallel move never copies between register classes.
+ */
 int alloc_free_stackspace_for_reg(X86_64_Function_Builder *builder, Type type, Reg reg) {
     int size = type.size;
+    int alignment = type.alignment > size ? type.alignment : size;
+    int slot_kind = size | (is_xmm_type(type) ? X86_64_SLOT_XMM : 0);
+    Stackframe *frame = &builder->block->stackframe;
+    SlotSizes *slot_sizes = &builder->slot_sizes;
     int start = 0;
-    for (int i = 0; i < builder->block->stackframe.length; i++) {
-        if (IS_VALID_REG(builder->block->stackframe.ptr[i])) {
-            start = i + 1;
-            continue;
-        }
-        if (i - start == size) {
-            break;
+    while (true) {
+        bool free = true;
+        for (int i = start; i < start + size && free; i++) {
+            int slot_size = i < slot_sizes->length ? slot_sizes->ptr[i] : 0;
+            free = (i >= frame->length || !IS_VALID_REG(frame->ptr[i])) && (slot_size == 0 || slot_size == slot_kind);
         }
+        if (free) break;
+        start += alignment;
+    }
+    if (frame->length < start + size) {
+        frame->ptr = grow_list(&builder->arena, frame->ptr, frame->length, start + size, sizeof(Reg));
+        for (int i = frame->length; i < start + size; i++) frame->ptr[i] = INVALID_REG;
+        frame->length = start + size;
     }
-    if (builder->block->stackframe.length < start + size) {
-        builder->block->stackframe.length = start + size;
-        builder->block->stackframe.ptr = realloc(builder->block->stackframe.ptr, (start + size) * sizeof(Reg));
+    if (slot_sizes->length < start + size) {
+        slot_sizes->ptr = grow_list(&builder->arena, slot_sizes->ptr, slot_sizes->length, start + size, 1);
+        memset(slot_sizes->ptr + slot_sizes->length, 0, start + size - slot_sizes->length);
+        slot_sizes->length = start + size;
     }
-    for (int i = 0; i < size; i++) {
-        builder->block->stackframe.ptr[start + i] = reg;
+    for (int i = start; i < start + size; i++) {
+        frame->ptr[i] = reg;
+        slot_sizes->ptr[i] = slot_kind;
     }
     if (start + size > builder->frame_high_water_mark)
         builder->frame_high_water_mark = start + size;
     return start;
 }
 
-void spill_to_stack(X86_64_Function_Builder *builder, Reg reg) {
-    RegRow *row = &builder->block->registers.ptr[reg.id];
-    assert(row->type.size == 8);
-    assert(row->location == LOC_CPU);
-    int hwreg = row->hw_reg;
-    // updates builder->block->stackframe
-    row->stack_offset = alloc_free_stackspace_for_reg(builder, row->type, reg);
-    row->location = LOC_STACK;
-    append_x86_64_store_reg_offset(&builder->buffer, X86_64_RSP, row->stack_offset, hwreg);
-    builder->block->hw_reg_map.gp_regs[hwreg] = INVALID_REG;
+X86_64_Location hwreg_location(int hwreg, bool xmm) {
+    return (X86_64_Location) { false, hwreg, xmm };
 }
 
-/**
- * Find or free up a hardware register to allocate to reg 'reg'.
+X86_64_Location stack_location(int offset, bool xmm) {
+    return (X86_64_Location) { true, offset, xmm };
+}
+
+/**
+ * Copy a value of 'size' bytes between a hwreg and a hwreg or stack slot of its register class,
+ * and record the move for the peephole pass. Register moves copy the whole register.
  */
-int alloc_hwreg(X86_64_Function_Builder *builder, Reg reg) {
-    // hack: spill the reg with the smallest number
-    // TODO spill the LRU reg
+void emit_move(X86_64_Function_Builder *builder, X86_64_Location to, X86_64_Location from, int size) {
+    Buffer *buffer = &builder->buffer;
+    size_t start = buffer->offset;
+    Type value_type = { size, size, to.xmm ? TYPE_FLOAT : TYPE_INTEGER };
+    if (!to.stack && !from.stack && to.xmm) {
+        append_x86_64_movaps_reg_reg(buffer, to.index, from.index);
+    } else if (!to.stack && !from.stack) {
+        append_x86_64_set_reg_reg(buffer, to.index, from.index);
+    } else if (!to.stack) {
+        append_x86_64_load_value(buffer, to.index, x86_64_stack_slot(from.index), value_type);
+    } else {
+        assert(!from.stack);
+        append_x86_64_store_value(buffer, x86_64_stack_slot(to.index), from.index, value_type);
+    }
+    if (!builder->peephole) return;
+    X86_64_Recorded_Moves *moves = &builder->moves;
+    moves->ptr = grow_list(&builder->arena, moves->ptr, moves->length, moves->length + 1, sizeof(X86_64_Recorded_Move));
+    moves->ptr[moves->length++] = (X86_64_Recorded_Move) { start, buffer->offset - start, to, from, size };
+}
+
+void spill_to_stack(X86_64_Function_Builder *builder, Reg reg) {
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    assert(row->location == LOC_CPU);
+    int hwreg = row->hw_reg;
+    if (row->stack_offset == -1) {
+        // updates builder->block->stackframe
+        row->stack_offset = alloc_free_stackspace_for_reg(builder, row->type, reg);
+        bool xmm = is_xmm_type(row->type);
+        emit_move(builder, stack_location(row->stack_offset, xmm), hwreg_location(hwreg, xmm), row->type.size);
+        builder->spills++;
+    }
+    row->location = LOC_STACK;
+    *hw_reg_map_entry(builder->block, row->type, hwreg) = INVALID_REG;
+}
+
+bool reglist_contains(RegList list, Reg reg) {
+    for (int i = 0; i < list.length; i++) {
+        if (list.ptr[i].id == reg.id) return true;
+    }
+    return false;
+}
+
+void free_stack_copy(X86_64_Block_Stats *block, RegRow *row) {
+    if (row->stack_offset == -1) return;
+    for (int i = row->stack_offset; i < row->stack_offset + row->type.size; i++) {
+        block->stackframe.ptr[i] = INVALID_REG;
+    }
+    row->stack_offset = -1;
+}
+
+void block_release_reg(X86_64_Block_Stats *block, Reg reg) {
+    RegRow *row = &block->registers.ptr[reg.id];
+    if (row->location == LOC_CPU) {
+        *hw_reg_map_entry(block, row->type, row->hw_reg) = INVALID_REG;
+    }
+    free_stack_copy(block, row);
+    row->location = LOC_DISCARDED;
+}
+
+/**
+ * The reg is dead: free its hwreg and stack slot.
+ */
+void release_reg(X86_64_Function_Builder *builder, Reg reg) {
+    // void calls return INVALID_REG, which may be discarded too, and so may regs this block hasn't seen.
+    if (!builder->block || !IS_VALID_REG(reg) || reg.id >= builder->block->registers.length) return;
+    block_release_reg(builder->block, reg);
+}
+
+void release_regs(X86_64_Function_Builder *builder, RegList regs) {
+    for (int i = 0; i < regs.length; i++) {
+        release_reg(builder, regs.ptr[i]);
+    }
+}
+
+/**
+ * Spill weight of a reg currently in a hwreg: lower means a better candidate for spilling.
+ * Returned as a fraction, cost / distance.
+ * The cost is the number of uses so far (which predicts how often it will be reloaded),
+ * plus one if spilling it needs a store.
+ * The distance is the number of ticks since the last use (which predicts the next use).
+ */
+void spill_weight(X86_64_Function_Builder *builder, Reg reg, int64_t *cost, int64_t *distance) {
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    *cost = row->uses + (row->stack_offset == -1 ? 1 : 0);
+    *distance = builder->tick - row->last_use;
+}
+
+/**
+ * Whether the reg in hwreg a is a better spill candidate than the one in b.
+ * Where the frontend gave both their next use, the one used furthest away, as linear scan would pick;
+ * otherwise the one with the lower spill weight.
+ */
+bool better_spill_candidate(X86_64_Function_Builder *builder, Reg a, Reg b) {
+    RegRow *a_row = &builder->block->registers.ptr[a.id], *b_row = &builder->block->registers.ptr[b.id];
+    if (a_row->next_use && b_row->next_use) return a_row->next_use > b_row->next_use;
+    int64_t a_cost, a_distance, b_cost, b_distance;
+    spill_weight(builder, a, &a_cost, &a_distance);
+    spill_weight(builder, b, &b_cost, &b_distance);
+    return a_cost * b_distance < b_cost * a_distance;
+}
+
+/**
+ * Find or free up a gp or xmm register.
+ * Free caller-saved registers are preferred; callee-saved registers
+ * cost a save and restore, but are still cheaper than a spill.
+ * All xmm registers are caller-saved.
+ */
+int alloc_hwreg_in_class(X86_64_Function_Builder *builder, bool xmm) {
     Reg spill_candidate_reg = INVALID_REG;
     int spill_candidate_hwreg = -1;
-    bool available[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
-    // callee-saved, so we just don't use them
-    available[X86_64_RSP] = false;
-    available[X86_64_RBP] = false;
-    available[X86_64_RBX] = false;
-    available[X86_64_R12] = false;
-    available[X86_64_R13] = false;
-    available[X86_64_R14] = false;
-    available[X86_64_R15] = false;
+    int free_callee_saved = -1;
+    Reg *hwregs = xmm ? builder->block->hw_reg_map.xmm_regs : builder->block->hw_reg_map.gp_regs;
+    int scratch_regs = xmm ? builder->scratch_xmm_regs : builder->scratch_regs;
     for (int i = 0; i < 16; i++) {
-        if (!available[i]) continue;
-        Reg current_reg = builder->block->hw_reg_map.gp_regs[i];
+        if (!xmm && (i == X86_64_RSP || i == X86_64_RBP)) continue;
+        if (scratch_regs & (1 << i)) continue;
+        Reg current_reg = hwregs[i];
         if (!IS_VALID_REG(current_reg)) {
-            return i;
+            if (xmm || !x86_64_is_callee_saved(i)) return i;
+            if (free_callee_saved == -1) free_callee_saved = i;
+            continue;
         }
-        if (!IS_VALID_REG(spill_candidate_reg) || current_reg.id < spill_candidate_reg.id) {
+        // operands of the current op
+        if (builder->block->registers.ptr[current_reg.id].last_use == builder->tick) continue;
+        if (!IS_VALID_REG(spill_candidate_reg) || better_spill_candidate(builder, current_reg, spill_candidate_reg)) {
             spill_candidate_reg = current_reg;
             spill_candidate_hwreg = i;
         }
     }
+    if (free_callee_saved != -1) {
+        builder->callee_saved_used |= 1 << free_callee_saved;
+        return free_callee_saved;
+    }
+    assert(IS_VALID_REG(spill_candidate_reg));
     spill_to_stack(builder, spill_candidate_reg);
-    builder->block->hw_reg_map.gp_regs[spill_candidate_hwreg] = INVALID_REG;
     return spill_candidate_hwreg;
 }
 
+// Find or free up a hwreg to allocate to reg 'reg', in its register class: the one the frontend assigned, if it's free.
+int alloc_hwreg(X86_64_Function_Builder *builder, Reg reg) {
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    bool xmm = is_xmm_type(row->type);
+    int assigned = row->assigned - 1;
+    if (assigned >= 0 && !((xmm ? builder->scratch_xmm_regs : builder->scratch_regs) & (1 << assigned))
+        && !IS_VALID_REG(*hw_reg_map_entry(builder->block, row->type, assigned))) {
+        if (!xmm && x86_64_is_callee_saved(assigned)) builder->callee_saved_used |= 1 << assigned;
+        return assigned;
+    }
+    return alloc_hwreg_in_class(builder, xmm);
+}
+
+// A hwreg for a temporary of the current op.
+int alloc_scratch_hwreg(X86_64_Function_Builder *builder, bool xmm) {
+    int hwreg = alloc_hwreg_in_class(builder, xmm);
+    add_scratch_hwreg(builder, xmm, hwreg);
+    return hwreg;
+}
+
+/**
+ * Find a free callee-saved register, or -1.
+ */
+int alloc_free_callee_saved_hwreg(X86_64_Function_Builder *builder) {
+    for (int i = 0; i < 5; i++) {
+        int hwreg = x86_64_callee_saved_regs[i];
+        if (builder->scratch_regs & (1 << hwreg)) continue;
+        if (!IS_VALID_REG(builder->block->hw_reg_map.gp_regs[hwreg])) {
+            builder->callee_saved_used |= 1 << hwreg;
+            return hwreg;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Values smaller than 8 bytes only have their low bytes defined, in hwregs and on the stack:
+ * ops on them work on the low 32 bits, and only extend them where the upper bits matter.
+ * Literals keep their value sign-extended from their size. Float literals are their bits.
+ */
+void emit_set_reg_literal(X86_64_Function_Builder *builder, int hwreg, RegRow *row) {
+    if (is_xmm_type(row->type) && row->value == 0) {
+        append_x86_64_xorps_reg_reg(&builder->buffer, hwreg, hwreg);
+    } else if (is_xmm_type(row->type)) {
+        // Go through the red zone below rsp, which doesn't need a free gp register.
+        X86_64_Address slot = x86_64_stack_slot(-8);
+        if (row->type.size == 4 || (row->value >= INT32_MIN && row->value <= INT32_MAX)) {
+            append_x86_64_store_address_imm(&builder->buffer, slot, row->value, row->type.size);
+        } else {
+            append_x86_64_store_address_imm(&builder->buffer, slot, row->value, 4);
+            slot.offset += 4;
+            append_x86_64_store_address_imm(&builder->buffer, slot, row->value >> 32, 4);
+            slot.offset -= 4;
+        }
+        append_x86_64_load_xmm_address(&builder->buffer, hwreg, slot, row->type.size);
+    } else if (row->value == 0 && !builder->keep_flags) {
+        append_x86_64_xor_reg_reg(&builder->buffer, false, hwreg, hwreg);
+    } else if (row->type.size < 8) {
+        append_x86_64_set_reg_imm32(&builder->buffer, hwreg, row->value);
+    } else {
+        append_x86_64_set_reg_imm(&builder->buffer, hwreg, row->value);
+    }
+}
+
 int move_reg_to_hw(X86_64_Function_Builder *builder, Reg reg) {
+    use_reg(builder, reg);
     RegRow *row = &builder->block->registers.ptr[reg.id];
     // unset current location
     if (row->location == LOC_CPU) {
         return row->hw_reg;
     }
     int hwreg = alloc_hwreg(builder, reg);
-    int size = row->type.size;
-    assert(size == 8);
     if (row->location == LOC_STACK) {
-        int current_offset = row->stack_offset;
-        append_x86_64_load_reg_offset(&builder->buffer, hwreg, X86_64_RSP, current_offset);
-        for (int i = current_offset; i < current_offset + size; i++) {
-            builder->block->stackframe.ptr[i] = INVALID_REG;
-        }
+        // the stack slot stays allocated: if we spill again, we don't need to store.
+        bool xmm = is_xmm_type(row->type);
+        emit_move(builder, hwreg_location(hwreg, xmm), stack_location(row->stack_offset, xmm), row->type.size);
+        builder->reloads++;
         // update new location
         set_reg_in_hwreg(builder, reg, hwreg);
     } else if (row->location == LOC_LITERAL) {
-        append_x86_64_set_reg_imm(&builder->buffer, hwreg, row->value);
-        // keep reg as literal!
+        emit_set_reg_literal(builder, hwreg, row);
+        // keep reg as literal! The hwreg is only a temporary for this op.
+        add_scratch_hwreg(builder, is_xmm_type(row->type), hwreg);
     } else {
         assert(false);
     }
     return hwreg;
 }
 
+// Move a reg that's in a hwreg to a specific other free hwreg.
+void move_reg_to_hwreg(X86_64_Function_Builder *builder, Reg reg, int hwreg) {
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    assert(row->location == LOC_CPU);
+    bool xmm = is_xmm_type(row->type);
+    emit_move(builder, hwreg_location(hwreg, xmm), hwreg_location(row->hw_reg, xmm), row->type.size);
+    *hw_reg_map_entry(builder->block, row->type, row->hw_reg) = INVALID_REG;
+    set_reg_in_hwreg(builder, reg, hwreg);
+}
+
+// Function targets are resolved on link: finalize moves them to the module's arena.
+void append_reloc_target(X86_64_Function_Builder *builder, RelocTargets *targets, Marker marker, size_t offset) {
+    X86_64_Arena *arena = &builder->arena;
+    targets->ptr = grow_list(arena, targets->ptr, targets->length, targets->length + 1, sizeof(RelocTarget));
+    targets->ptr[targets->length++] = (RelocTarget) { marker, offset };
+}
+
 void copy_reloc_to_hw(X86_64_Function_Builder *builder, int hwreg, Marker marker) {
-    RelocTargets *targets = &builder->far_function_targets;
-    targets->ptr = realloc(targets->ptr, ++targets->length * sizeof(RelocTarget));
     size_t offset = append_x86_64_set_reg_marker_placeholder(&builder->buffer, hwreg);
-    targets->ptr[targets->length - 1] = (RelocTarget) { marker, offset };
+    append_reloc_target(builder, &builder->far_function_targets, marker, offset);
 }
 
-// don't update any builder stats, just copy into a known hwreg
+// don't update any builder stats, just copy into a known hwreg of the reg's class
 // this is used if we want to pull a copy of a reg to use in an instr,
 // but not use it going forward after.
 void copy_reg_to_hw(X86_64_Function_Builder *builder, int hwreg, Reg reg) {
+    use_reg(builder, reg);
     RegRow *row = &builder->block->registers.ptr[reg.id];
+    bool xmm = is_xmm_type(row->type);
     if (row->location == LOC_CPU) {
         if (hwreg != row->hw_reg) {
-            append_x86_64_set_reg_reg(&builder->buffer, hwreg, row->hw_reg);
+            emit_move(builder, hwreg_location(hwreg, xmm), hwreg_location(row->hw_reg, xmm), row->type.size);
         }
     } else if (row->location == LOC_STACK) {
-        int current_offset = row->stack_offset;
-        assert(row->type.size == 8);
-        append_x86_64_load_reg_offset(&builder->buffer, hwreg, X86_64_RSP, current_offset);
+        emit_move(builder, hwreg_location(hwreg, xmm), stack_location(row->stack_offset, xmm), row->type.size);
+        builder->reloads++;
     } else if (row->location == LOC_LITERAL) {
-        append_x86_64_set_reg_imm(&builder->buffer, hwreg, row->value);
+        emit_set_reg_literal(builder, hwreg, row);
+    } else if (row->location == LOC_RELOC) {
+        copy_reloc_to_hw(builder, hwreg, row->marker);
     } else {
         assert(false);
     }
 }
 
+typedef struct {
+    Reg reg;
+    // of the reg's type, and so of any stack slot the move reads or writes
+    int size;
+    // If the reg is in a hwreg or on the stack. Otherwise, it's materialized after all other moves.
+    bool has_from;
+    X86_64_Location from;
+    X86_64_Location to;
+} X86_64_Move;
+
+// Where a value in a hwreg or on the stack is: its hwreg, if it has one.
+X86_64_Location row_location(RegRow *row) {
+    if (row->location == LOC_CPU) {
+        return (X86_64_Location) { false, row->hw_reg, is_xmm_type(row->type) };
+    }
+    return (X86_64_Location) { true, row->stack_offset, is_xmm_type(row->type) };
+}
+
+X86_64_Move move_reg_to_location(X86_64_Function_Builder *builder, Reg reg, X86_64_Location to) {
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    assert(to.xmm == is_xmm_type(row->type));
+    X86_64_Move move = { .reg = reg, .size = row->type.size, .to = to };
+    if (row->location == LOC_CPU || row->location == LOC_STACK) {
+        move.has_from = true;
+        move.from = row_location(row);
+    } else {
+        assert(row->location == LOC_LITERAL || row->location == LOC_RELOC);
+    }
+    return move;
+}
+
+bool same_location(X86_64_Location a, X86_64_Location b) {
+    return a.stack == b.stack && a.index == b.index && a.xmm == b.xmm;
+}
+
+/**
+ * Copy a value of 'size' bytes. Both locations have its register class.
+ * None of these copies touch the flags, since moves can come between a compare and its branch.
+ */
+void emit_location_copy(X86_64_Function_Builder *builder, X86_64_Location to, X86_64_Location from, int size) {
+    Buffer *buffer = &builder->buffer;
+    if (!to.stack || !from.stack) {
+        emit_move(builder, to, from, size);
+        if (to.stack) builder->spills++;
+        else if (from.stack) builder->reloads++;
+    } else if (size >= 8) {
+        // pop computes its address after incrementing rsp, so both use the same offsets.
+        for (int i = 0; i < size; i += 8) {
+            append_x86_64_push_offset(buffer, X86_64_RSP, from.index + i);
+            append_x86_64_pop_offset(buffer, X86_64_RSP, to.index + i);
+        }
+    } else {
+        // Narrower slots can't take a pop: go through rax, saved below the frame.
+        append_x86_64_push_reg(buffer, X86_64_RAX);
+        append_x86_64_load_address(buffer, X86_64_RAX, x86_64_stack_slot(from.index + 8), size, false);
+        append_x86_64_store_address(buffer, x86_64_stack_slot(to.index + 8), X86_64_RAX, size);
+        append_x86_64_pop_reg(buffer, X86_64_RAX);
+    }
+}
+
+void emit_location_swap(X86_64_Function_Builder *builder, X86_64_Location a, X86_64_Location b, int size) {
+    Buffer *buffer = &builder->buffer;
+    if (a.stack && !b.stack) {
+        X86_64_Location c = a;
+        a = b;
+        b = c;
+    }
+    if (!a.stack && !b.stack && a.xmm) {
+        // Three xors swap the whole registers.
+        append_x86_64_xorps_reg_reg(buffer, a.index, b.index);
+        append_x86_64_xorps_reg_reg(buffer, b.index, a.index);
+        append_x86_64_xorps_reg_reg(buffer, a.index, b.index);
+    } else if (!a.stack && !b.stack) {
+        append_x86_64_xchg_reg_reg(buffer, a.index, b.index);
+    } else if (!a.stack && a.xmm) {
+        // There's no xchg for xmm registers: go through another one, saved in the red zone below rsp.
+        Type value_type = float_type(size);
+        int temp = a.index == 0 ? 1 : 0;
+        X86_64_Address save = x86_64_stack_slot(-16);
+        append_x86_64_store_xmm_address(buffer, save, temp, 16);
+        append_x86_64_load_value(buffer, temp, x86_64_stack_slot(b.index), value_type);
+        append_x86_64_store_value(buffer, x86_64_stack_slot(b.index), a.index, value_type);
+        append_x86_64_movaps_reg_reg(buffer, a.index, temp);
+        append_x86_64_load_xmm_address(buffer, temp, save, 16);
+    } else if (!a.stack) {
+        append_x86_64_xchg_address(buffer, a.index, x86_64_stack_slot(b.index), size);
+    } else if (size >= 8) {
+        for (int i = 0; i < size; i += 8) {
+            append_x86_64_push_offset(buffer, X86_64_RSP, a.index + i);
+            append_x86_64_push_offset(buffer, X86_64_RSP, b.index + i + 8);
+            append_x86_64_pop_offset(buffer, X86_64_RSP, a.index + i + 8);
+            append_x86_64_pop_offset(buffer, X86_64_RSP, b.index + i);
+        }
+    } else {
+        append_x86_64_push_reg(buffer, X86_64_RAX);
+        append_x86_64_push_reg(buffer, X86_64_RCX);
+        append_x86_64_load_address(buffer, X86_64_RAX, x86_64_stack_slot(a.index + 16), size, false);
+        append_x86_64_load_address(buffer, X86_64_RCX, x86_64_stack_slot(b.index + 16), size, false);
+        append_x86_64_store_address(buffer, x86_64_stack_slot(b.index + 16), X86_64_RAX, size);
+        append_x86_64_store_address(buffer, x86_64_stack_slot(a.index + 16), X86_64_RCX, size);
+        append_x86_64_pop_reg(buffer, X86_64_RCX);
+        append_x86_64_pop_reg(buffer, X86_64_RAX);
+    }
+}
+
+/**
+ * Perform a set of moves as if they all happened at once.
+ * Every target location must be unique.
+ * Only emits code; the caller updates the block stats.
+ */
+void emit_parallel_move(X86_64_Function_Builder *builder, X86_64_Move *moves, size_t length) {
+    bool *done = calloc(length, sizeof(bool));
+    for (int i = 0; i < length; i++) {
+        if (moves[i].has_from && same_location(moves[i].from, moves[i].to)) done[i] = true;
+    }
+    while (true) {
+        int first_pending = -1;
+        bool progress = false;
+        for (int i = 0; i < length; i++) {
+            if (done[i] || !moves[i].has_from) continue;
+            if (first_pending == -1) first_pending = i;
+            // can't overwrite a location that another move still reads
+            bool blocked = false;
+            for (int k = 0; k < length; k++) {
+                if (k != i && !done[k] && moves[k].has_from && same_location(moves[k].from, moves[i].to)) {
+                    blocked = true;
+                    break;
+                }
+            }
+            if (blocked) continue;
+            emit_location_copy(builder, moves[i].to, moves[i].from, moves[i].size);
+            done[i] = true;
+            progress = true;
+        }
+        if (first_pending == -1) break;
+        if (progress) continue;
+        // Only cycles are left. Swap a move's source and target, then redirect moves that read either.
+        // The swap has the size of the move, so a hwreg target may hold a larger value that it can't swap:
+        // but every cycle also has a move into a stack slot, or it only has hwregs.
+        for (; first_pending < length; first_pending++) {
+            X86_64_Move *move = &moves[first_pending];
+            if (!done[first_pending] && move->has_from && !(move->from.stack && !move->to.stack)) break;
+        }
+        assert(first_pending < length);
+        X86_64_Move *move = &moves[first_pending];
+        emit_location_swap(builder, move->from, move->to, move->size);
+        for (int k = 0; k < length; k++) {
+            if (k == first_pending || done[k] || !moves[k].has_from) continue;
+            if (same_location(moves[k].from, move->to)) moves[k].from = move->from;
+            else if (same_location(moves[k].from, move->from)) moves[k].from = move->to;
+        }
+        done[first_pending] = true;
+    }
+    // Literals and relocations don't read any location.
+    for (int i = 0; i < length; i++) {
+        if (done[i]) continue;
+        assert(!moves[i].to.stack);
+        copy_reg_to_hw(builder, moves[i].to.index, moves[i].reg);
+    }
+    free(done);
+}
+
+bool is_stored(RegRow *row) {
+    return row->type.size > 0 && (row->location == LOC_CPU || row->location == LOC_STACK);
+}
+
+/**
+ * Compute the moves that take values from where 'from' has them to where 'to' expects them.
+ * Literals and relocations are the same in every state.
+ * Values that 'from' doesn't have are not defined on this edge, so they can't be used after it:
+ * if 'shrink' is set, they are dropped from 'to'.
+ */
+X86_64_Move *state_transfer_moves(X86_64_Block_Stats *from, X86_64_Block_Stats *to, bool shrink, size_t *length) {
+    X86_64_Move *moves = malloc(to->registers.length * sizeof(X86_64_Move));
+    *length = 0;
+    for (int i = 0; i < to->registers.length; i++) {
+        RegRow *to_row = &to->registers.ptr[i];
+        if (!is_stored(to_row)) continue;
+        RegRow *from_row = i < from->registers.length ? &from->registers.ptr[i] : NULL;
+        if (!from_row || !is_stored(from_row)) {
+            if (shrink) block_release_reg(to, (Reg) { i });
+            continue;
+        }
+        X86_64_Location to_location = row_location(to_row);
+        // the stack copy is as good as the hwreg
+        if (to_location.stack && from_row->stack_offset == to_location.index) continue;
+        X86_64_Location from_location = row_location(from_row);
+        if (same_location(from_location, to_location)) continue;
+        moves[(*length)++] = (X86_64_Move) {
+            .reg = (Reg) { i },
+            .size = to_row->type.size,
+            .has_from = true,
+            .from = from_location,
+            .to = to_location,
+        };
+    }
+    return moves;
+}
+
+void emit_state_transfer(X86_64_Function_Builder *builder, X86_64_Block_Stats *from, X86_64_Block_Stats *to, bool shrink) {
+    size_t length;
+    X86_64_Move *moves = state_transfer_moves(from, to, shrink, &length);
+    emit_parallel_move(builder, moves, length);
+    free(moves);
+}
+
+/**
+ * The code heap: executable memory shared by all modules.
+ * Regions are mapped twice from a memfd: an RX view the code runs from, and an RW view it's written through,
+ * so no page is ever writable and executable, and writing never disturbs code running from the same pages.
+ * Without memfd, a region has a single view that is flipped to RW for writing and back to RX.
+ * Small allocations come in power-of-two size classes with a free list each; large ones get a region of their own.
+ */
+#define X86_64_CODE_REGION_SIZE (1 << 20)
+#define X86_64_CODE_MIN_CLASS 6
+#define X86_64_CODE_MAX_CLASS 16
+#define X86_64_CODE_CLASSES (X86_64_CODE_MAX_CLASS - X86_64_CODE_MIN_CLASS + 1)
+
+typedef struct {
+    unsigned char *exec;
+    unsigned char *write;
+    size_t size;
+    // bytes handed out from the start of the region, never handed back
+    size_t top;
+    // holds one large allocation
+    bool dedicated;
+} X86_64_Code_Region;
+
+typedef struct {
+    size_t length;
+    unsigned char **ptr;
+} X86_64_Code_Chunks;
+
+typedef struct {
+    size_t page_size;
+    size_t length;
+    X86_64_Code_Region *ptr;
+    X86_64_Code_Chunks free_chunks[X86_64_CODE_CLASSES];
+    CodeHeapStats stats;
+    // Modules of different threads share the heap.
+    pthread_mutex_t lock;
+} X86_64_Code_Heap;
+
+X86_64_Code_Heap x86_64_code_heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Addresses that code must be able to reach with a rel32. Empty if lowest > highest.
+typedef struct {
+    uint64_t lowest, highest;
+} X86_64_Reach;
+
+#define X86_64_REACH_ANYWHERE ((X86_64_Reach) { UINT64_MAX, 0 })
+
+// Whether a rel32 displacement from anywhere in [start, start + length) reaches all of 'reach'.
+bool rel32_reaches(uint64_t start, size_t length, X86_64_Reach reach) {
+    if (reach.lowest > reach.highest) return true;
+    int64_t furthest_below = (int64_t) (start + length - reach.lowest);
+    int64_t furthest_above = (int64_t) (reach.highest - start);
+    return furthest_below <= INT_MAX && furthest_above <= INT_MAX;
+}
+
+size_t round_to_pages(size_t size) {
+    if (!x86_64_code_heap.page_size) x86_64_code_heap.page_size = sysconf(_SC_PAGESIZE);
+    size_t page_size = x86_64_code_heap.page_size;
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// Size class index for 'size', or -1 if it's too large for one.
+int code_size_class(size_t size) {
+    for (int i = 0; i < X86_64_CODE_CLASSES; i++) {
+        if (size <= (1 << (X86_64_CODE_MIN_CLASS + i))) return i;
+    }
+    return -1;
+}
+
+size_t code_class_size(int size_class) {
+    return 1 << (X86_64_CODE_MIN_CLASS + size_class);
+}
+
+bool map_code_region(X86_64_Code_Region *region, size_t size, void *hint) {
+    *region = (X86_64_Code_Region) { .size = size };
+    int fd = memfd_create("mujit-code", MFD_CLOEXEC);
+    if (fd != -1) {
+        if (ftruncate(fd, size) == 0) {
+            region->exec = mmap(hint, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+            region->write = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (region->exec && region->exec != MAP_FAILED && region->write && region->write != MAP_FAILED) return true;
+        if (region->exec && region->exec != MAP_FAILED) munmap(region->exec, size);
+        if (region->write && region->write != MAP_FAILED) munmap(region->write, size);
+    }
+    region->exec = mmap(hint, size, PROT_READ | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    region->write = region->exec;
+    return region->exec != MAP_FAILED;
+}
+
+void unmap_code_region(X86_64_Code_Region *region) {
+    munmap(region->exec, region->size);
+    if (region->write != region->exec) munmap(region->write, region->size);
+}
+
+/**
+ * Map a new region, within reach if possible. Returns its index, or -1.
+ * Without MAP_FIXED, the address is just a hint: check where the mapping actually ended up.
+ * Try right above and below the reach first, then further away if that's taken.
+ */
+int add_code_region(size_t size, bool dedicated, X86_64_Reach reach) {
+    X86_64_Code_Heap *heap = &x86_64_code_heap;
+    X86_64_Code_Region region;
+    bool found = false;
+    if (reach.lowest > reach.highest) {
+        found = map_code_region(&region, size, NULL);
+    } else if (reach.highest - reach.lowest < INT_MAX) {
+        for (uint64_t distance = 0; !found && distance < (1 << 30); distance += (1 << 26)) {
+            uint64_t hints[2] = { reach.highest + heap->page_size + distance, reach.lowest - size - heap->page_size - distance };
+            for (int i = 0; !found && i < 2; i++) {
+                if (hints[i] > reach.highest + (1ULL << 31) || hints[i] + (1ULL << 31) < reach.lowest) continue;
+                void *hint = (void*) (hints[i] & ~(heap->page_size - 1));
+                if (!map_code_region(&region, size, hint)) continue;
+                found = rel32_reaches((uint64_t) region.exec, size, reach);
+                if (!found) unmap_code_region(&region);
+            }
+        }
+    }
+    if (!found) return -1;
+    region.dedicated = dedicated;
+    heap->ptr = grow_list(NULL, heap->ptr, heap->length, heap->length + 1, sizeof(X86_64_Code_Region));
+    heap->ptr[heap->length++] = region;
+    heap->stats.regions++;
+    heap->stats.mapped += size;
+    return heap->length - 1;
+}
+
+X86_64_Code_Region *find_code_region(unsigned char *code) {
+    X86_64_Code_Heap *heap = &x86_64_code_heap;
+    for (int i = 0; i < heap->length; i++) {
+        X86_64_Code_Region *region = &heap->ptr[i];
+        if (code >= region->exec && code < region->exec + region->size) return region;
+    }
+    assert(false);
+    return NULL;
+}
+
+/**
+ * Allocate 'size' bytes of executable memory, placed so that all of it can reach 'reach' with a rel32.
+ * Returns NULL if no such place can be found.
+ */
+unsigned char *locked_code_heap_alloc(size_t size, X86_64_Reach reach) {
+    X86_64_Code_Heap *heap = &x86_64_code_heap;
+    round_to_pages(0);
+    int size_class = code_size_class(size);
+    unsigned char *code = NULL;
+    if (size_class == -1) {
+        size_t allocated = round_to_pages(size);
+        int index = add_code_region(allocated, true, reach);
+        if (index == -1) return NULL;
+        code = heap->ptr[index].exec;
+        heap->ptr[index].top = allocated;
+        heap->stats.allocated += allocated;
+        heap->stats.used += size;
+        return code;
+    }
+    size_t allocated = code_class_size(size_class);
+    X86_64_Code_Chunks *chunks = &heap->free_chunks[size_class];
+    for (int i = 0; !code && i < chunks->length; i++) {
+        if (!rel32_reaches((uint64_t) chunks->ptr[i], allocated, reach)) continue;
+        code = chunks->ptr[i];
+        chunks->ptr[i] = chunks->ptr[--chunks->length];
+        heap->stats.free -= allocated;
+    }
+    for (int i = 0; !code && i < heap->length; i++) {
+        X86_64_Code_Region *region = &heap->ptr[i];
+        if (region->dedicated || region->size - region->top < allocated) continue;
+        if (!rel32_reaches((uint64_t) (region->exec + region->top), allocated, reach)) continue;
+        code = region->exec + region->top;
+        region->top += allocated;
+    }
+    if (!code) {
+        int index = add_code_region(X86_64_CODE_REGION_SIZE, false, reach);
+        if (index == -1) return NULL;
+        code = heap->ptr[index].exec;
+        heap->ptr[index].top = allocated;
+    }
+    heap->stats.allocated += allocated;
+    heap->stats.used += size;
+    return code;
+}
+
+unsigned char *code_heap_alloc(size_t size, X86_64_Reach reach) {
+    pthread_mutex_lock(&x86_64_code_heap.lock);
+    unsigned char *code = locked_code_heap_alloc(size, reach);
+    pthread_mutex_unlock(&x86_64_code_heap.lock);
+    return code;
+}
+
+void locked_code_heap_free(unsigned char *code, size_t size) {
+    X86_64_Code_Heap *heap = &x86_64_code_heap;
+    int size_class = code_size_class(size);
+    heap->stats.used -= size;
+    if (size_class == -1) {
+        X86_64_Code_Region *region = find_code_region(code);
+        heap->stats.allocated -= region->size;
+        heap->stats.mapped -= region->size;
+        heap->stats.regions--;
+        unmap_code_region(region);
+        *region = heap->ptr[--heap->length];
+        return;
+    }
+    size_t allocated = code_class_size(size_class);
+    X86_64_Code_Chunks *chunks = &heap->free_chunks[size_class];
+    chunks->ptr = grow_list(NULL, chunks->ptr, chunks->length, chunks->length + 1, sizeof(unsigned char*));
+    chunks->ptr[chunks->length++] = code;
+    heap->stats.allocated -= allocated;
+    heap->stats.free += allocated;
+}
+
+void code_heap_free(unsigned char *code, size_t size) {
+    pthread_mutex_lock(&x86_64_code_heap.lock);
+    locked_code_heap_free(code, size);
+    pthread_mutex_unlock(&x86_64_code_heap.lock);
+}
+
+/**
+ * Where 'code' in the heap is mapped writable, or NULL if its region only has the one mapping,
+ * which code_heap_write makes writable for each write.
+ */
+unsigned char *code_heap_write_address(unsigned char *code) {
+    pthread_mutex_lock(&x86_64_code_heap.lock);
+    X86_64_Code_Region *region = find_code_region(code);
+    unsigned char *write = region->write != region->exec ? region->write + (code - region->exec) : NULL;
+    pthread_mutex_unlock(&x86_64_code_heap.lock);
+    return write;
+}
+
+// Copy 'length' bytes to 'code' in the heap.
+void code_heap_write(unsigned char *code, const void *data, size_t length) {
+    unsigned char *write = code_heap_write_address(code);
+    if (write) {
+        memcpy(write, data, length);
+        return;
+    }
+    // The pages of other writes may be in this range: they have to wait until it's executable again.
+    pthread_mutex_lock(&x86_64_code_heap.lock);
+    size_t page_size = x86_64_code_heap.page_size;
+    unsigned char *start = (unsigned char*) ((uint64_t) code & ~(page_size - 1));
+    size_t pages_length = round_to_pages(code + length - start);
+    mprotect(start, pages_length, PROT_READ | PROT_WRITE);
+    memcpy(code, data, length);
+    mprotect(start, pages_length, PROT_READ | PROT_EXEC);
+    pthread_mutex_unlock(&x86_64_code_heap.lock);
+}
+
+void x86_64_get_heap_stats(CodeHeapStats *stats) {
+    pthread_mutex_lock(&x86_64_code_heap.lock);
+    *stats = x86_64_code_heap.stats;
+    pthread_mutex_unlock(&x86_64_code_heap.lock);
+}
+
 void x86_64_import_function(void *module_, Marker marker, void (*funcptr)()) {
     X86_64_Module *module = (X86_64_Module*) module_;
     X86_64_Fixed_Resolutions *resolutions = &module->resolutions;
     union pedantic_convert convert;
     convert.funcptr = funcptr;
-    resolutions->ptr = realloc(resolutions->ptr, ++resolutions->length * sizeof(X86_64_Fixed_Resolution));
-    resolutions->ptr[resolutions->length - 1] = (X86_64_Fixed_Resolution) {
+    pthread_mutex_lock(&module->lock);
+    resolutions->ptr = grow_list(&module->arena, resolutions->ptr, resolutions->length, resolutions->length + 1, sizeof(X86_64_Fixed_Resolution));
+    resolutions->ptr[resolutions->length++] = (X86_64_Fixed_Resolution) {
         .marker = marker,
         .value = (int64_t) convert.ptr,
     };
+    pthread_mutex_unlock(&module->lock);
+}
+
+/**
+ * The CpuFeature bits of the CPU, which new modules generate code for.
+ * AVX and AVX-512 also need the OS to save their registers, which XCR0 tells.
+ */
+unsigned x86_64_cpu_features;
+
+unsigned detect_x86_64_cpu_features() {
+    unsigned features = 0;
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    if (ecx & (1 << 23)) features |= CPU_POPCNT;
+    bool avx_state = false, avx512_state = false;
+    // OSXSAVE
+    if (ecx & (1 << 27)) {
+        uint32_t xcr0, xcr0_high;
+        __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_high) : "c" (0));
+        avx_state = (xcr0 & 0x06) == 0x06;
+        avx512_state = (xcr0 & 0xE6) == 0xE6;
+    }
+    if (avx_state && (ecx & (1 << 28))) features |= CPU_AVX;
+    if (avx_state && (ecx & (1 << 12))) features |= CPU_FMA;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        if (ebx & (1 << 3)) features |= CPU_BMI1;
+        if (ebx & (1 << 8)) features |= CPU_BMI2;
+        if (avx_state && (ebx & (1 << 5))) features |= CPU_AVX2;
+        if (avx512_state && (ebx & (1 << 16))) features |= CPU_AVX512F;
+    }
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 5))) features |= CPU_LZCNT;
+    // To test lower tiers without changing the program: a mask of CpuFeature bits to keep.
+    const char *mask = getenv("MUJIT_CPU_FEATURES");
+    if (mask) features &= strtoul(mask, NULL, 0);
+    return features;
+}
+
+unsigned x86_64_get_cpu_features() {
+    return x86_64_cpu_features;
+}
+
+// How many calls make a tiered function hot, unless the module sets its own.
+#define X86_64_TIER_THRESHOLD 1000
+
+void x86_64_set_cpu_features(void *module_, unsigned features) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    module->cpu_features = features;
+}
+
+void x86_64_set_link_threads(void *module_, int threads) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    assert(threads >= 1);
+    module->link_threads = threads;
+}
+
+void x86_64_set_tier_threshold(void *module_, int calls) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    assert(calls >= 1 && !module->code);
+    module->tier_threshold = calls;
+}
+
+void x86_64_set_peephole(void *module_, bool enabled) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    module->peephole = enabled;
 }
 
 void *x86_64_new_module() {
     X86_64_Module *module = malloc(sizeof(X86_64_Module));
     *module = (X86_64_Module) {0};
+    module->cpu_features = x86_64_cpu_features;
+    module->peephole = true;
+    module->link_threads = 1;
+    module->tier_threshold = X86_64_TIER_THRESHOLD;
+    pthread_mutex_init(&module->lock, NULL);
+    pthread_mutex_init(&module->lazy_lock, NULL);
+    pthread_cond_init(&module->hot_cond, NULL);
     return module;
 }
 
-void x86_64_link_module(void *module_) {
-    X86_64_Module *module = (X86_64_Module*) module_;
-    // Allocate the target area.
-    uint64_t *marker_values = malloc(module->next_marker * sizeof(uint64_t));
+// Lazy function stub: jmp [rip+slot]; mov r11, record; jmp thunk; the slot.
+#define X86_64_STUB_SIZE 32
+#define X86_64_STUB_SLOT 24
 
-    for (int i = 0; i < module->resolutions.length; i++) {
-        X86_64_Fixed_Resolution *resolution = &module->resolutions.ptr[i];
-        marker_values[resolution->marker.id] = resolution->value;
-    }
+size_t append_x86_64_lazy_stub(Buffer *buffer, X86_64_Lazy_Function *lazy, uint64_t stub, uint64_t thunk) {
+    reserve(buffer, X86_64_STUB_SIZE);
+    size_t start = buffer->offset;
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 0, 4, 5);
+    put_x86_64_imm_w(buffer, X86_64_STUB_SLOT - 6);
+    size_t resolve_offset = buffer->offset - start;
+    append_x86_64_set_reg_imm(buffer, X86_64_R11, (uint64_t) lazy);
+    put(buffer, 0xe9);
+    put_x86_64_imm_w(buffer, thunk - (stub + buffer->offset - start + 4));
+    append_x86_64_nop(buffer, X86_64_STUB_SLOT - (buffer->offset - start));
+    // Until resolved, the slot points right behind the jmp.
+    put_x86_64_imm_q(buffer, lazy->code ? (uint64_t) lazy->code : stub + resolve_offset);
+    return X86_64_STUB_SIZE;
+}
 
-    size_t code_length = 0;
-    for (int i = 0; i < module->builders.length; i++) {
-        X86_64_Function_Builder *builder = module->builders.ptr[i];
-        code_length += builder->buffer.offset;
-    }
-    int pages = (code_length + 1023) / 1024;
-    unsigned char *target = mmap(NULL, pages * 1024, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+/**
+ * Tiered function stub: jmp [rip+slot]; and where the slot points until the tier thread swaps in the new code:
+ * mov r11, &calls; lock inc qword [r11]; jz resolve; jmp [rip+code]; resolve: mov r11, record; jmp thunk;
+ * then the tier 0 code and the slot.
+ */
+#define X86_64_TIERED_STUB_SIZE 64
+#define X86_64_TIERED_STUB_CODE 48
+#define X86_64_TIERED_STUB_SLOT 56
 
-    // Now that we know the target area, we can compute and resolve the offsets.
-    size_t target_offset = 0;
-    for (int i = 0; i < module->builders.length; i++) {
-        X86_64_Function_Builder *builder = module->builders.ptr[i];
-        marker_values[builder->declaration.id] = (int64_t)(target + target_offset);
-        target_offset += builder->buffer.offset;
+size_t append_x86_64_tiered_stub(Buffer *buffer, X86_64_Lazy_Function *lazy, uint64_t stub, uint64_t thunk) {
+    reserve(buffer, X86_64_TIERED_STUB_SIZE);
+    size_t start = buffer->offset;
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 0, 4, 5);
+    put_x86_64_imm_w(buffer, X86_64_TIERED_STUB_SLOT - 6);
+    size_t count_offset = buffer->offset - start;
+    append_x86_64_set_reg_imm(buffer, X86_64_R11, (uint64_t) &lazy->calls);
+    put(buffer, 0xf0);
+    put_x86_64_rex(buffer, 1, 0, 0, 1);
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 0, 0, X86_64_R11 & 0x7);
+    put(buffer, 0x0f);
+    put(buffer, 0x84);
+    size_t jz_offset = buffer->offset;
+    put_x86_64_imm_w(buffer, 0);
+    put(buffer, 0xff);
+    put_x86_64_modrm(buffer, 0, 4, 5);
+    put_x86_64_imm_w(buffer, X86_64_TIERED_STUB_CODE - (buffer->offset - start + 4));
+    patch_x86_64_imm_w(buffer, jz_offset, buffer->offset - (jz_offset + 4));
+    append_x86_64_set_reg_imm(buffer, X86_64_R11, (uint64_t) lazy);
+    put(buffer, 0xe9);
+    put_x86_64_imm_w(buffer, thunk - (stub + buffer->offset - start + 4));
+    assert(buffer->offset - start <= X86_64_TIERED_STUB_CODE);
+    append_x86_64_nop(buffer, X86_64_TIERED_STUB_CODE - (buffer->offset - start));
+    put_x86_64_imm_q(buffer, (uint64_t) lazy->code);
+    put_x86_64_imm_q(buffer, stub + count_offset);
+    return X86_64_TIERED_STUB_SIZE;
+}
+
+void *x86_64_resolve_lazy_function(X86_64_Lazy_Function *lazy);
+
+/**
+ * Call x86_64_resolve_lazy_function(r11), and jump to the function it returns.
+ * The argument registers, xmm0-7 and al (for varargs) are preserved, so the function gets the original call.
+ */
+int x86_64_thunk_saved_regs[7] = { X86_64_RDI, X86_64_RSI, X86_64_RDX, X86_64_RCX, X86_64_R8, X86_64_R9, X86_64_RAX };
+
+void append_x86_64_resolver_thunk(Buffer *buffer) {
+    append_x86_64_push_reg(buffer, X86_64_RBP);
+    append_x86_64_set_reg_reg(buffer, X86_64_RBP, X86_64_RSP);
+    for (int i = 0; i < 7; i++) {
+        append_x86_64_push_reg(buffer, x86_64_thunk_saved_regs[i]);
     }
-    target_offset = 0;
-    for (int i = 0; i < module->builders.length; i++) {
-        X86_64_Function_Builder *builder = module->builders.ptr[i];
-        for (int k = 0; k < builder->near_function_targets.length; k++) {
-            RelocTarget *reloc = &builder->near_function_targets.ptr[k];
-            Buffer upfixer = builder->buffer;
-            upfixer.offset = reloc->offset;
-            int64_t relvalue = marker_values[reloc->marker.id] - (int64_t) (target + target_offset + reloc->offset) - 4;
-            assert(relvalue >= INT_MIN && relvalue <= INT_MAX);
-            append_x86_64_imm_w(&upfixer, relvalue);
-        }
-        for (int k = 0; k < builder->far_function_targets.length; k++) {
-            RelocTarget *reloc = &builder->far_function_targets.ptr[k];
-            Buffer upfixer = builder->buffer;
-            upfixer.offset = reloc->offset;
-            append_x86_64_imm_q(&upfixer, marker_values[reloc->marker.id]);
-        }
-        memcpy(target + target_offset, builder->buffer.ptr, builder->buffer.offset);
-        union pedantic_convert generated_fn;
-        generated_fn.ptr = target + target_offset;
-        builder->funcptr = generated_fn.funcptr;
-        target_offset += builder->buffer.offset;
-    }
-    mprotect(target, pages * 1024, PROT_EXEC);
-}
-
-void copy_block(X86_64_Block_Stats *dest, X86_64_Block_Stats *src) {
-    dest->registers.length = src->registers.length;
-    dest->registers.ptr = malloc(dest->registers.length * sizeof(RegRow));
-    memcpy(dest->registers.ptr, src->registers.ptr, dest->registers.length * sizeof(RegRow));
-    dest->stackframe.length = src->stackframe.length;
-    dest->stackframe.ptr = malloc(dest->stackframe.length * sizeof(Reg));
-    memcpy(dest->stackframe.ptr, src->stackframe.ptr, dest->stackframe.length * sizeof(Reg));
-    memcpy(&dest->hw_reg_map, &src->hw_reg_map, 16 * sizeof(Reg));
+    // rbp and 7 regs were pushed on top of the return address: realign the stack to 16.
+    append_x86_64_sub_reg_imm(buffer, true, X86_64_RSP, 8 + 8 * 16);
+    for (int i = 0; i < 8; i++) {
+        append_x86_64_store_xmm_address(buffer, x86_64_stack_slot(16 * i), i, 16);
+    }
+    append_x86_64_set_reg_reg(buffer, X86_64_RDI, X86_64_R11);
+    union pedantic_convert convert;
+    convert.funcptr = (void(*)()) x86_64_resolve_lazy_function;
+    append_x86_64_set_reg_imm(buffer, X86_64_RAX, (uint64_t) convert.ptr);
+    append_x86_64_call_reg(buffer, X86_64_RAX);
+    append_x86_64_set_reg_reg(buffer, X86_64_R11, X86_64_RAX);
+    for (int i = 0; i < 8; i++) {
+        append_x86_64_load_xmm_address(buffer, i, x86_64_stack_slot(16 * i), 16);
+    }
+    append_x86_64_add_reg_imm(buffer, true, X86_64_RSP, 8 + 8 * 16);
+    for (int i = 6; i >= 0; i--) {
+        append_x86_64_pop_reg(buffer, x86_64_thunk_saved_regs[i]);
+    }
+    append_x86_64_pop_reg(buffer, X86_64_RBP);
+    append_x86_64_jmp_reg(buffer, X86_64_R11);
 }
 
-void* x86_64_begin_bb(void *fun, void *pred_bb) {
-    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    assert(builder->block == NULL);
-    builder->block = malloc(sizeof(X86_64_Block_Stats));
-    if (pred_bb) {
-        copy_block(builder->block, (X86_64_Block_Stats*) pred_bb);
+// Keep the larger of the buffers in 'spare', for the next function.
+void release_buffer(Buffer *spare, Buffer *buffer) {
+    if (buffer->length > spare->length) {
+        free(spare->ptr);
+        *spare = *buffer;
     } else {
-        *builder->block = (X86_64_Block_Stats) {0};
+        free(buffer->ptr);
     }
-    return builder->block;
+    *buffer = (Buffer) {0};
+}
+
+/**
+ * Resolve the builder's relocations for code placed at 'target', and write it there,
+ * or to 'write' if that's where the heap has it mapped writable.
+ * rel32 calls that can't reach their target go through its veneer.
+ */
+void link_builder(X86_64_Module *module, X86_64_Function_Builder *builder, unsigned char *target, unsigned char *write,
+                  Buffer *spare) {
+    for (int k = 0; k < builder->near_function_targets.length; k++) {
+        RelocTarget *reloc = &builder->near_function_targets.ptr[k];
+        int64_t next_instr = (int64_t) (target + reloc->offset + 4);
+        int64_t relvalue = module->marker_values[reloc->marker.id] - next_instr;
+        if ((relvalue < INT_MIN || relvalue > INT_MAX) && module->veneers[reloc->marker.id]) {
+            relvalue = module->veneers[reloc->marker.id] - next_instr;
+        }
+        assert(relvalue >= INT_MIN && relvalue <= INT_MAX);
+        patch_x86_64_imm_w(&builder->buffer, reloc->offset, relvalue);
+    }
+    for (int k = 0; k < builder->far_function_targets.length; k++) {
+        RelocTarget *reloc = &builder->far_function_targets.ptr[k];
+        patch_x86_64_imm_q(&builder->buffer, reloc->offset, module->marker_values[reloc->marker.id]);
+    }
+    if (write) memcpy(write, builder->buffer.ptr, builder->code_size);
+    else code_heap_write(target, builder->buffer.ptr, builder->code_size);
+    release_buffer(spare, &builder->buffer);
+    union pedantic_convert generated_fn;
+    generated_fn.ptr = target;
+    builder->funcptr = generated_fn.funcptr;
+}
+
+// A share of the module's builders, linked by one thread.
+typedef struct {
+    X86_64_Module *module;
+    size_t start;
+    size_t end;
+    // of the first builder
+    unsigned char *target;
+    unsigned char *write;
+    Buffer spare;
+} X86_64_Link_Job;
+
+void *link_builders(void *job_) {
+    X86_64_Link_Job *job = (X86_64_Link_Job*) job_;
+    size_t offset = 0;
+    for (size_t i = job->start; i < job->end; i++) {
+        X86_64_Function_Builder *builder = job->module->builders.ptr[i];
+        link_builder(job->module, builder, job->target + offset, job->write ? job->write + offset : NULL, &job->spare);
+        offset += builder->code_size;
+    }
+    return NULL;
+}
+
+/**
+ * Link the builders into the module's code at 'target', on up to link_threads threads.
+ * Threads only write in parallel where the heap has a writable mapping of the code.
+ */
+void link_all_builders(X86_64_Module *module, unsigned char *target) {
+    size_t count = module->builders.length;
+    unsigned char *write = code_heap_write_address(target);
+    int threads = write ? module->link_threads : 1;
+    if (threads > count) threads = count ? count : 1;
+    X86_64_Link_Job *jobs = malloc(threads * sizeof(X86_64_Link_Job));
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    size_t offset = 0, start = 0;
+    for (int t = 0; t < threads; t++) {
+        size_t end = count * (t + 1) / threads;
+        jobs[t] = (X86_64_Link_Job) { module, start, end, target + offset, write ? write + offset : NULL };
+        for (size_t i = start; i < end; i++) offset += module->builders.ptr[i]->code_size;
+        start = end;
+    }
+    for (int t = 1; t < threads; t++) pthread_create(&workers[t], NULL, link_builders, &jobs[t]);
+    link_builders(&jobs[0]);
+    for (int t = 1; t < threads; t++) pthread_join(workers[t], NULL);
+    for (int t = 0; t < threads; t++) release_buffer(&module->spare_buffer, &jobs[t].spare);
+    free(workers);
+    free(jobs);
+}
+
+void *x86_64_tier_thread(void *module_);
+
+/**
+ * Lay out the module: the functions built so far, then the resolver thunk and the lazy function stubs,
+ * then the veneers for imports, if needed.
+ * Lazy functions are placed anywhere within rel32 range of the module later, so with lazy functions,
+ * the module always gets veneers to be able to reach the imports.
+ */
+void x86_64_link_module(void *module_) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    assert(!module->code);
+    module->marker_values = arena_calloc(&module->arena, module->next_marker * sizeof(uint64_t));
+    module->veneers = arena_calloc(&module->arena, module->next_marker * sizeof(uint64_t));
+
+    X86_64_Reach imports = X86_64_REACH_ANYWHERE;
+    for (int i = 0; i < module->resolutions.length; i++) {
+        X86_64_Fixed_Resolution *resolution = &module->resolutions.ptr[i];
+        module->marker_values[resolution->marker.id] = resolution->value;
+        if (resolution->value < imports.lowest) imports.lowest = resolution->value;
+        if (resolution->value > imports.highest) imports.highest = resolution->value;
+    }
+
+    size_t code_length = 0;
+    for (int i = 0; i < module->builders.length; i++) {
+        X86_64_Function_Builder *builder = module->builders.ptr[i];
+        code_length += builder->code_size;
+    }
+    Buffer thunk = {0};
+    if (module->lazy_functions.length) append_x86_64_resolver_thunk(&thunk);
+    // stubs are aligned, for the sake of their slots
+    size_t stubs_offset = (code_length + thunk.offset + 7) & ~7;
+    size_t stubs_length = 0;
+    for (int i = 0; i < module->lazy_functions.length; i++) {
+        stubs_length += module->lazy_functions.ptr[i]->tiered ? X86_64_TIERED_STUB_SIZE : X86_64_STUB_SIZE;
+    }
+    size_t island_offset = stubs_offset + stubs_length;
+    size_t island_length = module->resolutions.length * X86_64_VENEER_SIZE;
+    // Allocate the target area, within rel32 range of the imports if possible.
+    bool with_island = module->lazy_functions.length > 0;
+    module->code_length = island_offset + (with_island ? island_length : 0);
+    unsigned char *target = code_heap_alloc(module->code_length, imports);
+    if (!target) {
+        with_island = true;
+        module->code_length = island_offset + island_length;
+        target = code_heap_alloc(module->code_length, X86_64_REACH_ANYWHERE);
+        assert(target);
+    }
+    module->code = target;
+
+    // Now that we know the target area, we can compute the addresses and resolve the offsets.
+    size_t target_offset = 0;
+    for (int i = 0; i < module->builders.length; i++) {
+        X86_64_Function_Builder *builder = module->builders.ptr[i];
+        module->marker_values[builder->declaration.id] = (int64_t)(target + target_offset);
+        target_offset += builder->code_size;
+    }
+    Buffer tail = thunk;
+    append_x86_64_nop(&tail, stubs_offset - code_length - thunk.offset);
+    for (int i = 0; i < module->lazy_functions.length; i++) {
+        X86_64_Lazy_Function *lazy = module->lazy_functions.ptr[i];
+        lazy->stub = target + code_length + tail.offset;
+        // It may have been built before link already, and tiered functions have to be.
+        lazy->code = (unsigned char*) module->marker_values[lazy->marker.id];
+        module->marker_values[lazy->marker.id] = (uint64_t) lazy->stub;
+        if (lazy->tiered) {
+            assert(lazy->code);
+            lazy->slot = lazy->stub + X86_64_TIERED_STUB_SLOT;
+            lazy->calls = -module->tier_threshold;
+            append_x86_64_tiered_stub(&tail, lazy, (uint64_t) lazy->stub, (uint64_t) (target + code_length));
+        } else {
+            lazy->slot = lazy->stub + X86_64_STUB_SLOT;
+            append_x86_64_lazy_stub(&tail, lazy, (uint64_t) lazy->stub, (uint64_t) (target + code_length));
+        }
+    }
+    for (int i = 0; with_island && i < module->resolutions.length; i++) {
+        X86_64_Fixed_Resolution *resolution = &module->resolutions.ptr[i];
+        module->veneers[resolution->marker.id] = (uint64_t) (target + code_length + tail.offset);
+        append_x86_64_veneer(&tail, resolution->value);
+    }
+    code_heap_write(target + code_length, tail.ptr, tail.offset);
+    free(tail.ptr);
+    link_all_builders(module, target);
+    // Without a writable mapping, swapping a stub would make code that other threads run unexecutable for a moment:
+    // tiered functions stay at tier 0 then.
+    bool tiered = false;
+    for (int i = 0; i < module->lazy_functions.length; i++) tiered |= module->lazy_functions.ptr[i]->tiered;
+    if (tiered && code_heap_write_address(target)) {
+        module->tier_thread_running = true;
+        pthread_create(&module->tier_thread, NULL, x86_64_tier_thread, module);
+    }
+}
+
+Marker x86_64_declare_function(void *module_) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    return (Marker) { __atomic_fetch_add(&module->next_marker, 1, __ATOMIC_RELAXED) };
+}
+
+X86_64_Lazy_Function *add_lazy_function(X86_64_Module *module, BuildFunction build, void *data, bool tiered) {
+    assert(!module->code);
+    pthread_mutex_lock(&module->lock);
+    X86_64_Lazy_Function *lazy = arena_alloc(&module->arena, sizeof(X86_64_Lazy_Function));
+    *lazy = (X86_64_Lazy_Function) {
+        .module = module,
+        .marker = x86_64_declare_function(module),
+        .build = build,
+        .data = data,
+        .tiered = tiered,
+    };
+    X86_64_Lazy_Functions *lazy_functions = &module->lazy_functions;
+    lazy_functions->ptr = grow_list(&module->arena, lazy_functions->ptr, lazy_functions->length, lazy_functions->length + 1, sizeof(X86_64_Lazy_Function*));
+    lazy_functions->ptr[lazy_functions->length++] = lazy;
+    pthread_mutex_unlock(&module->lock);
+    return lazy;
+}
+
+Marker x86_64_declare_lazy_function(void *module_, BuildFunction build, void *data) {
+    return add_lazy_function((X86_64_Module*) module_, build, data, false)->marker;
+}
+
+Marker x86_64_declare_tiered_function(void *module_, BuildFunction build, void *data) {
+    return add_lazy_function((X86_64_Module*) module_, build, data, true)->marker;
+}
+
+/**
+ * Link the newest builder of 'marker', built after the module was linked, anywhere within reach of the module.
+ * Returns its code.
+ */
+unsigned char *link_late_function(X86_64_Module *module, Marker marker) {
+    // Other threads may be adding builders too: look for the one with the marker.
+    pthread_mutex_lock(&module->lock);
+    X86_64_Function_Builder *builder = NULL;
+    for (size_t i = module->builders.length; !builder && i-- > 0;) {
+        if (module->builders.ptr[i]->declaration.id == marker.id) builder = module->builders.ptr[i];
+    }
+    pthread_mutex_unlock(&module->lock);
+    assert(builder && builder->code_size > 0 && !builder->code);
+    X86_64_Reach reach = { (uint64_t) module->code, (uint64_t) (module->code + module->code_length) };
+    builder->code = code_heap_alloc(builder->code_size, reach);
+    assert(builder->code);
+    Buffer spare = {0};
+    link_builder(module, builder, builder->code, NULL, &spare);
+    pthread_mutex_lock(&module->lock);
+    release_buffer(&module->spare_buffer, &spare);
+    pthread_mutex_unlock(&module->lock);
+    return builder->code;
+}
+
+// Point a stub at 'code'. Threads that jump through the slot at the same time see the old or the new address.
+void write_stub_slot(unsigned char *slot, unsigned char *code) {
+    unsigned char *write = code_heap_write_address(slot);
+    if (write) __atomic_store_n((uint64_t*) write, (uint64_t) code, __ATOMIC_RELEASE);
+    else code_heap_write(slot, &code, sizeof(uint64_t));
+}
+
+/**
+ * Called by the resolver thunk on the first call of a lazy function.
+ * Build it, place it within reach of the module, and point the stub at it.
+ * For a tiered function, the stub counted to its threshold: queue it for the tier thread, and keep calling tier 0.
+ */
+void *x86_64_resolve_lazy_function(X86_64_Lazy_Function *lazy) {
+    X86_64_Module *module = (X86_64_Module*) lazy->module;
+    // Threads that call it at once wait for the first one to build it.
+    pthread_mutex_lock(&module->lazy_lock);
+    if (lazy->tiered) {
+        if (module->tier_thread_running) {
+            if (module->hot_last) module->hot_last->next_hot = lazy;
+            else module->hot_first = lazy;
+            module->hot_last = lazy;
+            pthread_cond_signal(&module->hot_cond);
+        }
+    } else if (!lazy->code) {
+        lazy->build(module, lazy->marker, lazy->data);
+        lazy->code = link_late_function(module, lazy->marker);
+        write_stub_slot(lazy->slot, lazy->code);
+    }
+    unsigned char *code = lazy->code;
+    pthread_mutex_unlock(&module->lazy_lock);
+    return code;
+}
+
+/**
+ * The tier thread: rebuild the hot tiered functions one by one, and swap their stubs over to the new code.
+ * Threads that call them meanwhile go on with tier 0, and so do calls that already passed the stub.
+ */
+void *x86_64_tier_thread(void *module_) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    pthread_mutex_lock(&module->lazy_lock);
+    for (;;) {
+        while (!module->hot_first && !module->stopping) pthread_cond_wait(&module->hot_cond, &module->lazy_lock);
+        if (module->stopping) break;
+        X86_64_Lazy_Function *lazy = module->hot_first;
+        module->hot_first = lazy->next_hot;
+        if (!module->hot_first) module->hot_last = NULL;
+        pthread_mutex_unlock(&module->lazy_lock);
+        lazy->build(module, lazy->marker, lazy->data);
+        unsigned char *code = link_late_function(module, lazy->marker);
+        write_stub_slot(lazy->slot, code);
+        pthread_mutex_lock(&module->lazy_lock);
+        lazy->code = code;
+    }
+    pthread_mutex_unlock(&module->lazy_lock);
+    return NULL;
+}
+
+void (*x86_64_get_function(void *module_, Marker marker))() {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    assert(module->code && marker.id < module->next_marker);
+    union pedantic_convert convert;
+    convert.ptr = (void*) module->marker_values[marker.id];
+    return convert.funcptr;
+}
+
+/**
+ * Free the module's code, and everything that's left of its function builders.
+ * Function pointers into the module are invalid afterwards.
+ */
+void x86_64_free_module(void *module_) {
+    X86_64_Module *module = (X86_64_Module*) module_;
+    if (module->tier_thread_running) {
+        // It finishes the function it's building, and drops the rest of the queue.
+        pthread_mutex_lock(&module->lazy_lock);
+        module->stopping = true;
+        pthread_cond_signal(&module->hot_cond);
+        pthread_mutex_unlock(&module->lazy_lock);
+        pthread_join(module->tier_thread, NULL);
+    }
+    if (module->code) code_heap_free(module->code, module->code_length);
+    for (int i = 0; i < module->builders.length; i++) {
+        X86_64_Function_Builder *builder = module->builders.ptr[i];
+        if (builder->code) code_heap_free(builder->code, builder->code_size);
+        free(builder->buffer.ptr);
+        // unless it was finalized
+        arena_free(&builder->arena);
+    }
+    free(module->spare_buffer.ptr);
+    arena_free(&module->spare_arena);
+    arena_free(&module->arena);
+    pthread_mutex_destroy(&module->lock);
+    pthread_mutex_destroy(&module->lazy_lock);
+    pthread_cond_destroy(&module->hot_cond);
+    free(module);
+}
+
+// Block states live in the builder's arena; the copy has room to grow like any list.
+void copy_block(X86_64_Arena *arena, X86_64_Block_Stats *dest, X86_64_Block_Stats *src) {
+    dest->registers.length = src->registers.length;
+    dest->registers.ptr = grow_list(arena, NULL, 0, src->registers.length, sizeof(RegRow));
+    memcpy(dest->registers.ptr, src->registers.ptr, dest->registers.length * sizeof(RegRow));
+    dest->stackframe.length = src->stackframe.length;
+    dest->stackframe.ptr = grow_list(arena, NULL, 0, src->stackframe.length, sizeof(Reg));
+    memcpy(dest->stackframe.ptr, src->stackframe.ptr, dest->stackframe.length * sizeof(Reg));
+    dest->hw_reg_map = src->hw_reg_map;
+}
+
+/**
+ * The state that's required at a label: like 'block', but values only have one location.
+ * Otherwise, every edge would have to establish the stack copies too.
+ */
+X86_64_Block_Stats *label_state(X86_64_Arena *arena, X86_64_Block_Stats *block) {
+    X86_64_Block_Stats *state = arena_alloc(arena, sizeof(X86_64_Block_Stats));
+    copy_block(arena, state, block);
+    for (int i = 0; i < state->registers.length; i++) {
+        RegRow *row = &state->registers.ptr[i];
+        if (row->location == LOC_CPU) free_stack_copy(state, row);
+    }
+    return state;
+}
+
+void* x86_64_begin_bb(void *fun, void *pred_bb) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    assert(builder->block == NULL);
+    builder->block = arena_alloc(&builder->arena, sizeof(X86_64_Block_Stats));
+    if (pred_bb) {
+        copy_block(&builder->arena, builder->block, (X86_64_Block_Stats*) pred_bb);
+    } else {
+        *builder->block = (X86_64_Block_Stats) {0};
+        for (int i = 0; i < 16; i++) {
+            builder->block->hw_reg_map.gp_regs[i] = INVALID_REG;
+            builder->block->hw_reg_map.xmm_regs[i] = INVALID_REG;
+        }
+    }
+    // We're falling through from a conditional branch, but not from the block we claim to continue.
+    X86_64_Block_Stats *fallthrough = builder->fallthrough_block;
+    if (fallthrough && fallthrough != pred_bb) {
+        emit_state_transfer(builder, fallthrough, builder->block, true);
+    }
+    builder->fallthrough_block = NULL;
+    return builder->block;
 }
 
 Marker x86_64_label_marker(void *fun) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
     Labels *labels = &builder->labels;
-    labels->ptr = realloc(labels->ptr, ++labels->length * sizeof(size_t));
+    labels->ptr = grow_list(&builder->arena, labels->ptr, labels->length, labels->length + 1, sizeof(Label));
     // unset label
-    labels->ptr[labels->length - 1] = -1;
+    labels->ptr[labels->length++] = (Label) { .offset = -1 };
     return (Marker) { labels->length - 1 };
 }
 
 void *x86_64_new_function(void *module_, Marker marker, Types args, CallingConvention *cc, void **entry_bb) {
     X86_64_Module *module = (X86_64_Module*) module_;
-    X86_64_Function_Builder *builder = malloc(sizeof(X86_64_Function_Builder));
     assert(cc->type == CALLING_CONVENTION_X86_64_SYSV);
     X86_64_SysV *sysv_cc = (X86_64_SysV*) cc;
     assert(sysv_cc->arguments.length == args.length);
+    pthread_mutex_lock(&module->lock);
+    X86_64_Function_Builder *builder = arena_alloc(&module->arena, sizeof(X86_64_Function_Builder));
     *builder = (X86_64_Function_Builder) { 0 };
+    builder->module = module;
+    builder->cpu_features = module->cpu_features;
+    builder->peephole = module->peephole;
+    // Reuse a linked function's buffer, and make room for an average function up front.
+    builder->buffer = module->spare_buffer;
+    builder->buffer.offset = 0;
+    module->spare_buffer = (Buffer) {0};
+    builder->arena = module->spare_arena;
+    module->spare_arena = (X86_64_Arena) {0};
+    size_t estimate = module->functions_emitted ? module->code_emitted / module->functions_emitted : 0;
+    X86_64_Function_Builders *builders = &module->builders;
+    builders->ptr = grow_list(&module->arena, builders->ptr, builders->length, builders->length + 1, sizeof(X86_64_Function_Builder*));
+    builders->ptr[builders->length++] = builder;
+    pthread_mutex_unlock(&module->lock);
+    reserve(&builder->buffer, estimate < 256 ? 256 : estimate);
     *entry_bb = x86_64_begin_bb(builder, NULL);
-    for (int i = 0; i < 16; i++) {
-        builder->block->hw_reg_map.gp_regs[i] = INVALID_REG;
-    }
+    builder->reachable = true;
     builder->args = (Args) {
         .length = args.length,
-        .ptr = malloc(args.length * sizeof(Arg)),
+        .ptr = arena_alloc(&builder->arena, args.length * sizeof(Arg)),
     };
     int arg_regs[6] = { X86_64_RDI, X86_64_RSI, X86_64_RDX, X86_64_RCX, X86_64_R8, X86_64_R9 };
+    int num_int_args = 0, num_sse_args = 0;
     // reserve a reg for every arg
     for (int i = 0; i < args.length; i++) {
         Type arg_type = args.ptr[i];
-        assert(arg_type.size == 8);
-        assert(sysv_cc->arguments.ptr[i] == X86_64_CLASS_INTEGER);
+        assert(arg_type.size == 1 || arg_type.size == 2 || arg_type.size == 4 || arg_type.size == 8 || arg_type.size == 16);
         Reg reg = alloc_next_reg(builder, arg_type);
         builder->args.ptr[i] = (Arg) {
             .type = arg_type,
             .reg = reg,
         };
-        set_reg_in_hwreg(builder, reg, arg_regs[i]);
+        if (sysv_cc->arguments.ptr[i] == X86_64_CLASS_SSE) {
+            assert(is_xmm_type(arg_type) && num_sse_args < 8);
+            set_reg_in_hwreg(builder, reg, num_sse_args++);
+        } else {
+            assert(sysv_cc->arguments.ptr[i] == X86_64_CLASS_INTEGER && !is_xmm_type(arg_type) && num_int_args < 6);
+            set_reg_in_hwreg(builder, reg, arg_regs[num_int_args++]);
+        }
+    }
+    builder->declaration = marker;
+    // header
+    append_x86_64_push_reg(&builder->buffer, X86_64_RBP);
+    append_x86_64_set_reg_reg(&builder->buffer, X86_64_RBP, X86_64_RSP);
+    builder->frame_sub_offset = builder->buffer.offset;
+    append_x86_64_sub_reg_imm(&builder->buffer, true, X86_64_RSP, 0);
+    builder->callee_save_offset = builder->buffer.offset;
+    append_x86_64_callee_saves(&builder->buffer, 0, false);
+    return builder;
+}
+
+// The value of the low size bytes of 'value', sign or zero extended.
+int64_t extend_literal(int64_t value, int size, bool sign_extend) {
+    if (size == 8) return value;
+    int shift = 64 - 8 * size;
+    return sign_extend ? (int64_t) ((uint64_t) value << shift) >> shift : (int64_t) (((uint64_t) value << shift) >> shift);
+}
+
+Reg emit_literal(X86_64_Function_Builder *builder, Type value_type, int64_t value) {
+    Reg reg = alloc_next_reg(builder, value_type);
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    row->location = LOC_LITERAL;
+    // Narrow literals are kept sign-extended, so they always fit an imm32.
+    row->value = extend_literal(value, value_type.size, true);
+    return reg;
+}
+
+Reg x86_64_immediate_int32(void *fun, int32_t value, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    Reg reg = emit_literal(builder, type(4), value);
+    release_regs(builder, discards);
+    return reg;
+}
+
+Reg x86_64_immediate_int64(void *fun, int64_t value, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    Reg reg = emit_literal(builder, type(8), value);
+    release_regs(builder, discards);
+    return reg;
+}
+
+Reg x86_64_immediate_function(void *fun, Marker marker, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    Reg reg = alloc_next_reg(builder, type(8));
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    row->location = LOC_RELOC;
+    row->marker = marker;
+    release_regs(builder, discards);
+    return reg;
+}
+
+bool fits_imm32(RegRow *row) {
+    return row->location == LOC_LITERAL && row->value >= INT32_MIN && row->value <= INT32_MAX;
+}
+
+// The type of both operands, which must match unless one of them is a literal.
+Type operand_type(X86_64_Function_Builder *builder, Reg left, Reg right) {
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    RegRow *right_row = &builder->block->registers.ptr[right.id];
+    if (left_row->location == LOC_LITERAL) return right_row->type;
+    assert(right_row->location == LOC_LITERAL || right_row->type.size == left_row->type.size);
+    return left_row->type;
+}
+
+/**
+ * Ops on integer literals are folded at build time. 'a' and 'b' get the values of the operands,
+ * sign-extended from their size; the result is a literal of the operands' type.
+ */
+bool literal_operands(X86_64_Function_Builder *builder, Reg left, Reg right, int64_t *a, int64_t *b) {
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    RegRow *right_row = &builder->block->registers.ptr[right.id];
+    if (left_row->location != LOC_LITERAL || right_row->location != LOC_LITERAL) return false;
+    if (operand_type(builder, left, right).kind != TYPE_INTEGER) return false;
+    *a = left_row->value;
+    *b = right_row->value;
+    return true;
+}
+
+bool literal_operand(X86_64_Function_Builder *builder, Reg operand, int64_t *a) {
+    return literal_operands(builder, operand, operand, a, a);
+}
+
+Reg emit_folded(X86_64_Function_Builder *builder, Reg left, Reg right, uint64_t value, RegList discards) {
+    Reg reg = emit_literal(builder, operand_type(builder, left, right), value);
+    release_regs(builder, discards);
+    return reg;
+}
+
+// Whether 'a <comparison> b' holds for integers of the given size.
+bool fold_comparison(Comparison comparison, int size, int64_t a, int64_t b) {
+    bool is_signed = comparison >= COMPARE_LT && comparison <= COMPARE_GE;
+    int64_t x = extend_literal(a, size, is_signed), y = extend_literal(b, size, is_signed);
+    switch (comparison) {
+        case COMPARE_EQ: return x == y;
+        case COMPARE_NE: return x != y;
+        case COMPARE_LT: return x < y;
+        case COMPARE_LE: return x <= y;
+        case COMPARE_GT: return x > y;
+        case COMPARE_GE: return x >= y;
+        case COMPARE_ULT: return (uint64_t) x < (uint64_t) y;
+        case COMPARE_ULE: return (uint64_t) x <= (uint64_t) y;
+        case COMPARE_UGT: return (uint64_t) x > (uint64_t) y;
+        default: return (uint64_t) x >= (uint64_t) y;
+    }
+}
+
+// Define the upper bits of a 1 or 2-byte value in a hwreg, up to bit 31.
+void emit_extend_in_place(X86_64_Function_Builder *builder, int hwreg, int size, bool sign_extend) {
+    if (size < 4) append_x86_64_extend_reg(&builder->buffer, 4, size, sign_extend, hwreg, hwreg);
+}
+
+typedef struct {
+    void (*reg_reg)(Buffer *buffer, bool w, int to_reg, int from_reg);
+    void (*reg_imm)(Buffer *buffer, bool w, int reg, int32_t imm);
+    bool commutative;
+    // Optional three-operand forms, which don't need a copy of the left operand first.
+    void (*three_reg)(Buffer *buffer, bool w, int to_reg, int left_reg, int right_reg);
+    void (*three_imm)(Buffer *buffer, bool w, int to_reg, int left_reg, int32_t imm);
+} X86_64_ArithOp;
+
+/**
+ * Emit a two-address op, 'left = left op right', into a new reg.
+ * The new reg takes over the hwreg of a discarded operand if possible,
+ * otherwise left is copied into a new hwreg first, or the op's three-operand form is used.
+ * Values under 8 bytes use the 32-bit form: the low bits of the result don't depend on the upper bits.
+ */
+Reg emit_arith(X86_64_Function_Builder *builder, X86_64_ArithOp op, Reg left, Reg right, RegList discards) {
+    use_reg(builder, left);
+    use_reg(builder, right);
+    Type result_type = operand_type(builder, left, right);
+    assert(!is_xmm_type(result_type));
+    bool w = result_type.size == 8;
+    Reg reg = alloc_next_reg(builder, result_type);
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    RegRow *right_row = &builder->block->registers.ptr[right.id];
+    int hwret;
+    // the operand that's not in hwret: a hwreg, or an imm32 if hwother is -1.
+    int hwother = -1;
+    int32_t other_imm = 0;
+    if (fits_imm32(right_row)) {
+        other_imm = right_row->value;
+    } else {
+        hwother = move_reg_to_hw(builder, right);
+    }
+    if (left_row->location == LOC_CPU && reglist_contains(discards, left)) {
+        hwret = left_row->hw_reg;
+        release_reg(builder, left);
+        set_reg_in_hwreg(builder, reg, hwret);
+    } else if (op.commutative && hwother != -1 && left.id != right.id && reglist_contains(discards, right)) {
+        hwret = hwother;
+        release_reg(builder, right);
+        set_reg_in_hwreg(builder, reg, hwret);
+        if (fits_imm32(left_row)) {
+            hwother = -1;
+            other_imm = left_row->value;
+        } else {
+            hwother = move_reg_to_hw(builder, left);
+        }
+    } else {
+        hwret = alloc_hwreg(builder, reg);
+        set_reg_in_hwreg(builder, reg, hwret);
+        bool three_operand = left_row->location == LOC_CPU && (hwother == -1 ? op.three_imm : op.three_reg);
+        if (three_operand && hwother == -1) {
+            op.three_imm(&builder->buffer, w, hwret, left_row->hw_reg, other_imm);
+        } else if (three_operand) {
+            op.three_reg(&builder->buffer, w, hwret, left_row->hw_reg, hwother);
+        }
+        if (three_operand) {
+            release_regs(builder, discards);
+            return reg;
+        }
+        copy_reg_to_hw(builder, hwret, left);
+    }
+    if (hwother == -1) {
+        op.reg_imm(&builder->buffer, w, hwret, other_imm);
+    } else {
+        op.reg_reg(&builder->buffer, w, hwret, hwother);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Get a hwreg for the result of an op that overwrites its operand:
+ * the operand's hwreg if it's discarded, or else a new one with a copy of it.
+ * 'avoid' is a hwreg that the result can't use, or -1.
+ */
+int alloc_result_from_operand(X86_64_Function_Builder *builder, Reg reg, Reg operand, RegList discards, int avoid) {
+    RegRow *row = &builder->block->registers.ptr[operand.id];
+    int hwret;
+    if (row->location == LOC_CPU && row->hw_reg != avoid && reglist_contains(discards, operand)) {
+        hwret = row->hw_reg;
+        release_reg(builder, operand);
+    } else {
+        hwret = alloc_hwreg(builder, reg);
+        copy_reg_to_hw(builder, hwret, operand);
+    }
+    set_reg_in_hwreg(builder, reg, hwret);
+    return hwret;
+}
+
+/**
+ * Get a hwreg for the result of a three-operand op, which doesn't overwrite its operands:
+ * the hwreg of a discarded operand, or else a new one. The operands must be in hwregs by now.
+ */
+int alloc_result_from_operands(X86_64_Function_Builder *builder, Reg reg, Reg left, Reg right, RegList discards) {
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    RegRow *right_row = &builder->block->registers.ptr[right.id];
+    int hwret;
+    if (left_row->location == LOC_CPU && reglist_contains(discards, left)) {
+        hwret = left_row->hw_reg;
+        release_reg(builder, left);
+    } else if (right_row->location == LOC_CPU && reglist_contains(discards, right)) {
+        hwret = right_row->hw_reg;
+        release_reg(builder, right);
+    } else {
+        hwret = alloc_hwreg(builder, reg);
+    }
+    set_reg_in_hwreg(builder, reg, hwret);
+    return hwret;
+}
+
+// A new reg with the value of 'operand', which takes over its hwreg if it's discarded.
+Reg emit_copy(X86_64_Function_Builder *builder, Type result_type, Reg operand, RegList discards) {
+    RegRow *row = &builder->block->registers.ptr[operand.id];
+    if (row->location == LOC_LITERAL) {
+        Reg reg = emit_literal(builder, result_type, row->value);
+        release_regs(builder, discards);
+        return reg;
+    }
+    use_reg(builder, operand);
+    Reg reg = alloc_next_reg(builder, result_type);
+    alloc_result_from_operand(builder, reg, operand, discards, -1);
+    release_regs(builder, discards);
+    return reg;
+}
+
+// 'reg = op reg' into a new reg.
+Reg emit_unary(X86_64_Function_Builder *builder, int f7_modifier, Reg operand, RegList discards) {
+    use_reg(builder, operand);
+    Type result_type = builder->block->registers.ptr[operand.id].type;
+    Reg reg = alloc_next_reg(builder, result_type);
+    int hwret = alloc_result_from_operand(builder, reg, operand, discards, -1);
+    append_x86_64_op_f7_reg(&builder->buffer, result_type.size == 8, f7_modifier, hwret);
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Free up a specific hwreg for an instruction that needs its operand or result there.
+ * Its reg moves to another hwreg, spilling if needed, and the hwreg is a scratch register until the next op.
+ */
+void reserve_hwreg(X86_64_Function_Builder *builder, int hwreg) {
+    builder->scratch_regs |= 1 << hwreg;
+    Reg reg = builder->block->hw_reg_map.gp_regs[hwreg];
+    if (!IS_VALID_REG(reg)) return;
+    move_reg_to_hwreg(builder, reg, alloc_hwreg(builder, reg));
+}
+
+/**
+ * div and idiv divide rdx:rax, and leave the quotient in rax and the remainder in rdx.
+ * 1 and 2-byte values are extended and divided as 32-bit values.
+ */
+Reg emit_divide(X86_64_Function_Builder *builder, Reg left, Reg right, RegList discards, bool is_signed, bool remainder) {
+    Type result_type = operand_type(builder, left, right);
+    int64_t a, b;
+    // Division by 0, and signed division by -1, which can overflow, are left to the CPU.
+    if (literal_operands(builder, left, right, &a, &b)) {
+        int64_t x = extend_literal(a, result_type.size, is_signed), y = extend_literal(b, result_type.size, is_signed);
+        if (is_signed && y != 0 && y != -1) {
+            return emit_folded(builder, left, right, remainder ? x % y : x / y, discards);
+        } else if (!is_signed && y != 0) {
+            uint64_t value = remainder ? (uint64_t) x % (uint64_t) y : (uint64_t) x / (uint64_t) y;
+            return emit_folded(builder, left, right, value, discards);
+        }
+    }
+    use_reg(builder, left);
+    use_reg(builder, right);
+    bool w = result_type.size == 8;
+    // Dead regs don't need to be saved from rax and rdx.
+    for (int i = 0; i < discards.length; i++) {
+        if (discards.ptr[i].id != left.id && discards.ptr[i].id != right.id) release_reg(builder, discards.ptr[i]);
+    }
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    // A dead dividend can just stay in rax.
+    bool left_in_rax = left_row->location == LOC_CPU && left_row->hw_reg == X86_64_RAX
+        && left.id != right.id && reglist_contains(discards, left);
+    if (left_in_rax) {
+        release_reg(builder, left);
+        builder->scratch_regs |= 1 << X86_64_RAX;
+    } else {
+        reserve_hwreg(builder, X86_64_RAX);
+    }
+    reserve_hwreg(builder, X86_64_RDX);
+    // A literal divisor needs a hwreg too; move_reg_to_hw won't pick rax or rdx now.
+    int hwdivisor = move_reg_to_hw(builder, right);
+    if (!left_in_rax) copy_reg_to_hw(builder, X86_64_RAX, left);
+    // Extending a value in place leaves its low bytes, and so the value, as they are.
+    emit_extend_in_place(builder, X86_64_RAX, result_type.size, is_signed);
+    emit_extend_in_place(builder, hwdivisor, result_type.size, is_signed);
+    if (is_signed) {
+        append_x86_64_cqo(&builder->buffer, w);
+    } else {
+        append_x86_64_xor_reg_reg(&builder->buffer, false, X86_64_RDX, X86_64_RDX);
+    }
+    append_x86_64_op_f7_reg(&builder->buffer, w, is_signed ? 7 : 6, hwdivisor);
+    release_regs(builder, discards);
+    Reg reg = alloc_next_reg(builder, result_type);
+    set_reg_in_hwreg(builder, reg, remainder ? X86_64_RDX : X86_64_RAX);
+    return reg;
+}
+
+// shlx, shrx or sarx, which take the count in any hwreg, and don't overwrite their operand.
+Reg emit_shift_x(X86_64_Function_Builder *builder, int modifier, Reg left, Reg right, RegList discards) {
+    Type result_type = builder->block->registers.ptr[left.id].type;
+    bool w = result_type.size == 8;
+    Reg reg = alloc_next_reg(builder, result_type);
+    int hwcount = move_reg_to_hw(builder, right);
+    int hwleft, hwret;
+    if (modifier != 4 && result_type.size < 4) {
+        // Extending a copy in place leaves the count as it is, even if it's the same reg.
+        hwret = alloc_result_from_operand(builder, reg, left, discards, -1);
+        emit_extend_in_place(builder, hwret, result_type.size, modifier == 7);
+        hwleft = hwret;
+    } else {
+        hwleft = move_reg_to_hw(builder, left);
+        hwret = alloc_result_from_operands(builder, reg, left, right, discards);
+    }
+    append_x86_64_shift_x_reg_reg(&builder->buffer, w, modifier, hwret, hwleft, hwcount);
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Shift counts are an imm8, or in cl, unless BMI2 has shifts that take them in any hwreg.
+ * The count can have any type. Right shifts of 1 and 2-byte values extend them to 32 bits first.
+ */
+Reg emit_shift(X86_64_Function_Builder *builder, int modifier, Reg left, Reg right, RegList discards) {
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    RegRow *right_row = &builder->block->registers.ptr[right.id];
+    Type result_type = left_row->type;
+    if (left_row->location == LOC_LITERAL && right_row->location == LOC_LITERAL) {
+        int count = right_row->value & (result_type.size == 8 ? 63 : 31);
+        int64_t value = extend_literal(left_row->value, result_type.size, modifier == 7);
+        if (modifier == 4) value = (uint64_t) value << count;
+        else if (modifier == 5) value = (uint64_t) value >> count;
+        else value >>= count;
+        return emit_folded(builder, left, left, value, discards);
+    }
+    use_reg(builder, left);
+    use_reg(builder, right);
+    bool w = result_type.size == 8;
+    bool imm = fits_imm32(right_row);
+    if (!imm && (builder->cpu_features & CPU_BMI2)) return emit_shift_x(builder, modifier, left, right, discards);
+    int32_t count = imm ? right_row->value : 0;
+    if (!imm && right_row->location == LOC_CPU && right_row->hw_reg == X86_64_RCX) {
+        builder->scratch_regs |= 1 << X86_64_RCX;
+    } else if (!imm) {
+        reserve_hwreg(builder, X86_64_RCX);
+        copy_reg_to_hw(builder, X86_64_RCX, right);
+    }
+    Reg reg = alloc_next_reg(builder, result_type);
+    int hwret = alloc_result_from_operand(builder, reg, left, discards, imm ? -1 : X86_64_RCX);
+    // shl doesn't look at the upper bits; shr and sar shift them in.
+    if (modifier != 4) emit_extend_in_place(builder, hwret, result_type.size, modifier == 7);
+    if (imm) {
+        append_x86_64_shift_reg_imm(&builder->buffer, w, modifier, hwret, count);
+    } else {
+        append_x86_64_shift_reg_cl(&builder->buffer, w, modifier, hwret);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Zero or sign extend a reg to a type at least as large, or truncate it to a type at most as large.
+ * Truncation just copies: the upper bytes of the copy are undefined.
+ */
+Reg emit_resize(X86_64_Function_Builder *builder, Reg operand, Type to, bool sign_extend, bool truncate, RegList discards) {
+    RegRow *row = &builder->block->registers.ptr[operand.id];
+    Type from = row->type;
+    assert(truncate ? to.size <= from.size : to.size >= from.size);
+    if (row->location == LOC_LITERAL) {
+        Reg reg = emit_literal(builder, to, truncate ? row->value : extend_literal(row->value, from.size, sign_extend));
+        release_regs(builder, discards);
+        return reg;
+    }
+    use_reg(builder, operand);
+    int hwfrom = move_reg_to_hw(builder, operand);
+    Reg reg = alloc_next_reg(builder, to);
+    if (truncate || from.size == to.size) {
+        alloc_result_from_operand(builder, reg, operand, discards, -1);
+    } else {
+        // movzx and movsx can take the value from another hwreg, so there's no copy.
+        int hwret;
+        if (reglist_contains(discards, operand)) {
+            hwret = hwfrom;
+            release_reg(builder, operand);
+        } else {
+            hwret = alloc_hwreg(builder, reg);
+        }
+        set_reg_in_hwreg(builder, reg, hwret);
+        append_x86_64_extend_reg(&builder->buffer, to.size, from.size, sign_extend, hwret, hwfrom);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+Reg x86_64_zero_extend(void *fun, Reg reg, Type to, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_resize(builder, reg, to, false, false, discards);
+}
+
+Reg x86_64_sign_extend(void *fun, Reg reg, Type to, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_resize(builder, reg, to, true, false, discards);
+}
+
+Reg x86_64_truncate(void *fun, Reg reg, Type to, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_resize(builder, reg, to, false, true, discards);
+}
+
+Reg x86_64_add(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, (uint64_t) a + b, discards);
+    X86_64_ArithOp op = {
+        append_x86_64_add_reg_reg, append_x86_64_add_reg_imm, true,
+        append_x86_64_lea_reg_reg, append_x86_64_lea_reg_offset,
+    };
+    return emit_arith(builder, op, left, right, discards);
+}
+
+Reg x86_64_sub(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, (uint64_t) a - b, discards);
+    X86_64_ArithOp op = { append_x86_64_sub_reg_reg, append_x86_64_sub_reg_imm, false };
+    return emit_arith(builder, op, left, right, discards);
+}
+
+Reg x86_64_mul(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, (uint64_t) a * b, discards);
+    X86_64_ArithOp op = {
+        append_x86_64_imul_reg_reg, append_x86_64_imul_reg_imm, true,
+        NULL, append_x86_64_imul_reg_reg_imm,
+    };
+    return emit_arith(builder, op, left, right, discards);
+}
+
+Reg x86_64_div(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_divide(builder, left, right, discards, true, false);
+}
+
+Reg x86_64_rem(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_divide(builder, left, right, discards, true, true);
+}
+
+Reg x86_64_udiv(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_divide(builder, left, right, discards, false, false);
+}
+
+Reg x86_64_urem(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_divide(builder, left, right, discards, false, true);
+}
+
+Reg x86_64_bit_and(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, a & b, discards);
+    X86_64_ArithOp op = { append_x86_64_and_reg_reg, append_x86_64_and_reg_imm, true };
+    return emit_arith(builder, op, left, right, discards);
+}
+
+Reg x86_64_bit_or(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, a | b, discards);
+    X86_64_ArithOp op = { append_x86_64_or_reg_reg, append_x86_64_or_reg_imm, true };
+    return emit_arith(builder, op, left, right, discards);
+}
+
+Reg x86_64_bit_xor(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, a ^ b, discards);
+    X86_64_ArithOp op = { append_x86_64_xor_reg_reg, append_x86_64_xor_reg_imm, true };
+    return emit_arith(builder, op, left, right, discards);
+}
+
+Reg x86_64_shl(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_shift(builder, 4, left, right, discards);
+}
+
+Reg x86_64_shr(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_shift(builder, 5, left, right, discards);
+}
+
+Reg x86_64_sar(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_shift(builder, 7, left, right, discards);
+}
+
+Reg x86_64_neg(void *fun, Reg reg, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a;
+    if (literal_operand(builder, reg, &a)) return emit_folded(builder, reg, reg, -(uint64_t) a, discards);
+    return emit_unary(builder, 3, reg, discards);
+}
+
+Reg x86_64_bit_not(void *fun, Reg reg, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a;
+    if (literal_operand(builder, reg, &a)) return emit_folded(builder, reg, reg, ~a, discards);
+    return emit_unary(builder, 2, reg, discards);
+}
+
+// left & ~right: andn with BMI1, or else 'not' a copy of right, and 'and' left into it.
+Reg x86_64_and_not(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, left, right, &a, &b)) return emit_folded(builder, left, right, a & ~b, discards);
+    use_reg(builder, left);
+    use_reg(builder, right);
+    Type result_type = operand_type(builder, left, right);
+    bool w = result_type.size == 8;
+    Reg reg = alloc_next_reg(builder, result_type);
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    if (builder->cpu_features & CPU_BMI1) {
+        int hwleft = move_reg_to_hw(builder, left);
+        int hwright = move_reg_to_hw(builder, right);
+        int hwret = alloc_result_from_operands(builder, reg, left, right, discards);
+        append_x86_64_andn_reg_reg(&builder->buffer, w, hwret, hwright, hwleft);
+        release_regs(builder, discards);
+        return reg;
+    }
+    int hwleft = fits_imm32(left_row) ? -1 : move_reg_to_hw(builder, left);
+    // left has to survive the 'not', even if it's the same reg as right.
+    int hwret = alloc_result_from_operand(builder, reg, right, discards, hwleft);
+    append_x86_64_op_f7_reg(&builder->buffer, w, 2, hwret);
+    if (hwleft == -1) {
+        append_x86_64_and_reg_imm(&builder->buffer, w, hwret, left_row->value);
+    } else {
+        append_x86_64_and_reg_reg(&builder->buffer, w, hwret, hwleft);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Bit counts go in a copy of their operand, or in its hwreg if it's discarded.
+ * Values under 4 bytes are counted as 32-bit values, zero extended.
+ */
+Reg emit_bit_count_operand(X86_64_Function_Builder *builder, Reg operand, RegList discards, int *hwret) {
+    use_reg(builder, operand);
+    Type result_type = builder->block->registers.ptr[operand.id].type;
+    assert(result_type.kind == TYPE_INTEGER);
+    Reg reg = alloc_next_reg(builder, result_type);
+    *hwret = alloc_result_from_operand(builder, reg, operand, discards, -1);
+    emit_extend_in_place(builder, *hwret, result_type.size, false);
+    return reg;
+}
+
+// lzcnt, or bsr, which leaves its result undefined for 0, and gives the index of the highest set bit.
+Reg x86_64_count_leading_zeros(void *fun, Reg operand, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a;
+    if (literal_operand(builder, operand, &a)) {
+        int bits = 8 * builder->block->registers.ptr[operand.id].type.size;
+        uint64_t x = extend_literal(a, bits / 8, false);
+        return emit_folded(builder, operand, operand, x ? __builtin_clzll(x) - (64 - bits) : bits, discards);
+    }
+    int size = builder->block->registers.ptr[operand.id].type.size, hwret;
+    bool w = size == 8;
+    Reg reg = emit_bit_count_operand(builder, operand, discards, &hwret);
+    if (builder->cpu_features & CPU_LZCNT) {
+        append_x86_64_bit_count_reg_reg(&builder->buffer, 0xF3, w, 0xBD, hwret, hwret);
+        if (size < 4) append_x86_64_sub_reg_imm(&builder->buffer, false, hwret, 32 - 8 * size);
+    } else {
+        // bits - 1 - index, with an index of -1 for 0.
+        int hwtemp = alloc_scratch_hwreg(builder, false);
+        append_x86_64_set_reg_imm(&builder->buffer, hwtemp, -1);
+        append_x86_64_bit_count_reg_reg(&builder->buffer, 0, w, 0xBD, hwret, hwret);
+        append_x86_64_cmov_reg_reg(&builder->buffer, w, X86_64_COND_EQ, hwret, hwtemp);
+        append_x86_64_op_f7_reg(&builder->buffer, w, 3, hwret);
+        append_x86_64_add_reg_imm(&builder->buffer, w, hwret, 8 * size - 1);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+// tzcnt, or bsf, which leaves its result undefined for 0. Values under 4 bytes get bit 8 * size set, to stop at.
+Reg x86_64_count_trailing_zeros(void *fun, Reg operand, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a;
+    if (literal_operand(builder, operand, &a)) {
+        int bits = 8 * builder->block->registers.ptr[operand.id].type.size;
+        uint64_t x = extend_literal(a, bits / 8, false);
+        return emit_folded(builder, operand, operand, x ? __builtin_ctzll(x) : bits, discards);
+    }
+    int size = builder->block->registers.ptr[operand.id].type.size, hwret;
+    bool w = size == 8;
+    Reg reg = emit_bit_count_operand(builder, operand, discards, &hwret);
+    if (size < 4) append_x86_64_or_reg_imm(&builder->buffer, false, hwret, 1 << (8 * size));
+    if (builder->cpu_features & CPU_BMI1) {
+        append_x86_64_bit_count_reg_reg(&builder->buffer, 0xF3, w, 0xBC, hwret, hwret);
+    } else if (size < 4) {
+        append_x86_64_bit_count_reg_reg(&builder->buffer, 0, false, 0xBC, hwret, hwret);
+    } else {
+        int hwtemp = alloc_scratch_hwreg(builder, false);
+        append_x86_64_set_reg_imm32(&builder->buffer, hwtemp, 8 * size);
+        append_x86_64_bit_count_reg_reg(&builder->buffer, 0, w, 0xBC, hwret, hwret);
+        append_x86_64_cmov_reg_reg(&builder->buffer, w, X86_64_COND_EQ, hwret, hwtemp);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+// reg &= mask. 64-bit masks don't fit an imm32, and go through hwmask.
+void emit_and_mask(X86_64_Function_Builder *builder, bool w, int hwreg, int hwmask, uint64_t mask) {
+    if (w) {
+        append_x86_64_set_reg_imm(&builder->buffer, hwmask, mask);
+        append_x86_64_and_reg_reg(&builder->buffer, true, hwreg, hwmask);
+    } else {
+        append_x86_64_and_reg_imm(&builder->buffer, false, hwreg, (int32_t) mask);
+    }
+}
+
+/**
+ * Without popcnt, count bits in parallel: the sums of every 2 bits, then 4, then 8,
+ * and a multiply adds all bytes up into the top one.
+ */
+void emit_popcount_sequence(X86_64_Function_Builder *builder, bool w, int hwreg) {
+    Buffer *buffer = &builder->buffer;
+    int hwtemp = alloc_scratch_hwreg(builder, false);
+    int hwmask = w ? alloc_scratch_hwreg(builder, false) : -1;
+    // x -= (x >> 1) & 0x55..
+    append_x86_64_set_reg_reg(buffer, hwtemp, hwreg);
+    append_x86_64_shift_reg_imm(buffer, w, 5, hwtemp, 1);
+    emit_and_mask(builder, w, hwtemp, hwmask, 0x5555555555555555);
+    append_x86_64_sub_reg_reg(buffer, w, hwreg, hwtemp);
+    // x = (x & 0x33..) + ((x >> 2) & 0x33..)
+    append_x86_64_set_reg_reg(buffer, hwtemp, hwreg);
+    append_x86_64_shift_reg_imm(buffer, w, 5, hwtemp, 2);
+    emit_and_mask(builder, w, hwtemp, hwmask, 0x3333333333333333);
+    if (w) {
+        append_x86_64_and_reg_reg(buffer, true, hwreg, hwmask);
+    } else {
+        append_x86_64_and_reg_imm(buffer, false, hwreg, 0x33333333);
+    }
+    append_x86_64_add_reg_reg(buffer, w, hwreg, hwtemp);
+    // x = (x + (x >> 4)) & 0x0f..
+    append_x86_64_set_reg_reg(buffer, hwtemp, hwreg);
+    append_x86_64_shift_reg_imm(buffer, w, 5, hwtemp, 4);
+    append_x86_64_add_reg_reg(buffer, w, hwreg, hwtemp);
+    emit_and_mask(builder, w, hwreg, hwmask, 0x0F0F0F0F0F0F0F0F);
+    // x = (x * 0x01..) >> (bits - 8)
+    if (w) {
+        append_x86_64_set_reg_imm(buffer, hwmask, 0x0101010101010101);
+        append_x86_64_imul_reg_reg(buffer, true, hwreg, hwmask);
+    } else {
+        append_x86_64_imul_reg_imm(buffer, false, hwreg, 0x01010101);
+    }
+    append_x86_64_shift_reg_imm(buffer, w, 5, hwreg, w ? 56 : 24);
+}
+
+Reg x86_64_popcount(void *fun, Reg operand, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a;
+    if (literal_operand(builder, operand, &a)) {
+        int bits = 8 * builder->block->registers.ptr[operand.id].type.size;
+        uint64_t x = extend_literal(a, bits / 8, false);
+        return emit_folded(builder, operand, operand, __builtin_popcountll(x), discards);
+    }
+    bool w = builder->block->registers.ptr[operand.id].type.size == 8;
+    int hwret;
+    Reg reg = emit_bit_count_operand(builder, operand, discards, &hwret);
+    if (builder->cpu_features & CPU_POPCNT) {
+        append_x86_64_bit_count_reg_reg(&builder->buffer, 0xF3, w, 0xB8, hwret, hwret);
+    } else {
+        emit_popcount_sequence(builder, w, hwret);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+Reg x86_64_immediate_float32(void *fun, float value, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    union { float value; int32_t bits; } convert = { value };
+    Reg reg = emit_literal(builder, float_type(4), convert.bits);
+    release_regs(builder, discards);
+    return reg;
+}
+
+Reg x86_64_immediate_float64(void *fun, double value, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    union { double value; int64_t bits; } convert = { value };
+    Reg reg = emit_literal(builder, float_type(8), convert.bits);
+    release_regs(builder, discards);
+    return reg;
+}
+
+// The type of both operands of a float or vector op, which must be the same.
+Type sse_operand_type(X86_64_Function_Builder *builder, TypeKind kind, Reg left, Reg right) {
+    Type left_type = builder->block->registers.ptr[left.id].type;
+    Type right_type = builder->block->registers.ptr[right.id].type;
+    assert(left_type.kind == kind && right_type.kind == kind && left_type.size == right_type.size);
+    return left_type;
+}
+
+/**
+ * The AVX form of an SSE op, 'reg = left op right', which doesn't overwrite left.
+ * map is the opcode map of the op (1 is 0F, 2 is 0F38).
+ */
+Reg emit_vex_binary(X86_64_Function_Builder *builder, int prefix, int map, bool w, unsigned char opcode,
+                    Reg left, Reg right, RegList discards) {
+    use_reg(builder, left);
+    use_reg(builder, right);
+    Reg reg = alloc_next_reg(builder, builder->block->registers.ptr[left.id].type);
+    int hwleft = move_reg_to_hw(builder, left);
+    int hwright = move_reg_to_hw(builder, right);
+    int hwret = alloc_result_from_operands(builder, reg, left, right, discards);
+    append_x86_64_vex_reg_reg(&builder->buffer, prefix, map, w, opcode, hwret, hwleft, hwright);
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Emit a two-address SSE op, 'left = left op right', into a new reg, like emit_arith, or its AVX form.
+ * There are no immediates: literals are loaded into a scratch register.
+ */
+Reg emit_sse_binary(X86_64_Function_Builder *builder, int prefix, unsigned char opcode, bool commutative,
+                    Reg left, Reg right, RegList discards) {
+    if (builder->cpu_features & CPU_AVX) return emit_vex_binary(builder, prefix, 1, false, opcode, left, right, discards);
+    use_reg(builder, left);
+    use_reg(builder, right);
+    Reg reg = alloc_next_reg(builder, builder->block->registers.ptr[left.id].type);
+    RegRow *left_row = &builder->block->registers.ptr[left.id];
+    RegRow *right_row = &builder->block->registers.ptr[right.id];
+    int hwright = move_reg_to_hw(builder, right);
+    int hwret;
+    if (left_row->location == LOC_CPU && reglist_contains(discards, left)) {
+        hwret = left_row->hw_reg;
+        release_reg(builder, left);
+        set_reg_in_hwreg(builder, reg, hwret);
+    } else if (commutative && right_row->location == LOC_CPU && left.id != right.id && reglist_contains(discards, right)) {
+        hwret = hwright;
+        release_reg(builder, right);
+        set_reg_in_hwreg(builder, reg, hwret);
+        hwright = move_reg_to_hw(builder, left);
+    } else {
+        hwret = alloc_hwreg(builder, reg);
+        set_reg_in_hwreg(builder, reg, hwret);
+        copy_reg_to_hw(builder, hwret, left);
+    }
+    append_x86_64_sse_reg_reg(&builder->buffer, prefix, false, opcode, hwret, hwright);
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Emit 'result = op operand' into a new reg of result_type, which can be of the other register class.
+ * The result takes over the operand's hwreg if it's discarded and of the same class.
+ * imm8 is appended to the op, unless it's -1.
+ */
+Reg emit_sse_unary(X86_64_Function_Builder *builder, int prefix, bool w, unsigned char opcode, int imm8,
+                   Type result_type, Reg operand, RegList discards) {
+    use_reg(builder, operand);
+    Reg reg = alloc_next_reg(builder, result_type);
+    RegRow *row = &builder->block->registers.ptr[operand.id];
+    bool same_class = is_xmm_type(row->type) == is_xmm_type(result_type);
+    int hwoperand = move_reg_to_hw(builder, operand);
+    int hwret;
+    if (same_class && row->location == LOC_CPU && reglist_contains(discards, operand)) {
+        hwret = hwoperand;
+        release_reg(builder, operand);
+    } else {
+        hwret = alloc_hwreg(builder, reg);
+    }
+    set_reg_in_hwreg(builder, reg, hwret);
+    if (!same_class && is_xmm_type(result_type)) {
+        // cvtsi2ss and cvtsi2sd only write the low lane: zero the rest, so they don't wait for its old value.
+        append_x86_64_xorps_reg_reg(&builder->buffer, hwret, hwret);
+    }
+    append_x86_64_sse_reg_reg(&builder->buffer, prefix, w, opcode, hwret, hwoperand);
+    if (imm8 != -1) append(&builder->buffer, imm8);
+    release_regs(builder, discards);
+    return reg;
+}
+
+// Scalar float ops have the prefix of movss or movsd.
+Reg emit_float_binary(X86_64_Function_Builder *builder, unsigned char opcode, bool commutative, Reg left, Reg right, RegList discards) {
+    Type value_type = sse_operand_type(builder, TYPE_FLOAT, left, right);
+    return emit_sse_binary(builder, x86_64_sse_size_prefix(value_type.size), opcode, commutative, left, right, discards);
+}
+
+Reg x86_64_fadd(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_float_binary(builder, 0x58, true, left, right, discards);
+}
+
+Reg x86_64_fsub(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_float_binary(builder, 0x5C, false, left, right, discards);
+}
+
+Reg x86_64_fmul(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_float_binary(builder, 0x59, true, left, right, discards);
+}
+
+Reg x86_64_fdiv(void *fun, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_float_binary(builder, 0x5E, false, left, right, discards);
+}
+
+Reg x86_64_fsqrt(void *fun, Reg reg, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    Type value_type = builder->block->registers.ptr[reg.id].type;
+    assert(value_type.kind == TYPE_FLOAT);
+    return emit_sse_unary(builder, x86_64_sse_size_prefix(value_type.size), false, 0x51, -1, value_type, reg, discards);
+}
+
+/**
+ * vfmadd213: left = left * right + addend, rounded once. opcode is A8 for vectors and A9 for scalars,
+ * and W selects f64.
+ */
+Reg emit_fused_multiply_add(X86_64_Function_Builder *builder, unsigned char opcode, bool w,
+                            Reg left, Reg right, Reg addend, RegList discards) {
+    use_reg(builder, left);
+    use_reg(builder, right);
+    use_reg(builder, addend);
+    Reg reg = alloc_next_reg(builder, builder->block->registers.ptr[left.id].type);
+    int hwright = move_reg_to_hw(builder, right);
+    int hwaddend = move_reg_to_hw(builder, addend);
+    int hwret = alloc_result_from_operand(builder, reg, left, discards, -1);
+    append_x86_64_vex_reg_reg(&builder->buffer, 0x66, 2, w, opcode, hwret, hwright, hwaddend);
+    release_regs(builder, discards);
+    return reg;
+}
+
+// Without FMA, multiply into a temporary, then add.
+Reg x86_64_fma(void *fun, Reg left, Reg right, Reg addend, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    if (builder->cpu_features & CPU_FMA) {
+        Type value_type = sse_operand_type(builder, TYPE_FLOAT, left, right);
+        sse_operand_type(builder, TYPE_FLOAT, left, addend);
+        return emit_fused_multiply_add(builder, 0xA9, value_type.size == 8, left, right, addend, discards);
+    }
+    use_reg(builder, addend);
+    Reg product = emit_float_binary(builder, 0x59, true, left, right, ND);
+    Reg reg = emit_float_binary(builder, 0x58, true, product, addend, (RegList) { 1, &product });
+    release_regs(builder, discards);
+    return reg;
+}
+
+Reg x86_64_convert(void *fun, Reg reg, Type to, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    Type from = row->type;
+    if (from.kind == TYPE_INTEGER && to.kind == TYPE_FLOAT) {
+        // cvtsi2ss or cvtsi2sd, from a signed 32 or 64-bit integer.
+        if (from.size < 4 && row->location != LOC_LITERAL) {
+            emit_extend_in_place(builder, move_reg_to_hw(builder, reg), from.size, true);
+        }
+        return emit_sse_unary(builder, x86_64_sse_size_prefix(to.size), from.size == 8, 0x2A, -1, to, reg, discards);
+    } else if (from.kind == TYPE_FLOAT && to.kind == TYPE_INTEGER) {
+        // cvttss2si or cvttsd2si, to a 32 or 64-bit integer.
+        return emit_sse_unary(builder, x86_64_sse_size_prefix(from.size), to.size == 8, 0x2C, -1, to, reg, discards);
+    } else if (from.kind == TYPE_FLOAT && to.kind == TYPE_FLOAT && from.size == to.size) {
+        return emit_sse_unary(builder, 0, false, 0x28, -1, to, reg, discards);
+    } else if (from.kind == TYPE_FLOAT && to.kind == TYPE_FLOAT) {
+        // cvtss2sd or cvtsd2ss
+        return emit_sse_unary(builder, x86_64_sse_size_prefix(from.size), false, 0x5A, -1, to, reg, discards);
+    }
+    assert(false);
+    return INVALID_REG;
+}
+
+int x86_64_lane_size(Lanes lanes) {
+    static const int sizes[6] = { 1, 2, 4, 8, 4, 8 };
+    return sizes[lanes];
+}
+
+// The type of a single lane.
+Type x86_64_lane_type(Lanes lanes) {
+    return lanes >= LANES_F32 ? float_type(x86_64_lane_size(lanes)) : type(x86_64_lane_size(lanes));
+}
+
+// Packed ops on integer and F64 lanes take a 0x66 prefix, on F32 lanes none.
+int x86_64_lanes_prefix(Lanes lanes) {
+    return lanes == LANES_F32 ? 0 : 0x66;
+}
+
+// Opcodes of packed ops, by lanes. 0 if there's none.
+unsigned char x86_64_vector_add_opcodes[6] = { 0xFC, 0xFD, 0xFE, 0xD4, 0x58, 0x58 };
+unsigned char x86_64_vector_sub_opcodes[6] = { 0xF8, 0xF9, 0xFA, 0xFB, 0x5C, 0x5C };
+// I32 has its own sequence.
+unsigned char x86_64_vector_mul_opcodes[6] = { 0, 0xD5, 0, 0, 0x59, 0x59 };
+unsigned char x86_64_vector_div_opcodes[6] = { 0, 0, 0, 0, 0x5E, 0x5E };
+
+Reg emit_vector_binary(X86_64_Function_Builder *builder, unsigned char *opcodes, bool commutative,
+                       Lanes lanes, Reg left, Reg right, RegList discards) {
+    sse_operand_type(builder, TYPE_VECTOR, left, right);
+    assert(opcodes[lanes] != 0);
+    return emit_sse_binary(builder, x86_64_lanes_prefix(lanes), opcodes[lanes], commutative, left, right, discards);
+}
+
+/**
+ * pmulld is SSE4.1, which AVX implies: without it, multiply the even and the odd lanes into 64-bit products
+ * with pmuludq, and interleave the low halves of the products.
+ */
+Reg emit_vector_mul_i32(X86_64_Function_Builder *builder, Reg left, Reg right, RegList discards) {
+    Buffer *buffer = &builder->buffer;
+    if (builder->cpu_features & CPU_AVX) {
+        sse_operand_type(builder, TYPE_VECTOR, left, right);
+        return emit_vex_binary(builder, 0x66, 2, false, 0x40, left, right, discards);
     }
-    builder->declaration = marker;
-    // header
-    append_x86_64_push_reg(&builder->buffer, X86_64_RBP);
-    append_x86_64_set_reg_reg(&builder->buffer, X86_64_RBP, X86_64_RSP);
-    builder->frame_sub_offset = builder->buffer.offset;
-    append_x86_64_sub_reg_imm(&builder->buffer, X86_64_RSP, 0);
-    module->builders.ptr = realloc(module->builders.ptr, ++module->builders.length * sizeof(X86_64_Function_Builder*));
-    module->builders.ptr[module->builders.length - 1] = builder;
-    return builder;
+    use_reg(builder, left);
+    use_reg(builder, right);
+    Reg reg = alloc_next_reg(builder, sse_operand_type(builder, TYPE_VECTOR, left, right));
+    int hwleft = move_reg_to_hw(builder, left);
+    int hwright = move_reg_to_hw(builder, right);
+    int odd_left = alloc_scratch_hwreg(builder, true);
+    int odd_right = alloc_scratch_hwreg(builder, true);
+    // pshufd: lanes 1, 1, 3, 3
+    append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0x70, odd_left, hwleft, 0xF5);
+    append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0x70, odd_right, hwright, 0xF5);
+    // pmuludq
+    append_x86_64_sse_reg_reg(buffer, 0x66, false, 0xF4, odd_left, odd_right);
+    int hwret = alloc_result_from_operand(builder, reg, left, discards, -1);
+    append_x86_64_sse_reg_reg(buffer, 0x66, false, 0xF4, hwret, hwright);
+    // pshufd: the low halves to lanes 0 and 1, then punpckldq
+    append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0x70, hwret, hwret, 0x08);
+    append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0x70, odd_left, odd_left, 0x08);
+    append_x86_64_sse_reg_reg(buffer, 0x66, false, 0x62, hwret, odd_left);
+    release_regs(builder, discards);
+    return reg;
 }
 
-Reg x86_64_immediate_int64(void *fun, int64_t value, RegList discards) {
+Reg x86_64_vector_add(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    Reg reg = alloc_next_reg(builder, type(8));
-    RegRow *row = &builder->block->registers.ptr[reg.id];
-    row->location = LOC_LITERAL;
-    row->value = value;
-    return reg;
+    begin_op(builder);
+    return emit_vector_binary(builder, x86_64_vector_add_opcodes, true, lanes, left, right, discards);
 }
 
-Reg x86_64_immediate_function(void *fun, Marker marker, RegList discards) {
+Reg x86_64_vector_sub(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    Reg reg = alloc_next_reg(builder, type(8));
-    RegRow *row = &builder->block->registers.ptr[reg.id];
-    row->location = LOC_RELOC;
-    row->marker = marker;
+    begin_op(builder);
+    return emit_vector_binary(builder, x86_64_vector_sub_opcodes, false, lanes, left, right, discards);
+}
+
+Reg x86_64_vector_mul(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    if (lanes == LANES_I32) return emit_vector_mul_i32(builder, left, right, discards);
+    return emit_vector_binary(builder, x86_64_vector_mul_opcodes, true, lanes, left, right, discards);
+}
+
+Reg x86_64_vector_div(void *fun, Lanes lanes, Reg left, Reg right, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    return emit_vector_binary(builder, x86_64_vector_div_opcodes, false, lanes, left, right, discards);
+}
+
+Reg x86_64_vector_fma(void *fun, Lanes lanes, Reg left, Reg right, Reg addend, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    assert(lanes == LANES_F32 || lanes == LANES_F64);
+    if (builder->cpu_features & CPU_FMA) {
+        sse_operand_type(builder, TYPE_VECTOR, left, right);
+        sse_operand_type(builder, TYPE_VECTOR, left, addend);
+        return emit_fused_multiply_add(builder, 0xA8, lanes == LANES_F64, left, right, addend, discards);
+    }
+    use_reg(builder, addend);
+    Reg product = emit_vector_binary(builder, x86_64_vector_mul_opcodes, true, lanes, left, right, ND);
+    Reg reg = emit_vector_binary(builder, x86_64_vector_add_opcodes, true, lanes, product, addend, (RegList) { 1, &product });
+    release_regs(builder, discards);
     return reg;
 }
 
-Reg x86_64_add(void *fun, Reg left, Reg right, RegList discards) {
+/**
+ * Integer scalars are moved to the low lane first. Then pshufd copies lane 0 (or lanes 0 and 1) everywhere;
+ * 8 and 16-bit lanes are first spread over the low 32 bits with punpcklbw and pshuflw.
+ * AVX2 broadcasts any lane in one go.
+ */
+Reg x86_64_vector_splat(void *fun, Lanes lanes, Reg scalar, RegList discards) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    Reg reg = alloc_next_reg(builder, type(8));
+    begin_op(builder);
+    Buffer *buffer = &builder->buffer;
+    RegRow *row = &builder->block->registers.ptr[scalar.id];
+    Type lane_type = x86_64_lane_type(lanes);
+    assert(row->type.kind == lane_type.kind && (row->location == LOC_LITERAL || row->type.size == lane_type.size));
+    use_reg(builder, scalar);
+    int hwscalar = move_reg_to_hw(builder, scalar);
+    Reg reg = alloc_next_reg(builder, vector_type(16));
     int hwret = alloc_hwreg(builder, reg);
     set_reg_in_hwreg(builder, reg, hwret);
-    copy_reg_to_hw(builder, hwret, left);
-    RegRow *right_row = &builder->block->registers.ptr[right.id];
-    if (right_row->location == LOC_LITERAL && right_row->value >= INT32_MIN && right_row->value <= INT32_MAX) {
-        append_x86_64_add_reg_imm(&builder->buffer, hwret, right_row->value);
-    } else {
-        int hwright = move_reg_to_hw(builder, right);
-        append_x86_64_add_reg_reg(&builder->buffer, hwret, hwright);
+    int hwlow = hwscalar;
+    if (lanes < LANES_F32) {
+        append_x86_64_movq_xmm_reg(buffer, lanes == LANES_I64, hwret, hwscalar);
+        hwlow = hwret;
+    }
+    if (builder->cpu_features & CPU_AVX2) {
+        // vpbroadcastb/w/d/q, and vbroadcastss
+        static const unsigned char broadcast_opcodes[6] = { 0x78, 0x79, 0x58, 0x59, 0x18, 0x59 };
+        append_x86_64_vex_reg_reg(buffer, 0x66, 2, false, broadcast_opcodes[lanes], hwret, 0, hwlow);
+        release_regs(builder, discards);
+        return reg;
+    }
+    if (lanes == LANES_I8) {
+        // punpcklbw
+        append_x86_64_sse_reg_reg(buffer, 0x66, false, 0x60, hwret, hwret);
     }
+    if (lanes == LANES_I8 || lanes == LANES_I16) {
+        // pshuflw
+        append_x86_64_sse_reg_reg_imm8(buffer, 0xF2, 0x70, hwret, hwret, 0x00);
+    }
+    append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0x70, hwret, hwlow, x86_64_lane_size(lanes) == 8 ? 0x44 : 0x00);
+    release_regs(builder, discards);
     return reg;
 }
 
-Reg x86_64_sub(void *fun, Reg left, Reg right, RegList discards) {
+/**
+ * 8 and 16-bit lanes come out of pextrw. Other lanes are shuffled to lane 0 with pshufd, unless they're there already,
+ * and integers then go to a gp register.
+ */
+Reg x86_64_vector_extract(void *fun, Lanes lanes, Reg vector, int lane, RegList discards) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    Reg reg = alloc_next_reg(builder, type(8));
+    begin_op(builder);
+    Buffer *buffer = &builder->buffer;
+    assert(builder->block->registers.ptr[vector.id].type.kind == TYPE_VECTOR);
+    int lane_size = x86_64_lane_size(lanes);
+    assert(lane >= 0 && lane < 16 / lane_size);
+    use_reg(builder, vector);
+    int hwvector = move_reg_to_hw(builder, vector);
+    Reg reg = alloc_next_reg(builder, x86_64_lane_type(lanes));
     int hwret = alloc_hwreg(builder, reg);
     set_reg_in_hwreg(builder, reg, hwret);
-    copy_reg_to_hw(builder, hwret, left);
-    RegRow *right_row = &builder->block->registers.ptr[right.id];
-    if (right_row->location == LOC_LITERAL && right_row->value >= INT32_MIN && right_row->value <= INT32_MAX) {
-        append_x86_64_sub_reg_imm(&builder->buffer, hwret, right_row->value);
+    if (lane_size <= 2) {
+        // pextrw zero extends the word.
+        append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0xC5, hwret, hwvector, lane * lane_size / 2);
+        if (lane_size == 1 && lane % 2) append_x86_64_shift_reg_imm(buffer, false, 5, hwret, 8);
     } else {
-        int hwright = move_reg_to_hw(builder, right);
-        append_x86_64_sub_reg_reg(&builder->buffer, hwret, hwright);
+        int hwlow = hwvector;
+        if (lane != 0) {
+            hwlow = lanes >= LANES_F32 ? hwret : alloc_scratch_hwreg(builder, true);
+            // lane 1, 2 or 3, or lanes 2 and 3
+            append_x86_64_sse_reg_reg_imm8(buffer, 0x66, 0x70, hwlow, hwvector, lane_size == 4 ? lane : 0xEE);
+        }
+        if (lanes < LANES_F32) {
+            append_x86_64_movq_reg_xmm(buffer, lane_size == 8, hwret, hwlow);
+        } else if (hwlow != hwret) {
+            append_x86_64_movaps_reg_reg(buffer, hwret, hwlow);
+        }
     }
+    release_regs(builder, discards);
     return reg;
 }
 
+// pshufd, with 64-bit lanes as pairs of 32-bit lanes.
+Reg x86_64_vector_shuffle(void *fun, Lanes lanes, Reg vector, const int *indices, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    Type vector_type = builder->block->registers.ptr[vector.id].type;
+    assert(vector_type.kind == TYPE_VECTOR);
+    int lane_size = x86_64_lane_size(lanes);
+    assert(lane_size == 4 || lane_size == 8);
+    int imm = 0;
+    for (int i = 0; i < 16 / lane_size; i++) {
+        assert(indices[i] >= 0 && indices[i] < 16 / lane_size);
+        if (lane_size == 4) {
+            imm |= indices[i] << (2 * i);
+        } else {
+            imm |= (2 * indices[i]) << (4 * i) | (2 * indices[i] + 1) << (4 * i + 2);
+        }
+    }
+    return emit_sse_unary(builder, 0x66, false, 0x70, imm, vector_type, vector, discards);
+}
+
 Reg x86_64_arg(void *fun, int arg) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
     assert(arg >= 0 && arg < builder->args.length);
@@ -646,166 +3713,921 @@ Reg x86_64_arg(void *fun, int arg) {
 
 Reg x86_64_immediate_void(void *fun, RegList discards) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
     Reg reg = alloc_next_reg(builder, type(0));
     // no space necessary
     // TODO always return the same register?
     builder->block->registers.ptr[reg.id].location = LOC_STACK;
+    release_regs(builder, discards);
     return reg;
 }
 
 Reg x86_64_call(void *fun, Reg target, RegList args, Type ret_type, Types types, CallingConvention *cc, RegList discards) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
     assert(args.length == types.length);
     assert(cc->type == CALLING_CONVENTION_X86_64_SYSV);
     X86_64_SysV *sysv_cc = (X86_64_SysV*) cc;
     assert(sysv_cc->arguments.length == args.length);
-    // bleh bleh bleh bleh bleh bleh
-    // First spill all regs currently in hwregs to the stack.
-    // TODO unless it's in discards
+    // First move all regs that are still needed after the call out of caller-saved hwregs.
+    // Those the frontend assigned a callee-saved hwreg go there if it's free.
+    // The most valuable other ones go into free callee-saved hwregs, the rest to the stack.
+    // Discarded regs stay where they are, since they may still be needed as arguments.
     for (int i = 0; i < 16; i++) {
         Reg reg = builder->block->hw_reg_map.gp_regs[i];
-        if (IS_VALID_REG(reg)) spill_to_stack(builder, reg);
+        if (!IS_VALID_REG(reg) || x86_64_is_callee_saved(i) || reglist_contains(discards, reg)) continue;
+        int assigned = builder->block->registers.ptr[reg.id].assigned - 1;
+        if (assigned >= 0 && x86_64_is_callee_saved(assigned) && !(builder->scratch_regs & (1 << assigned))
+            && !IS_VALID_REG(builder->block->hw_reg_map.gp_regs[assigned])) {
+            builder->callee_saved_used |= 1 << assigned;
+            move_reg_to_hwreg(builder, reg, assigned);
+        }
+    }
+    while (true) {
+        Reg evacuate_reg = INVALID_REG;
+        int64_t evacuate_cost = 0, evacuate_distance = 0;
+        for (int i = 0; i < 16; i++) {
+            Reg reg = builder->block->hw_reg_map.gp_regs[i];
+            if (!IS_VALID_REG(reg) || x86_64_is_callee_saved(i) || reglist_contains(discards, reg)) continue;
+            int64_t cost, distance;
+            spill_weight(builder, reg, &cost, &distance);
+            if (!IS_VALID_REG(evacuate_reg) || cost * evacuate_distance > evacuate_cost * distance) {
+                evacuate_reg = reg;
+                evacuate_cost = cost;
+                evacuate_distance = distance;
+            }
+        }
+        if (!IS_VALID_REG(evacuate_reg)) break;
+        int hwreg = alloc_free_callee_saved_hwreg(builder);
+        if (hwreg == -1) {
+            spill_to_stack(builder, evacuate_reg);
+        } else {
+            move_reg_to_hwreg(builder, evacuate_reg, hwreg);
+        }
     }
+    // No xmm registers are callee-saved.
+    for (int i = 0; i < 16; i++) {
+        Reg reg = builder->block->hw_reg_map.xmm_regs[i];
+        if (IS_VALID_REG(reg) && !reglist_contains(discards, reg)) spill_to_stack(builder, reg);
+    }
+    // Then move the arguments and the call target into place, all at once.
     int preferred_int_regs[6] = { X86_64_RDI, X86_64_RSI, X86_64_RDX, X86_64_RCX, X86_64_R8, X86_64_R9 };
-    bool occupied[16] = { 0 };
+    X86_64_Move moves[6 + 8 + 1];
+    bool arg_hwreg[16] = { 0 };
+    int num_int_args = 0, num_sse_args = 0;
     for (int i = 0; i < args.length; i++) {
-        RegRow row = builder->block->registers.ptr[args.ptr[i].id];
-        assert(row.type.size == 8);
-        int hwreg = preferred_int_regs[i];
-        Reg blocking_reg = builder->block->hw_reg_map.gp_regs[hwreg];
-        if (IS_VALID_REG(blocking_reg)) spill_to_stack(builder, blocking_reg);
-        copy_reg_to_hw(builder, hwreg, args.ptr[i]);
-        occupied[hwreg] = true;
+        RegRow *row = &builder->block->registers.ptr[args.ptr[i].id];
+        assert(row->type.size == types.ptr[i].size);
+        use_reg(builder, args.ptr[i]);
+        X86_64_Location to;
+        if (sysv_cc->arguments.ptr[i] == X86_64_CLASS_SSE) {
+            assert(num_sse_args < 8);
+            to = (X86_64_Location) { false, num_sse_args++, true };
+        } else {
+            assert(sysv_cc->arguments.ptr[i] == X86_64_CLASS_INTEGER && num_int_args < 6);
+            to = (X86_64_Location) { false, preferred_int_regs[num_int_args++] };
+            arg_hwreg[to.index] = true;
+        }
+        moves[i] = move_reg_to_location(builder, args.ptr[i], to);
     }
+    // al is an upper bound on the number of xmm registers a varargs function gets.
+    if (num_sse_args > 0) arg_hwreg[X86_64_RAX] = true;
+    int num_moves = args.length;
     RegRow *target_row = &builder->block->registers.ptr[target.id];
-    if (target_row->location == LOC_CPU) {
-        int target_hwreg = builder->block->registers.ptr[target.id].hw_reg;
-        append_x86_64_call_reg(&builder->buffer, target_hwreg);
-    } else if (target_row->location == LOC_RELOC) {
+    int target_hwreg = -1;
+    if (target_row->location == LOC_CPU && !arg_hwreg[target_row->hw_reg]) {
+        target_hwreg = target_row->hw_reg;
+    } else if (target_row->location != LOC_RELOC) {
+        // r11 is caller-saved, and not used for arguments.
+        target_hwreg = X86_64_R11;
+        moves[num_moves++] = move_reg_to_location(builder, target, (X86_64_Location) { false, target_hwreg });
+    }
+    use_reg(builder, target);
+    emit_parallel_move(builder, moves, num_moves);
+    // Callees read 1 and 2-byte args as 32 bits, as C compilers extend them. Values that small are neither
+    // signed nor unsigned, so they're zero-extended: clients sign-extend them to 4 bytes themselves for signed ones.
+    for (int i = 0; i < args.length; i++) {
+        if (!moves[i].to.xmm) emit_extend_in_place(builder, moves[i].to.index, types.ptr[i].size, false);
+    }
+    if (num_sse_args > 0) append_x86_64_set_reg_imm32(&builder->buffer, X86_64_RAX, num_sse_args);
+    builder->last_call = (X86_64_Call_Site) { .start = builder->buffer.offset, .target_hwreg = target_hwreg };
+    if (target_row->location == LOC_RELOC) {
         size_t offset = append_x86_64_call_rel(&builder->buffer);
-        RelocTargets *targets = &builder->near_function_targets;
-        targets->ptr = realloc(targets->ptr, ++targets->length * sizeof(RelocTarget));
-        targets->ptr[targets->length - 1] = (RelocTarget) {
-            .marker = target_row->marker,
-            .offset = offset,
-        };
-    } else if (target_row->location == LOC_STACK || target_row->location == LOC_LITERAL) {
-        // find a free hwreg for the funcptr
-        for (int i = 0; i < 16; i++) {
-            if (occupied[i]) continue;
-            int target_hwreg = i;
-            copy_reg_to_hw(builder, i, target);
-            append_x86_64_call_reg(&builder->buffer, target_hwreg);
-            break;
-        }
+        append_reloc_target(builder, &builder->near_function_targets, target_row->marker, offset);
     } else {
-        assert(false);
+        append_x86_64_call_reg(&builder->buffer, target_hwreg);
+    }
+    // Whatever is left in caller-saved hwregs was discarded, and is now clobbered.
+    for (int i = 0; i < 16; i++) {
+        Reg reg = builder->block->hw_reg_map.gp_regs[i];
+        if (!IS_VALID_REG(reg) || x86_64_is_callee_saved(i)) continue;
+        assert(reglist_contains(discards, reg));
+        release_reg(builder, reg);
+    }
+    for (int i = 0; i < 16; i++) {
+        Reg reg = builder->block->hw_reg_map.xmm_regs[i];
+        if (!IS_VALID_REG(reg)) continue;
+        assert(reglist_contains(discards, reg));
+        release_reg(builder, reg);
+    }
+    for (int i = 0; i < discards.length; i++) {
+        release_reg(builder, discards.ptr[i]);
     }
+    builder->last_call.end = builder->buffer.offset;
+    builder->last_call.result = INVALID_REG;
     if (ret_type.size == 0) return INVALID_REG;
-    else if (ret_type.size == 8) {
+    else if (ret_type.size == 1 || ret_type.size == 2 || ret_type.size == 4 || ret_type.size == 8 || ret_type.size == 16) {
+        assert(sysv_cc->ret_class == (is_xmm_type(ret_type) ? X86_64_CLASS_SSE : X86_64_CLASS_INTEGER));
         Reg reg = alloc_next_reg(builder, ret_type);
-        set_reg_in_hwreg(builder, reg, X86_64_RAX);
+        // rax or xmm0
+        set_reg_in_hwreg(builder, reg, 0);
+        builder->last_call.result = reg;
         return reg;
     } else {
         assert(false);
     }
 }
 
+/**
+ * If nothing happened since the last call but computing the reg to return, the call can become a jmp:
+ * the callee then returns to our caller directly, from our caller's frame.
+ * All arguments are passed in registers, so that never needs stack space of our caller's.
+ */
+bool is_tail_call(X86_64_Function_Builder *builder, Reg reg, Type type) {
+    X86_64_Call_Site *call = &builder->last_call;
+    if (call->end != builder->buffer.offset || call->start == call->end) return false;
+    return type.size == 0 || (IS_VALID_REG(call->result) && reg.id == call->result.id);
+}
+
 void x86_64_ret(void *fun, Reg reg, Type type, CallingConvention *cc) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
     assert(cc->type == CALLING_CONVENTION_X86_64_SYSV);
     X86_64_SysV *sysv_cc = (X86_64_SysV*) cc;
     assert(builder->block->registers.ptr[reg.id].type.size == type.size);
+    bool tail_call = is_tail_call(builder, reg, type);
+    int target_hwreg = -1;
+    Marker target_marker;
+    if (tail_call) {
+        // Take back the call; the arguments are still in place.
+        X86_64_Call_Site *call = &builder->last_call;
+        builder->buffer.offset = call->start;
+        X86_64_Recorded_Moves *moves = &builder->moves;
+        while (moves->length && moves->ptr[moves->length - 1].offset >= call->start) moves->length--;
+        target_hwreg = call->target_hwreg;
+        if (target_hwreg == -1) {
+            RelocTargets *targets = &builder->near_function_targets;
+            target_marker = targets->ptr[--targets->length].marker;
+        } else if (x86_64_is_callee_saved(target_hwreg)) {
+            // It would be restored before the jmp.
+            append_x86_64_set_reg_reg(&builder->buffer, X86_64_R11, target_hwreg);
+            target_hwreg = X86_64_R11;
+        }
+    }
     if (type.size == 0) {
         assert(sysv_cc->ret_class == X86_64_CLASS_MEMORY);
-    } else if (type.size == 8) {
-        assert(sysv_cc->ret_class == X86_64_CLASS_INTEGER);
-        copy_reg_to_hw(builder, X86_64_RAX, reg);
+    } else if (type.size == 1 || type.size == 2 || type.size == 4 || type.size == 8 || type.size == 16) {
+        assert(sysv_cc->ret_class == (is_xmm_type(type) ? X86_64_CLASS_SSE : X86_64_CLASS_INTEGER));
+        // rax or xmm0
+        if (!tail_call) copy_reg_to_hw(builder, 0, reg);
     } else {
         assert(false);
     }
+    Offsets *restores = &builder->callee_restore_offsets;
+    restores->ptr = grow_list(&builder->arena, restores->ptr, restores->length, restores->length + 1, sizeof(size_t));
+    restores->ptr[restores->length++] = builder->buffer.offset;
+    append_x86_64_callee_saves(&builder->buffer, 0, true);
     append_x86_64_set_reg_reg(&builder->buffer, X86_64_RSP, X86_64_RBP);
     append_x86_64_pop_reg(&builder->buffer, X86_64_RBP);
-    append_x86_64_ret(&builder->buffer);
+    if (!tail_call) {
+        append_x86_64_ret(&builder->buffer);
+    } else if (target_hwreg == -1) {
+        size_t offset = append_x86_64_jmp_marker(&builder->buffer);
+        append_reloc_target(builder, &builder->near_function_targets, target_marker, offset);
+    } else {
+        append_x86_64_jmp_reg(&builder->buffer, target_hwreg);
+    }
     builder->block = NULL;
+    builder->reachable = false;
 }
 
 void append_reloc_label_target(X86_64_Function_Builder *builder, Marker marker, size_t offset) {
     RelocTargets *label_targets = &builder->label_targets;
-    label_targets->ptr = realloc(label_targets->ptr, ++label_targets->length);
-    label_targets->ptr[label_targets->length - 1] = (RelocTarget) {
+    label_targets->ptr = grow_list(&builder->arena, label_targets->ptr, label_targets->length, label_targets->length + 1, sizeof(RelocTarget));
+    label_targets->ptr[label_targets->length++] = (RelocTarget) {
         .marker = marker,
         .offset = offset,
     };
 }
 
+/**
+ * Get the moves needed to jump to a label from the current block.
+ * The first edge to reach a label fixes its state.
+ */
+X86_64_Move *label_edge_moves(X86_64_Function_Builder *builder, Label *label, size_t *length) {
+    if (!label->state) {
+        label->state = label_state(&builder->arena, builder->block);
+    }
+    // Before the label is placed, values not defined on every edge can still be dropped from its state.
+    bool placed = label->offset != -1;
+    return state_transfer_moves(builder->block, label->state, !placed, length);
+}
+
 void x86_64_branch(void *fun, Marker marker) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
     assert(marker.id < builder->labels.length);
+    size_t num_moves;
+    X86_64_Move *moves = label_edge_moves(builder, &builder->labels.ptr[marker.id], &num_moves);
+    emit_parallel_move(builder, moves, num_moves);
+    free(moves);
     size_t offset = append_x86_64_jmp_marker(&builder->buffer);
     append_reloc_label_target(builder, marker, offset);
     builder->block = NULL;
+    builder->reachable = false;
 }
 
-void x86_64_branch_if_equal(void *fun, Marker marker, Reg first, Reg second) {
-    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    assert(marker.id < builder->labels.length);
+int x86_64_cond(Comparison comparison) {
+    switch (comparison) {
+        case COMPARE_EQ: return X86_64_COND_EQ;
+        case COMPARE_NE: return X86_64_COND_NE;
+        case COMPARE_LT: return X86_64_COND_LT;
+        case COMPARE_LE: return X86_64_COND_LE;
+        case COMPARE_GT: return X86_64_COND_GT;
+        case COMPARE_GE: return X86_64_COND_GE;
+        case COMPARE_ULT: return X86_64_COND_B;
+        case COMPARE_ULE: return X86_64_COND_BE;
+        case COMPARE_UGT: return X86_64_COND_A;
+        case COMPARE_UGE: return X86_64_COND_AE;
+    }
+    assert(false);
+    return -1;
+}
+
+// The comparison that holds for (second, first) when 'comparison' holds for (first, second).
+Comparison swap_comparison(Comparison comparison) {
+    switch (comparison) {
+        case COMPARE_LT: return COMPARE_GT;
+        case COMPARE_LE: return COMPARE_GE;
+        case COMPARE_GT: return COMPARE_LT;
+        case COMPARE_GE: return COMPARE_LE;
+        case COMPARE_ULT: return COMPARE_UGT;
+        case COMPARE_ULE: return COMPARE_UGE;
+        case COMPARE_UGT: return COMPARE_ULT;
+        case COMPARE_UGE: return COMPARE_ULE;
+        default: return comparison;
+    }
+}
+
+/**
+ * ucomiss and ucomisd set the flags like an unsigned compare, and ZF, PF and CF all if an operand is NaN.
+ * So 'a > b' and 'a >= b' are A and AE, which don't hold for NaN, and 'a < b' and 'a <= b' swap the operands.
+ * EQ and NE also need PF: they're combined in a gp register, for a condition of NE.
+ */
+int emit_float_compare(X86_64_Function_Builder *builder, Comparison comparison, Reg first, Reg second) {
+    assert(comparison <= COMPARE_GE);
+    Type value_type = sse_operand_type(builder, TYPE_FLOAT, first, second);
+    if (comparison == COMPARE_LT || comparison == COMPARE_LE) {
+        Reg swap = first;
+        first = second;
+        second = swap;
+        comparison = swap_comparison(comparison);
+    }
+    use_reg(builder, first);
+    use_reg(builder, second);
     int hwreg1 = move_reg_to_hw(builder, first);
+    int hwreg2 = move_reg_to_hw(builder, second);
+    bool equality = comparison == COMPARE_EQ || comparison == COMPARE_NE;
+    int temp1 = equality ? alloc_scratch_hwreg(builder, false) : -1;
+    int temp2 = equality ? alloc_scratch_hwreg(builder, false) : -1;
+    append_x86_64_sse_reg_reg(&builder->buffer, value_type.size == 8 ? 0x66 : 0, false, 0x2E, hwreg1, hwreg2);
+    if (comparison == COMPARE_GT) return X86_64_COND_A;
+    if (comparison == COMPARE_GE) return X86_64_COND_AE;
+    bool eq = comparison == COMPARE_EQ;
+    append_x86_64_setcc_reg(&builder->buffer, eq ? X86_64_COND_EQ : X86_64_COND_NE, temp1);
+    append_x86_64_setcc_reg(&builder->buffer, eq ? X86_64_COND_NP : X86_64_COND_P, temp2);
+    if (eq) {
+        append_x86_64_and_reg_reg(&builder->buffer, false, temp1, temp2);
+    } else {
+        append_x86_64_or_reg_reg(&builder->buffer, false, temp1, temp2);
+    }
+    return X86_64_COND_NE;
+}
+
+/**
+ * Set the flags for 'first - second' at the operands' size, and return the condition for the comparison.
+ * 1 and 2-byte operands are extended to 32 bits first, according to the comparison's signedness.
+ * An imm32 can only be the second operand, so a literal first operand swaps them.
+ */
+int emit_compare(X86_64_Function_Builder *builder, Comparison comparison, Reg first, Reg second) {
+    if (is_xmm_type(operand_type(builder, first, second))) return emit_float_compare(builder, comparison, first, second);
+    RegRow *first_row = &builder->block->registers.ptr[first.id];
     RegRow *second_row = &builder->block->registers.ptr[second.id];
-    if (second_row->location == LOC_LITERAL && second_row->value >= INT32_MIN && second_row->value <= INT32_MAX) {
-        append_x86_64_cmp_reg_imm(&builder->buffer, hwreg1, second_row->value);
+    if (fits_imm32(first_row) && !fits_imm32(second_row)) {
+        Reg swap = first;
+        first = second;
+        second = swap;
+        second_row = first_row;
+        comparison = swap_comparison(comparison);
+    }
+    int size = operand_type(builder, first, second).size;
+    bool w = size == 8;
+    bool is_signed = comparison >= COMPARE_LT && comparison <= COMPARE_GE;
+    use_reg(builder, second);
+    int hwreg1 = move_reg_to_hw(builder, first);
+    emit_extend_in_place(builder, hwreg1, size, is_signed);
+    if (fits_imm32(second_row)) {
+        int32_t imm = extend_literal(second_row->value, size, is_signed);
+        if (imm == 0) {
+            // flags of first - 0 are the flags of first & first, except for carry and overflow, which are 0 either way.
+            append_x86_64_test_reg_reg(&builder->buffer, w, hwreg1, hwreg1);
+        } else {
+            append_x86_64_cmp_reg_imm(&builder->buffer, w, hwreg1, imm);
+        }
     } else {
         int hwreg2 = move_reg_to_hw(builder, second);
-        append_x86_64_cmp_reg_reg(&builder->buffer, hwreg1, hwreg2);
+        emit_extend_in_place(builder, hwreg2, size, is_signed);
+        append_x86_64_cmp_reg_reg(&builder->buffer, w, hwreg1, hwreg2);
     }
-    size_t offset = append_x86_64_jmp_cond_marker(&builder->buffer, X86_64_COND_EQ);
-    append_reloc_label_target(builder, marker, offset);
+    return x86_64_cond(comparison);
+}
+
+void x86_64_branch_if(void *fun, Comparison comparison, Marker marker, Reg first, Reg second) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    assert(marker.id < builder->labels.length);
+    int64_t a, b;
+    if (literal_operands(builder, first, second, &a, &b)) {
+        // Known at build time: an unconditional branch, or just the fallthrough.
+        if (fold_comparison(comparison, operand_type(builder, first, second).size, a, b)) {
+            x86_64_branch(builder, marker);
+        } else {
+            builder->fallthrough_block = builder->block;
+            builder->block = NULL;
+        }
+        return;
+    }
+    int cond = emit_compare(builder, comparison, first, second);
+    size_t num_moves;
+    X86_64_Move *moves = label_edge_moves(builder, &builder->labels.ptr[marker.id], &num_moves);
+    if (num_moves == 0) {
+        size_t offset = append_x86_64_jmp_cond_marker(&builder->buffer, cond);
+        append_reloc_label_target(builder, marker, offset);
+    } else {
+        // The moves only happen on the taken edge: jump over them otherwise.
+        Marker skip = x86_64_label_marker(builder);
+        size_t offset = append_x86_64_jmp_cond_marker(&builder->buffer, cond ^ 1);
+        append_reloc_label_target(builder, skip, offset);
+        emit_parallel_move(builder, moves, num_moves);
+        offset = append_x86_64_jmp_marker(&builder->buffer);
+        append_reloc_label_target(builder, marker, offset);
+        builder->labels.ptr[skip.id].offset = builder->buffer.offset;
+    }
+    free(moves);
+    builder->fallthrough_block = builder->block;
     builder->block = NULL;
 }
 
+void x86_64_branch_if_equal(void *fun, Marker marker, Reg first, Reg second) {
+    x86_64_branch_if(fun, COMPARE_EQ, marker, first, second);
+}
+
+// 1 if the comparison holds, 0 otherwise.
+Reg x86_64_compare(void *fun, Comparison comparison, Reg first, Reg second, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, first, second, &a, &b)) {
+        Reg reg = emit_literal(builder, type(8), fold_comparison(comparison, operand_type(builder, first, second).size, a, b));
+        release_regs(builder, discards);
+        return reg;
+    }
+    int cond = emit_compare(builder, comparison, first, second);
+    // Only movs from here on, which leave the flags alone.
+    builder->keep_flags = true;
+    release_regs(builder, discards);
+    Reg reg = alloc_next_reg(builder, type(8));
+    int hwret = alloc_hwreg(builder, reg);
+    set_reg_in_hwreg(builder, reg, hwret);
+    append_x86_64_setcc_reg(&builder->buffer, cond, hwret);
+    builder->keep_flags = false;
+    return reg;
+}
+
+// if_true if the comparison holds, if_false otherwise.
+Reg x86_64_select(void *fun, Comparison comparison, Reg first, Reg second, Reg if_true, Reg if_false, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    int64_t a, b;
+    if (literal_operands(builder, first, second, &a, &b)) {
+        bool holds = fold_comparison(comparison, operand_type(builder, first, second).size, a, b);
+        return emit_copy(builder, operand_type(builder, if_true, if_false), holds ? if_true : if_false, discards);
+    }
+    use_reg(builder, if_true);
+    use_reg(builder, if_false);
+    int cond = emit_compare(builder, comparison, first, second);
+    // Only movs from here on, which leave the flags alone.
+    builder->keep_flags = true;
+    int hw_true = move_reg_to_hw(builder, if_true);
+    Type result_type = operand_type(builder, if_true, if_false);
+    Reg reg = alloc_next_reg(builder, result_type);
+    RegRow *false_row = &builder->block->registers.ptr[if_false.id];
+    int hwret;
+    if (false_row->location == LOC_CPU && if_false.id != if_true.id && reglist_contains(discards, if_false)) {
+        hwret = false_row->hw_reg;
+        release_reg(builder, if_false);
+        set_reg_in_hwreg(builder, reg, hwret);
+    } else {
+        hwret = alloc_hwreg(builder, reg);
+        set_reg_in_hwreg(builder, reg, hwret);
+        copy_reg_to_hw(builder, hwret, if_false);
+    }
+    if (is_xmm_type(result_type)) {
+        // There's no cmov for xmm registers: jump over a movaps.
+        append_x86_64_jmp_rel8(&builder->buffer, cond ^ 1, 0);
+        size_t start = builder->buffer.offset;
+        append_x86_64_movaps_reg_reg(&builder->buffer, hwret, hw_true);
+        builder->buffer.ptr[start - 1] = builder->buffer.offset - start;
+    } else {
+        append_x86_64_cmov_reg_reg(&builder->buffer, result_type.size == 8, cond, hwret, hw_true);
+    }
+    builder->keep_flags = false;
+    release_regs(builder, discards);
+    return reg;
+}
+
+/**
+ * Get the base and index of an address into hwregs.
+ * A literal index is folded into the offset if the sum fits.
+ */
+X86_64_Address emit_address(X86_64_Function_Builder *builder, Address address) {
+    X86_64_Address result = { -1, -1, address.scale, address.offset };
+    // The upper bits of narrower values would be undefined.
+    assert(builder->block->registers.ptr[address.base.id].type.size == 8);
+    assert(!IS_VALID_REG(address.index) || builder->block->registers.ptr[address.index.id].type.size == 8);
+    use_reg(builder, address.base);
+    if (IS_VALID_REG(address.index)) {
+        use_reg(builder, address.index);
+        RegRow *row = &builder->block->registers.ptr[address.index.id];
+        int64_t offset = fits_imm32(row) ? row->value * address.scale + address.offset : INT64_MAX;
+        if (offset >= INT32_MIN && offset <= INT32_MAX) {
+            result.offset = offset;
+        } else {
+            result.index_reg = move_reg_to_hw(builder, address.index);
+        }
+    }
+    result.base_reg = move_reg_to_hw(builder, address.base);
+    return result;
+}
+
+Reg x86_64_load(void *fun, Address address, Type value_type, bool sign_extend, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    X86_64_Address hwaddress = emit_address(builder, address);
+    bool xmm = is_xmm_type(value_type);
+    Reg reg = alloc_next_reg(builder, xmm ? value_type : type(8));
+    // The address is read before the result is written, so it can take over the hwreg of a dead base or index.
+    int hwret = -1;
+    Reg operands[2] = { address.base, address.index };
+    for (int i = 0; i < 2 && hwret == -1 && !xmm; i++) {
+        if (!IS_VALID_REG(operands[i]) || !reglist_contains(discards, operands[i])) continue;
+        RegRow *row = &builder->block->registers.ptr[operands[i].id];
+        if (row->location != LOC_CPU) continue;
+        hwret = row->hw_reg;
+        release_reg(builder, operands[i]);
+    }
+    if (hwret == -1) hwret = alloc_hwreg(builder, reg);
+    set_reg_in_hwreg(builder, reg, hwret);
+    if (xmm) {
+        append_x86_64_load_xmm_address(&builder->buffer, hwret, hwaddress, value_type.size);
+    } else {
+        append_x86_64_load_address(&builder->buffer, hwret, hwaddress, value_type.size, sign_extend);
+    }
+    release_regs(builder, discards);
+    return reg;
+}
+
+void x86_64_store(void *fun, Address address, Reg value, Type value_type, RegList discards) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    begin_op(builder);
+    use_reg(builder, value);
+    X86_64_Address hwaddress = emit_address(builder, address);
+    RegRow *row = &builder->block->registers.ptr[value.id];
+    assert(row->location == LOC_LITERAL || value_type.size <= row->type.size);
+    assert(!is_xmm_type(value_type) || (value_type.kind == row->type.kind && value_type.size == row->type.size));
+    // Narrow stores only need the low bits of a literal. Float literals are stored as their bits.
+    if (fits_imm32(row) || (row->location == LOC_LITERAL && value_type.size < 8)) {
+        append_x86_64_store_address_imm(&builder->buffer, hwaddress, (int32_t) row->value, value_type.size);
+    } else if (is_xmm_type(row->type)) {
+        int hwvalue = move_reg_to_hw(builder, value);
+        append_x86_64_store_xmm_address(&builder->buffer, hwaddress, hwvalue, value_type.size);
+    } else {
+        int hwvalue = move_reg_to_hw(builder, value);
+        append_x86_64_store_address(&builder->buffer, hwaddress, hwvalue, value_type.size);
+    }
+    release_regs(builder, discards);
+}
+
 void x86_64_label(void *fun, Marker marker) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
     assert(marker.id < builder->labels.length);
-    builder->labels.ptr[marker.id] = builder->buffer.offset;
+    Label *label = &builder->labels.ptr[marker.id];
+    assert(label->offset == -1);
+    if (!label->state) {
+        label->state = label_state(&builder->arena, builder->block);
+    } else if (builder->reachable) {
+        // we fall into the label from the preceding code
+        emit_state_transfer(builder, builder->block, label->state, true);
+    }
+    // Continue with the label's state, which is all that later edges establish: the block's stack copies may not be
+    // there when they jump here. Update in place, since the block may be used as a pred_bb later.
+    copy_block(&builder->arena, builder->block, label->state);
+    label->offset = builder->buffer.offset;
+    builder->reachable = true;
+    // Code jumping here expects the call to return.
+    builder->last_call.end = -1;
 }
 
 void x86_64_discard(void *fun, RegList discards) {
-    // TODO
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    release_regs(builder, discards);
+}
+
+void x86_64_hint_next_use(void *fun, Reg reg, int position) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    if (!builder->block || !IS_VALID_REG(reg) || reg.id >= builder->block->registers.length) return;
+    builder->block->registers.ptr[reg.id].next_use = position;
+}
+
+// Allocatable hwregs by index, callee-saved ones first. r11 is left out: calls use it for their target.
+int x86_64_assignable_regs[13] = {
+    X86_64_RBX, X86_64_R12, X86_64_R13, X86_64_R14, X86_64_R15,
+    X86_64_RAX, X86_64_RCX, X86_64_RDX, X86_64_RSI, X86_64_RDI, X86_64_R8, X86_64_R9, X86_64_R10,
+};
+
+int x86_64_get_registers(Type type, int *count, int *preserved) {
+    if (is_xmm_type(type)) {
+        *count = 16;
+        *preserved = 0;
+        return 1;
+    }
+    *count = 13;
+    *preserved = 5;
+    return 0;
+}
+
+void x86_64_hint_register(void *fun, Reg reg, int index) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    if (!builder->block || !IS_VALID_REG(reg) || reg.id >= builder->block->registers.length) return;
+    RegRow *row = &builder->block->registers.ptr[reg.id];
+    if (index == -1) row->assigned = -1;
+    else row->assigned = 1 + (is_xmm_type(row->type) ? index : x86_64_assignable_regs[index]);
 }
 
 void x86_64_debug_dump(void *fun) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
-    Buffer *buffer = &builder->buffer;
-    printf("function generated by x86-64 backend: %i bytes\n", (int) buffer->offset);
-    for (int i = 0; i < buffer->offset; i += 8) {
-        for (int k = i; k < ((i + 8 < buffer->offset) ? (i + 8) : buffer->offset); k++) {
-            printf("%02x ", buffer->ptr[k]);
+    // Link hands the buffer back to the module for reuse: from then on, dump the linked code.
+    union pedantic_convert convert;
+    convert.funcptr = builder->funcptr;
+    unsigned char *code = builder->funcptr ? (unsigned char*) convert.ptr : builder->buffer.ptr;
+    size_t length = builder->funcptr ? builder->code_size : builder->buffer.offset;
+    printf("function generated by x86-64 backend: %i bytes\n", (int) length);
+    for (size_t i = 0; i < length; i += 8) {
+        for (size_t k = i; k < ((i + 8 < length) ? (i + 8) : length); k++) {
+            printf("%02x ", code[k]);
         }
         printf("\n");
     }
 }
 
+int callee_save_area_size(X86_64_Function_Builder *builder) {
+    return 8 * __builtin_popcount(builder->callee_saved_used);
+}
+
+int frame_size(X86_64_Function_Builder *builder) {
+    // spill slots grow up from rsp, callee-saved slots down from rbp.
+    int size = builder->frame_high_water_mark + callee_save_area_size(builder);
+    // round-up to 16 to maintain x86-64 stack alignment
+    return ((size + 15) / 16) * 16;
+}
+
+void x86_64_get_stats(void *fun, FunctionStats *stats) {
+    X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
+    *stats = (FunctionStats) {
+        .code_size = builder->buffer.ptr ? builder->buffer.offset : builder->code_size,
+        .frame_size = frame_size(builder),
+        .spills = builder->spills,
+        .reloads = builder->reloads,
+    };
+    memcpy(stats->peephole_hits, builder->peephole_hits, sizeof(stats->peephole_hits));
+}
+
+/**
+ * Code that can get shorter on finalize: a branch, which can use a rel8 if its label is close enough,
+ * or the padding after a patched placeholder, which can be dropped.
+ */
+typedef struct {
+    size_t offset;
+    size_t length;
+    size_t new_length;
+    // Branches only: the label, and the condition, or -1 for jmp.
+    Marker label;
+    int cond;
+} X86_64_Shrinkable;
+
+typedef struct {
+    size_t length;
+    X86_64_Shrinkable *ptr;
+} X86_64_Shrinkables;
+
+void append_shrinkable(X86_64_Arena *arena, X86_64_Shrinkables *shrinkables, X86_64_Shrinkable shrinkable) {
+    shrinkables->ptr = grow_list(arena, shrinkables->ptr, shrinkables->length, shrinkables->length + 1, sizeof(X86_64_Shrinkable));
+    shrinkables->ptr[shrinkables->length++] = shrinkable;
+}
+
+void append_padding_shrinkable(X86_64_Arena *arena, X86_64_Shrinkables *shrinkables, size_t placeholder_offset, size_t used) {
+    if (used == X86_64_CALLEE_SAVE_SIZE) return;
+    append_shrinkable(arena, shrinkables, (X86_64_Shrinkable) {
+        .offset = placeholder_offset + used,
+        .length = X86_64_CALLEE_SAVE_SIZE - used,
+        .new_length = 0,
+        .label = { -1 },
+    });
+}
+
+int compare_shrinkables(const void *a, const void *b) {
+    size_t offset_a = ((X86_64_Shrinkable*) a)->offset, offset_b = ((X86_64_Shrinkable*) b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// saved[i] is the number of bytes saved by the first i shrinkables.
+void sum_savings(X86_64_Shrinkables *shrinkables, size_t *saved) {
+    saved[0] = 0;
+    for (int i = 0; i < shrinkables->length; i++) {
+        X86_64_Shrinkable *shrinkable = &shrinkables->ptr[i];
+        saved[i + 1] = saved[i] + shrinkable->length - shrinkable->new_length;
+    }
+}
+
+// Where the code at 'offset' ends up after shrinking.
+size_t relaxed_offset(X86_64_Shrinkables *shrinkables, size_t *saved, size_t offset) {
+    // binary search for the number of shrinkables starting before offset
+    size_t low = 0, high = shrinkables->length;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (shrinkables->ptr[mid].offset < offset) low = mid + 1;
+        else high = mid;
+    }
+    return offset - saved[low];
+}
+
+void append_removed_shrinkable(X86_64_Arena *arena, X86_64_Shrinkables *shrinkables, size_t offset, size_t length) {
+    append_shrinkable(arena, shrinkables, (X86_64_Shrinkable) {
+        .offset = offset,
+        .length = length,
+        .new_length = 0,
+        .label = { -1 },
+    });
+}
+
+/**
+ * A register move with the same effect as reloading a value of 'size' into to_reg, right after it was
+ * stored from from_reg. Loads zero the rest of the register, so the move has to as well: a 64-bit value,
+ * a 32-bit mov, movq or movaps. Returns false if there's none.
+ */
+bool append_x86_64_reload_move(Buffer *buffer, bool xmm, int size, int to_reg, int from_reg) {
+    if (!xmm && size == 8) {
+        append_x86_64_set_reg_reg(buffer, to_reg, from_reg);
+    } else if (!xmm && size == 4) {
+        append_x86_64_op_r_reg_reg(buffer, false, 0x89, to_reg, from_reg);
+    } else if (xmm && size == 8) {
+        append_x86_64_sse_reg_reg(buffer, 0xF3, false, 0x7E, to_reg, from_reg);
+    } else if (xmm && size == 16) {
+        append_x86_64_movaps_reg_reg(buffer, to_reg, from_reg);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Remove the moves the one-pass emitter leaves behind (see PeepholePattern), by comparing each
+ * recorded move with the one right before it. A move can only be taken out, or made cheaper,
+ * based on the one before it if there's no label at it: a jump can get there with other values.
+ * Removed code becomes shrinkables, so relax_function moves labels and relocations along.
+ * Code that jumps over recorded moves with a jump of its own would have to use a label.
+ */
+void peephole_function(X86_64_Function_Builder *builder, X86_64_Shrinkables *shrinkables) {
+    X86_64_Recorded_Moves *moves = &builder->moves;
+    if (moves->length < 2) return;
+    // Moves are recorded in code order.
+    bool *labelled = arena_calloc(&builder->arena, moves->length * sizeof(bool));
+    for (int i = 0; i < builder->labels.length; i++) {
+        size_t offset = builder->labels.ptr[i].offset;
+        size_t low = 0, high = moves->length;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (moves->ptr[mid].offset < offset) low = mid + 1;
+            else high = mid;
+        }
+        if (low < moves->length && moves->ptr[low].offset == offset) labelled[low] = true;
+    }
+    X86_64_Recorded_Move *prev = NULL;
+    // Where the code after prev starts, past the moves removed since, and if any of them had a label.
+    size_t prev_end = 0;
+    bool label_since = false;
+    for (size_t i = 0; i < moves->length; i++) {
+        X86_64_Recorded_Move *move = &moves->ptr[i];
+        bool follows = prev && prev_end == move->offset && prev->to.xmm == move->to.xmm;
+        bool reached = label_since || labelled[i];
+        if (follows && !reached && prev->to.stack && same_location(move->from, prev->to)) {
+            // mov [slot], a; mov b, [slot]
+            assert(move->size == prev->size);
+            builder->peephole_hits[PEEPHOLE_SPILL_RELOAD]++;
+            builder->reloads--;
+            if (move->to.index == prev->from.index && move->size == (move->to.xmm ? 16 : 8)) {
+                append_removed_shrinkable(&builder->arena, shrinkables, move->offset, move->length);
+                prev_end = move->offset + move->length;
+                continue;
+            }
+            unsigned char bytes[X86_64_MAX_INSTRUCTION];
+            Buffer patcher = { bytes, sizeof(bytes), 0 };
+            if (append_x86_64_reload_move(&patcher, move->to.xmm, move->size, move->to.index, prev->from.index)) {
+                assert(patcher.offset < move->length);
+                memcpy(builder->buffer.ptr + move->offset, bytes, patcher.offset);
+                append_removed_shrinkable(&builder->arena, shrinkables, move->offset + patcher.offset, move->length - patcher.offset);
+                // A narrower move isn't the same as the load in every pattern: start over after it.
+                prev = NULL;
+                continue;
+            }
+            builder->peephole_hits[PEEPHOLE_SPILL_RELOAD]--;
+            builder->reloads++;
+        } else if (follows && !reached && same_location(move->to, prev->from) && same_location(move->from, prev->to)) {
+            // mov a, b; mov b, a: a store back to the slot a value was just loaded from writes the same bytes.
+            builder->peephole_hits[PEEPHOLE_MOVE_BACK]++;
+            if (move->to.stack) builder->spills--;
+            append_removed_shrinkable(&builder->arena, shrinkables, move->offset, move->length);
+            prev_end = move->offset + move->length;
+            label_since |= labelled[i];
+            continue;
+        } else if (follows && same_location(move->to, prev->to) && !same_location(move->from, prev->to)) {
+            // mov a, b; mov a, c: stack slots only hold values of one size, so a store overwrites all of the last one.
+            builder->peephole_hits[PEEPHOLE_DEAD_MOVE]++;
+            if (prev->to.stack) builder->spills--;
+            else if (prev->from.stack) builder->reloads--;
+            append_removed_shrinkable(&builder->arena, shrinkables, prev->offset, prev->length);
+        }
+        prev = move;
+        prev_end = move->offset + move->length;
+        label_since = false;
+    }
+}
+
+/**
+ * Shrink branches to rel8 where they fit and drop placeholder padding and the given shrinkables, then rewrite the buffer
+ * and everything that points into it. Shrinking only ever brings code closer together,
+ * so we repeat until no more branches fit.
+ */
+void relax_function(X86_64_Function_Builder *builder, X86_64_Shrinkables shrinkables,
+                    size_t callee_save_length, size_t callee_restore_length) {
+    Buffer *buffer = &builder->buffer;
+    append_padding_shrinkable(&builder->arena, &shrinkables, builder->callee_save_offset, callee_save_length);
+    for (int i = 0; i < builder->callee_restore_offsets.length; i++) {
+        append_padding_shrinkable(&builder->arena, &shrinkables, builder->callee_restore_offsets.ptr[i], callee_restore_length);
+    }
+    for (int i = 0; i < builder->label_targets.length; i++) {
+        RelocTarget *target = &builder->label_targets.ptr[i];
+        // the rel32 follows the opcode: E9 for jmp, 0F 8x for jcc.
+        bool is_jmp = buffer->ptr[target->offset - 1] == 0xE9;
+        size_t length = is_jmp ? 5 : 6;
+        assert(is_jmp || buffer->ptr[target->offset - 2] == 0x0F);
+        append_shrinkable(&builder->arena, &shrinkables, (X86_64_Shrinkable) {
+            .offset = target->offset + 4 - length,
+            .length = length,
+            .new_length = length,
+            .label = target->marker,
+            .cond = is_jmp ? -1 : buffer->ptr[target->offset - 1] - 0x80,
+        });
+    }
+    if (shrinkables.length == 0) return;
+    qsort(shrinkables.ptr, shrinkables.length, sizeof(X86_64_Shrinkable), compare_shrinkables);
+
+    size_t *saved = arena_alloc(&builder->arena, (shrinkables.length + 1) * sizeof(size_t));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        sum_savings(&shrinkables, saved);
+        for (int i = 0; i < shrinkables.length; i++) {
+            X86_64_Shrinkable *shrinkable = &shrinkables.ptr[i];
+            if (shrinkable->label.id == -1 || shrinkable->new_length == 2) continue;
+            size_t label = builder->labels.ptr[shrinkable->label.id].offset;
+            assert(label != -1);
+            int64_t rel = (int64_t) relaxed_offset(&shrinkables, saved, label)
+                - (int64_t) (relaxed_offset(&shrinkables, saved, shrinkable->offset) + 2);
+            if (rel >= INT8_MIN && rel <= INT8_MAX) {
+                shrinkable->new_length = 2;
+                changed = true;
+            }
+        }
+    }
+
+    // Rewrite in place: the relaxed code never gets ahead of the code it's read from.
+    // Reads go through relaxed.ptr too, since encoding a jump may still grow the buffer.
+    Buffer relaxed = *buffer;
+    relaxed.offset = 0;
+    size_t copied = 0;
+    for (int i = 0; i < shrinkables.length; i++) {
+        X86_64_Shrinkable *shrinkable = &shrinkables.ptr[i];
+        memmove(relaxed.ptr + relaxed.offset, relaxed.ptr + copied, shrinkable->offset - copied);
+        relaxed.offset += shrinkable->offset - copied;
+        copied = shrinkable->offset + shrinkable->length;
+        if (shrinkable->label.id == -1) continue;
+        int64_t label = relaxed_offset(&shrinkables, saved, builder->labels.ptr[shrinkable->label.id].offset);
+        int64_t end = relaxed.offset + shrinkable->new_length;
+        if (shrinkable->new_length == 2) {
+            append_x86_64_jmp_rel8(&relaxed, shrinkable->cond, label - end);
+        } else {
+            append_x86_64_jmp_rel32(&relaxed, shrinkable->cond, label - end);
+        }
+    }
+    memmove(relaxed.ptr + relaxed.offset, relaxed.ptr + copied, buffer->offset - copied);
+    relaxed.offset += buffer->offset - copied;
+    assert(relaxed.offset == relaxed_offset(&shrinkables, saved, buffer->offset));
+
+    // Label targets are resolved now; everything else moves along.
+    builder->label_targets.length = 0;
+    for (int i = 0; i < builder->labels.length; i++) {
+        Label *label = &builder->labels.ptr[i];
+        if (label->offset != -1) label->offset = relaxed_offset(&shrinkables, saved, label->offset);
+    }
+    RelocTargets *reloc_lists[2] = { &builder->near_function_targets, &builder->far_function_targets };
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < reloc_lists[k]->length; i++) {
+            RelocTarget *reloc = &reloc_lists[k]->ptr[i];
+            reloc->offset = relaxed_offset(&shrinkables, saved, reloc->offset);
+        }
+    }
+    builder->frame_sub_offset = relaxed_offset(&shrinkables, saved, builder->frame_sub_offset);
+    builder->callee_save_offset = relaxed_offset(&shrinkables, saved, builder->callee_save_offset);
+    for (int i = 0; i < builder->callee_restore_offsets.length; i++) {
+        size_t *offset = &builder->callee_restore_offsets.ptr[i];
+        *offset = relaxed_offset(&shrinkables, saved, *offset);
+    }
+    *buffer = relaxed;
+}
+
 void x86_64_finalize_function(void *fun) {
     X86_64_Function_Builder *builder = (X86_64_Function_Builder*) fun;
     assert(builder->block == NULL);
+    // Patch the placeholders. The encoders write into a buffer of their own, then it's copied over:
+    // they may grow the buffer they're given, which mustn't happen to a copy of the builder's.
+    unsigned char bytes[64];
+    Buffer patcher = { bytes, sizeof(bytes), 0 };
     // patch stackframe allocation
-    {
-        // round-up to 16 to maintain x86-64 stack alignment
-        int frame_size = ((builder->frame_high_water_mark + 15) / 16) * 16;
-        Buffer patcher = builder->buffer;
-        patcher.offset = builder->frame_sub_offset;
-        append_x86_64_sub_reg_imm(&patcher, X86_64_RSP, frame_size);
-    }
-    // patch jump labels
-    for (int i = 0; i < builder->label_targets.length; i++) {
-        RelocTarget *target = &builder->label_targets.ptr[i];
-        size_t label = builder->labels.ptr[target->marker.id];
-        assert(label != -1);
-        Buffer patcher = builder->buffer;
-        patcher.offset = target->offset;
-        // reloffs starts after the instr
-        append_x86_64_imm_w(&patcher, label - (patcher.offset + 4));
+    append_x86_64_sub_reg_imm(&patcher, true, X86_64_RSP, frame_size(builder));
+    memcpy(builder->buffer.ptr + builder->frame_sub_offset, bytes, patcher.offset);
+    // patch callee-saved register saves and restores
+    size_t callee_save_length, callee_restore_length = 0;
+    patcher.offset = 0;
+    callee_save_length = append_x86_64_callee_saves(&patcher, builder->callee_saved_used, false);
+    memcpy(builder->buffer.ptr + builder->callee_save_offset, bytes, patcher.offset);
+    patcher.offset = 0;
+    callee_restore_length = append_x86_64_callee_saves(&patcher, builder->callee_saved_used, true);
+    for (int i = 0; i < builder->callee_restore_offsets.length; i++) {
+        memcpy(builder->buffer.ptr + builder->callee_restore_offsets.ptr[i], bytes, patcher.offset);
+    }
+    // remove redundant moves, then shrink and resolve jumps to labels
+    X86_64_Shrinkables removed = {0};
+    if (builder->peephole) peephole_function(builder, &removed);
+    relax_function(builder, removed, callee_save_length, callee_restore_length);
+    builder->code_size = builder->buffer.offset;
+    X86_64_Module *module = (X86_64_Module*) builder->module;
+    // The register states, labels and the rest of the builder's arena are no longer needed:
+    // the next function can have it, once the relocations are copied to the module.
+    builder->args = (Args) {0};
+    builder->slot_sizes = (SlotSizes) {0};
+    builder->labels = (Labels) {0};
+    builder->label_targets = (RelocTargets) {0};
+    builder->callee_restore_offsets = (Offsets) {0};
+    builder->moves = (X86_64_Recorded_Moves) {0};
+    pthread_mutex_lock(&module->lock);
+    module->code_emitted += builder->code_size;
+    module->functions_emitted++;
+    RelocTargets *reloc_lists[2] = { &builder->near_function_targets, &builder->far_function_targets };
+    for (int k = 0; k < 2; k++) {
+        if (!reloc_lists[k]->length) continue;
+        RelocTarget *targets = arena_alloc(&module->arena, reloc_lists[k]->length * sizeof(RelocTarget));
+        memcpy(targets, reloc_lists[k]->ptr, reloc_lists[k]->length * sizeof(RelocTarget));
+        reloc_lists[k]->ptr = targets;
     }
+    pthread_mutex_unlock(&module->lock);
+    arena_reset(&builder->arena);
+    pthread_mutex_lock(&module->lock);
+    bool spare = !module->spare_arena.chunk;
+    if (spare) module->spare_arena = builder->arena;
+    pthread_mutex_unlock(&module->lock);
+    if (!spare) arena_free(&builder->arena);
+    builder->arena = (X86_64_Arena) {0};
 }
 
 void (*x86_64_get_funcptr(void *fun))() {
@@ -814,22 +4636,66 @@ void (*x86_64_get_funcptr(void *fun))() {
     return builder->funcptr;
 }
 
-Marker x86_64_declare_function(void *module_) {
-    X86_64_Module *module = (X86_64_Module*) module_;
-    return (Marker) {module->next_marker++};
-}
-
 Backend *create_backend_x86_64() {
+    x86_64_cpu_features = detect_x86_64_cpu_features();
     Backend *backend = malloc(sizeof(Backend));
     *backend = (Backend) {
         .declare_function = x86_64_declare_function,
+        .declare_lazy_function = x86_64_declare_lazy_function,
+        .declare_tiered_function = x86_64_declare_tiered_function,
+        .import_function = x86_64_import_function,
         .new_module = x86_64_new_module,
+        .get_cpu_features = x86_64_get_cpu_features,
+        .set_cpu_features = x86_64_set_cpu_features,
+        .set_peephole = x86_64_set_peephole,
+        .set_link_threads = x86_64_set_link_threads,
+        .set_tier_threshold = x86_64_set_tier_threshold,
         .new_function = x86_64_new_function,
         .immediate_void = x86_64_immediate_void,
+        .immediate_int32 = x86_64_immediate_int32,
         .immediate_int64 = x86_64_immediate_int64,
         .immediate_function = x86_64_immediate_function,
         .add = x86_64_add,
         .sub = x86_64_sub,
+        .mul = x86_64_mul,
+        .div = x86_64_div,
+        .rem = x86_64_rem,
+        .udiv = x86_64_udiv,
+        .urem = x86_64_urem,
+        .bit_and = x86_64_bit_and,
+        .bit_or = x86_64_bit_or,
+        .bit_xor = x86_64_bit_xor,
+        .shl = x86_64_shl,
+        .shr = x86_64_shr,
+        .sar = x86_64_sar,
+        .neg = x86_64_neg,
+        .bit_not = x86_64_bit_not,
+        .and_not = x86_64_and_not,
+        .count_leading_zeros = x86_64_count_leading_zeros,
+        .count_trailing_zeros = x86_64_count_trailing_zeros,
+        .popcount = x86_64_popcount,
+        .zero_extend = x86_64_zero_extend,
+        .sign_extend = x86_64_sign_extend,
+        .truncate = x86_64_truncate,
+        .immediate_float32 = x86_64_immediate_float32,
+        .immediate_float64 = x86_64_immediate_float64,
+        .fadd = x86_64_fadd,
+        .fsub = x86_64_fsub,
+        .fmul = x86_64_fmul,
+        .fdiv = x86_64_fdiv,
+        .fsqrt = x86_64_fsqrt,
+        .fma = x86_64_fma,
+        .convert = x86_64_convert,
+        .vector_add = x86_64_vector_add,
+        .vector_sub = x86_64_vector_sub,
+        .vector_mul = x86_64_vector_mul,
+        .vector_div = x86_64_vector_div,
+        .vector_fma = x86_64_vector_fma,
+        .vector_splat = x86_64_vector_splat,
+        .vector_extract = x86_64_vector_extract,
+        .vector_shuffle = x86_64_vector_shuffle,
+        .load = x86_64_load,
+        .store = x86_64_store,
         .arg = x86_64_arg,
         .discard = x86_64_discard,
         .call = x86_64_call,
@@ -837,11 +4703,21 @@ Backend *create_backend_x86_64() {
         .ret = x86_64_ret,
         .branch = x86_64_branch,
         .branch_if_equal = x86_64_branch_if_equal,
+        .branch_if = x86_64_branch_if,
+        .compare = x86_64_compare,
+        .select = x86_64_select,
         .label = x86_64_label,
+        .hint_next_use = x86_64_hint_next_use,
+        .get_registers = x86_64_get_registers,
+        .hint_register = x86_64_hint_register,
         .debug_dump = x86_64_debug_dump,
+        .get_stats = x86_64_get_stats,
         .finalize_function = x86_64_finalize_function,
         .link = x86_64_link_module,
+        .free_module = x86_64_free_module,
+        .get_heap_stats = x86_64_get_heap_stats,
         .get_funcptr = x86_64_get_funcptr,
+        .get_function = x86_64_get_function,
         .label_marker = x86_64_label_marker,
     };
     return backend;